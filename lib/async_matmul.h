@@ -0,0 +1,337 @@
+#include "epilogue.h"
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "parallel_matmul.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifndef __ASYNC_MATMUL_H__
+#define __ASYNC_MATMUL_H__
+
+using algo::epilogue::Epilogue;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace async {
+
+// Asynchronous GEMM submission. submit() queues C = epilogue(A @ B) and
+// returns at once with a Token to wait on; a dispatcher thread runs the jobs
+// on the global pool as their inputs become ready.
+//
+//  - Dependencies: a job may list Tokens of earlier jobs (say, the one that
+//    writes its A). It becomes ready the moment the last of them completes,
+//    so a chain of layers pipelines behind independent work with no barrier.
+//  - Batching: ready jobs below small_flop each run single threaded and
+//    side by side, one per worker, in a single parallel_for, the way
+//    batched_matmul does. Larger jobs get the whole pool one at a time, in
+//    row slices of about slice_flop, so no small job waits for more than a
+//    slice however large the GEMM in front of it.
+//  - Ordering: ready jobs are kept in submission order, but a batch of small
+//    ones may go ahead of an older large one, at most max_bypass times, so
+//    short requests do not queue behind long ones and long ones still make
+//    progress; the count restarts with each slice. Tail latency of the small
+//    requests is what this buys.
+//
+// Views are borrowed: A, B and C must stay alive and untouched (except by
+// dependent jobs, through their tokens) until the job completes. Tokens
+// passed as dependencies must come from the same queue.
+
+struct QueueOptions {
+  // Pool workers used for each large job or batch, 0 meaning all of them
+  uint32_t threads = 0;
+  // Jobs of fewer flops (2 M N K) are batched, 2 * 128^3 by default
+  double small_flop = 2.0 * 128 * 128 * 128;
+  // Rows of a large job run between two looks at the queue: about this many
+  // flops, 2 * 512^3 by default, but at least min_slice_rows, since every
+  // slice packs all of B again
+  double slice_flop = 2.0 * 512 * 512 * 512;
+  uint32_t min_slice_rows = 256;
+  // Most small jobs run in one batch
+  uint32_t max_batch = 64;
+  // Times the oldest large job may be passed over by a batch of small ones
+  uint32_t max_bypass = 2;
+};
+
+class GemmQueue;
+
+namespace detail {
+
+struct Job {
+  MatrixView<const float> A, B;
+  MatrixView<float> C;
+  Epilogue epilogue;
+  double flop;
+
+  std::promise<void> promise;
+  std::shared_future<void> future;
+
+  // Guarded by the queue's lock
+  uint32_t pending = 0;
+  uint32_t bypassed = 0;
+  // Rows of C done so far, for large jobs run in slices
+  uint32_t nextRow = 0;
+  bool done = false;
+  std::exception_ptr error;
+  std::vector<std::shared_ptr<Job>> dependents;
+
+  Job(MatrixView<const float> A, MatrixView<const float> B,
+      MatrixView<float> C, const Epilogue &epilogue)
+      : A(A), B(B), C(C), epilogue(epilogue),
+        flop(2.0 * C.get_height() * C.get_width() * A.get_width()),
+        future(promise.get_future().share()) {}
+};
+
+} // namespace detail
+
+// Completion handle of a submitted job. Copies share the job; waiting
+// rethrows whatever the GEMM, or a job it depends on, threw.
+class Token {
+public:
+  Token() = default;
+
+  void wait() const { _job->future.get(); }
+
+  bool ready() const {
+    return _job->future.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  const std::shared_future<void> &future() const { return _job->future; }
+
+  bool valid() const { return _job != nullptr; }
+
+private:
+  friend class GemmQueue;
+  explicit Token(std::shared_ptr<detail::Job> job) : _job(std::move(job)) {}
+
+  std::shared_ptr<detail::Job> _job;
+};
+
+class GemmQueue {
+public:
+  explicit GemmQueue(const QueueOptions &options = QueueOptions())
+      : _options(options), _dispatcher(&GemmQueue::dispatchLoop, this) {}
+
+  // Runs every job already submitted, then stops
+  ~GemmQueue() {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _stop = true;
+    }
+    _wake.notify_all();
+    _dispatcher.join();
+  }
+
+  GemmQueue(const GemmQueue &) = delete;
+  GemmQueue &operator=(const GemmQueue &) = delete;
+
+  // Queues C = epilogue(A @ B) to run once every job in `after` is done.
+  // Throws std::invalid_argument, queueing nothing, if a token in `after` is
+  // default constructed.
+  Token submit(MatrixView<const float> A, MatrixView<const float> B,
+               MatrixView<float> C, const std::vector<Token> &after = {},
+               const Epilogue &epilogue = Epilogue()) {
+    for (const Token &token : after) {
+      if (!token.valid()) {
+        throw std::invalid_argument("GemmQueue::submit: dependency on an "
+                                    "empty Token");
+      }
+    }
+    auto job = std::make_shared<detail::Job>(A, B, C, epilogue);
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      for (const Token &token : after) {
+        detail::Job &dependency = *token._job;
+        if (!dependency.done) {
+          dependency.dependents.push_back(job);
+          job->pending++;
+        } else if (dependency.error && !job->error) {
+          job->error = dependency.error;
+        }
+      }
+      _outstanding++;
+      if (job->pending == 0) {
+        _ready.push_back(job);
+      }
+    }
+    _wake.notify_all();
+    return Token(job);
+  }
+
+  Token submit(MatrixView<const float> A, MatrixView<const float> B,
+               MatrixView<float> C, const Epilogue &epilogue) {
+    return submit(A, B, C, {}, epilogue);
+  }
+
+  // Blocks until every job submitted so far has completed
+  void wait_all() {
+    std::unique_lock<std::mutex> lock(_lock);
+    _idle.wait(lock, [&] { return _outstanding == 0; });
+  }
+
+private:
+  using JobPtr = std::shared_ptr<detail::Job>;
+
+  bool isSmall(const detail::Job &job) const {
+    return job.flop < _options.small_flop;
+  }
+
+  // Takes the next jobs to run off _ready: the oldest job alone if it is
+  // large and has waited long enough, otherwise up to max_batch small ones.
+  // Jobs whose inputs failed are taken too and skip running.
+  std::vector<JobPtr> takeBatch() {
+    std::vector<JobPtr> batch;
+    JobPtr oldest = _ready.front();
+    bool anySmall = std::any_of(_ready.begin(), _ready.end(),
+                                [&](const JobPtr &job) { return isSmall(*job); });
+    if (!isSmall(*oldest) &&
+        (!anySmall || oldest->bypassed >= _options.max_bypass)) {
+      _ready.pop_front();
+      batch.push_back(oldest);
+      return batch;
+    }
+
+    for (auto it = _ready.begin();
+         it != _ready.end() && batch.size() < _options.max_batch;) {
+      if (isSmall(**it)) {
+        batch.push_back(*it);
+        it = _ready.erase(it);
+      } else {
+        (*it)->bypassed++;
+        ++it;
+      }
+    }
+    return batch;
+  }
+
+  // Runs a batch of small jobs, or the next slice of a large one. Returns
+  // false if the large job has rows left.
+  bool run(const std::vector<JobPtr> &batch) {
+    ThreadPool &pool = ThreadPool::global();
+    if (batch.size() == 1 && !isSmall(*batch[0])) {
+      detail::Job &job = *batch[0];
+      uint32_t M = job.C.get_height(), N = job.C.get_width();
+      uint32_t K = job.A.get_width();
+      double rowFlop = std::max(2.0 * N * K, 1.0);
+      uint32_t rows = uint32_t(std::min<double>(
+          std::max<double>(_options.slice_flop / rowFlop,
+                           std::max(_options.min_slice_rows, 1u)),
+          M));
+      uint32_t r0 = job.nextRow, r1 = std::min(M, r0 + std::max(rows, 1u));
+      if (!job.error) {
+        try {
+          parallel::packed_matmul_fused_threads(
+              job.A.block(r0, 0, r1 - r0, K), job.B,
+              job.C.block(r0, 0, r1 - r0, N),
+              job.epilogue.block(r0, 0, true, true), _options.threads,
+              _workspace);
+        } catch (...) {
+          job.error = std::current_exception();
+        }
+      }
+      job.nextRow = r1;
+      return job.error || r1 >= M;
+    }
+
+    // One small job per task, each on its worker's own workspace
+    pool.parallel_for(
+        uint32_t(batch.size()),
+        [&](uint32_t task, uint32_t) {
+          detail::Job &job = *batch[task];
+          if (job.error) {
+            return;
+          }
+          try {
+            packed::packed_matmul_fused_ws(job.A, job.B, job.C, job.epilogue,
+                                           Workspace::local());
+          } catch (...) {
+            job.error = std::current_exception();
+          }
+        },
+        _options.threads);
+    return true;
+  }
+
+  // Marks jobs done, passes failures on and releases the dependents whose
+  // last input this was, then fulfils the futures outside the lock
+  void complete(const std::vector<JobPtr> &batch) {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      for (const JobPtr &job : batch) {
+        job->done = true;
+        for (const JobPtr &dependent : job->dependents) {
+          if (job->error && !dependent->error) {
+            dependent->error = job->error;
+          }
+          if (--dependent->pending == 0) {
+            _ready.push_back(dependent);
+          }
+        }
+        job->dependents.clear();
+        _outstanding--;
+      }
+    }
+    for (const JobPtr &job : batch) {
+      if (job->error) {
+        job->promise.set_exception(job->error);
+      } else {
+        job->promise.set_value();
+      }
+    }
+    _idle.notify_all();
+  }
+
+  void dispatchLoop() {
+    std::unique_lock<std::mutex> lock(_lock);
+    while (true) {
+      _wake.wait(lock, [&] { return !_ready.empty() || _stop; });
+      if (_ready.empty()) {
+        // Every waiting job depends on a ready or running one, so an empty
+        // ready list means nothing is left
+        return;
+      }
+
+      std::vector<JobPtr> batch = takeBatch();
+      lock.unlock();
+      if (run(batch)) {
+        complete(batch);
+        lock.lock();
+      } else {
+        // The rest of a large job stays first in line
+        lock.lock();
+        batch[0]->bypassed = 0;
+        _ready.push_front(batch[0]);
+      }
+    }
+  }
+
+  QueueOptions _options;
+  // Scratch of the large jobs, which all run on the dispatcher thread
+  Workspace _workspace;
+
+  std::mutex _lock;
+  std::condition_variable _wake, _idle;
+  std::deque<JobPtr> _ready;
+  uint64_t _outstanding = 0;
+  bool _stop = false;
+
+  std::thread _dispatcher;
+};
+
+} // namespace async
+} // namespace algo
+#endif
@@ -0,0 +1,284 @@
+#include "benchmark.h"
+#include "matrix.h"
+#include "naive_matmul.h"
+#include "packed_matmul.h"
+#include "random_fill.h"
+#include "roofline.h"
+#include <stdint.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+
+using support::Matrix;
+using support::MatrixView;
+
+namespace algo {
+namespace autotune {
+
+using MatmulPtr = void (*)(MatrixView<const float>, MatrixView<const float>,
+                           MatrixView<float>);
+
+struct Candidate {
+  const char *name;
+  MatmulPtr fn;
+};
+
+#define TUNE_CANDIDATE(...)                                                    \
+  Candidate { #__VA_ARGS__, __VA_ARGS__ }
+
+// The search space: every tile size / loop order variant the tuner may pick,
+// instantiated at compile time. The first entry is the untuned default.
+inline const std::vector<Candidate> &candidates() {
+  static const std::vector<Candidate> space = {
+      TUNE_CANDIDATE(algo::packed::packed_matmul<72, 256, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<48, 128, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<48, 256, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<48, 512, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<72, 128, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<72, 384, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<72, 512, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<96, 128, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<96, 256, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<96, 384, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<144, 128, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<144, 256, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<144, 384, 4080>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<72, 256, 1024>),
+      TUNE_CANDIDATE(algo::packed::packed_matmul<144, 256, 1024>),
+      TUNE_CANDIDATE(algo::naive::tiled_ijk_matmul_kij<float, 8, 8, 8>),
+      TUNE_CANDIDATE(algo::naive::tiled_ijk_matmul_kij<float, 16, 16, 16>),
+      TUNE_CANDIDATE(algo::naive::tiled_ijk_matmul_kij<float, 32, 32, 32>),
+      TUNE_CANDIDATE(algo::naive::tiled_ijk_matmul_ijk<float, 8, 8, 8>),
+      TUNE_CANDIDATE(algo::naive::naive_matmul_kij<float>),
+  };
+  return space;
+}
+
+inline const Candidate *findCandidate(const std::string &name) {
+  for (const Candidate &candidate : candidates()) {
+    if (name == candidate.name) {
+      return &candidate;
+    }
+  }
+  return nullptr;
+}
+
+// Best known kernel per (CPU model, dtype, M, N, K), stored one tab separated
+// record per line so it can be shared between hosts of different types.
+class TuningDatabase {
+public:
+  struct Record {
+    std::string kernel;
+    double median_us;
+  };
+
+  bool load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+      return false;
+    }
+
+    // Lines that do not parse are skipped with a warning, so one bad entry
+    // costs a retune of its shape rather than every run
+    std::string line;
+    for (uint32_t number = 1; std::getline(file, line); number++) {
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      std::stringstream stream(line);
+      std::string cpu, dtype, M, N, K, kernel, us;
+      uint32_t m, n, k;
+      double median_us;
+      if (std::getline(stream, cpu, '\t') && std::getline(stream, dtype, '\t') &&
+          std::getline(stream, M, '\t') && std::getline(stream, N, '\t') &&
+          std::getline(stream, K, '\t') && std::getline(stream, kernel, '\t') &&
+          std::getline(stream, us) && parseSize(M, m) && parseSize(N, n) &&
+          parseSize(K, k) && parseTime(us, median_us)) {
+        _records[Key(cpu, dtype, m, n, k)] = {kernel, median_us};
+      } else {
+        std::cerr << path << ":" << number
+                  << ": skipping malformed tuning entry" << std::endl;
+      }
+    }
+    return true;
+  }
+
+  bool save(const std::string &path) const {
+    std::ofstream file(path);
+    file << "# cpu\tdtype\tM\tN\tK\tkernel\tmedian_us" << std::endl;
+    for (const auto &entry : _records) {
+      const Key &key = entry.first;
+      file << std::get<0>(key) << "\t" << std::get<1>(key) << "\t"
+           << std::get<2>(key) << "\t" << std::get<3>(key) << "\t"
+           << std::get<4>(key) << "\t" << entry.second.kernel << "\t"
+           << entry.second.median_us << std::endl;
+    }
+    return bool(file);
+  }
+
+  const Record *lookup(const std::string &cpu, const std::string &dtype,
+                       uint32_t M, uint32_t N, uint32_t K) const {
+    auto it = _records.find(Key(cpu, dtype, M, N, K));
+    return it == _records.end() ? nullptr : &it->second;
+  }
+
+  void record(const std::string &cpu, const std::string &dtype, uint32_t M,
+              uint32_t N, uint32_t K, const Record &best) {
+    _records[Key(cpu, dtype, M, N, K)] = best;
+  }
+
+  size_t size() const { return _records.size(); }
+
+private:
+  using Key = std::tuple<std::string, std::string, uint32_t, uint32_t, uint32_t>;
+
+  // Whole fields only: "12x", "" or "-1" are errors, not 12, 0 or UINT_MAX
+  static bool parseSize(const std::string &text, uint32_t &value) {
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
+      return false;
+    }
+    char *end = nullptr;
+    errno = 0;
+    unsigned long parsed = std::strtoul(text.c_str(), &end, 10);
+    if (*end != '\0' || errno != 0 || parsed > UINT32_MAX) {
+      return false;
+    }
+    value = uint32_t(parsed);
+    return true;
+  }
+
+  static bool parseTime(const std::string &text, double &value) {
+    char *end = nullptr;
+    errno = 0;
+    value = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0' && errno == 0 && std::isfinite(value);
+  }
+  std::map<Key, Record> _records;
+};
+
+// Times every candidate on a random [M, K] @ [K, N] problem and returns the
+// fastest by median. Candidates whose first run is already 4x slower than the
+// best median so far are not timed further. Candidates that disagree with
+// the reference are never picked.
+inline TuningDatabase::Record tuneShape(uint32_t M, uint32_t N, uint32_t K,
+                                        uint32_t repeats = 5,
+                                        bool verbose = false) {
+  Matrix<float> A(K, M), B(N, K), C(N, M), golden(N, M);
+  uint64_t seed = M * 31 + N * 17 + K;
+  support::random_fill(A, seed);
+  support::random_fill(B, seed + 1);
+  support::reference_matmul(A, B, golden);
+
+  TuningDatabase::Record best = {candidates().front().name, 1e300};
+  for (const Candidate &candidate : candidates()) {
+    std::vector<double> first =
+        support::time_runs([&] { candidate.fn(A, B, C); }, 1, 1);
+    if (first[0] > 4 * best.median_us ||
+        support::max_error(C, golden) > 1e-4) {
+      continue;
+    }
+
+    double median_us =
+        support::summarize(
+            support::time_runs([&] { candidate.fn(A, B, C); }, 0, repeats))
+            .median_us;
+    if (verbose) {
+      std::cerr << "\t" << candidate.name << ": " << median_us << " us"
+                << std::endl;
+    }
+    if (median_us < best.median_us) {
+      best = {candidate.name, median_us};
+    }
+  }
+  return best;
+}
+
+// Picks the best known variant for a shape at run time. Shapes missing from
+// the database run the default candidate; nothing is tuned on the call path.
+class Dispatcher {
+public:
+  static Dispatcher &global() {
+    static Dispatcher dispatcher;
+    return dispatcher;
+  }
+
+  bool load(const std::string &path) {
+    std::lock_guard<std::mutex> lock(_lock);
+    _selected.clear();
+    return _database.load(path);
+  }
+
+  bool save(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _database.save(path);
+  }
+
+  // Tunes the shape now and records the result for this CPU
+  TuningDatabase::Record tune(uint32_t M, uint32_t N, uint32_t K,
+                              uint32_t repeats = 5, bool verbose = false) {
+    TuningDatabase::Record best = tuneShape(M, N, K, repeats, verbose);
+    std::lock_guard<std::mutex> lock(_lock);
+    _database.record(_cpu, "f32", M, N, K, best);
+    _selected.erase(ShapeKey(M, N, K));
+    return best;
+  }
+
+  const Candidate &select(uint32_t M, uint32_t N, uint32_t K) {
+    std::lock_guard<std::mutex> lock(_lock);
+    ShapeKey key(M, N, K);
+    auto it = _selected.find(key);
+    if (it != _selected.end()) {
+      return *it->second;
+    }
+
+    const Candidate *candidate = &candidates().front();
+    const TuningDatabase::Record *record =
+        _database.lookup(_cpu, "f32", M, N, K);
+    if (record != nullptr && findCandidate(record->kernel) != nullptr) {
+      candidate = findCandidate(record->kernel);
+    }
+    _selected[key] = candidate;
+    return *candidate;
+  }
+
+  const TuningDatabase &database() const { return _database; }
+
+private:
+  // Tunings are per kernel variant too: an AVX2 winner says nothing about the
+  // AVX-512 kernels
+  Dispatcher()
+      : _cpu(support::calibration::cpu_model() + "/" +
+             support::isa_name(support::active_isa())) {}
+
+  using ShapeKey = std::tuple<uint32_t, uint32_t, uint32_t>;
+
+  mutable std::mutex _lock;
+  std::string _cpu;
+  TuningDatabase _database;
+  std::map<ShapeKey, const Candidate *> _selected;
+};
+
+// STEP 7: GEMM through the autotuner's choice for this shape and CPU
+inline void tuned_matmul(MatrixView<const float> A, MatrixView<const float> B,
+                         MatrixView<float> C) {
+  const Candidate &candidate = Dispatcher::global().select(
+      A.get_height(), B.get_width(), A.get_width());
+  candidate.fn(A, B, C);
+}
+
+} // namespace autotune
+} // namespace algo
+#endif
@@ -0,0 +1,111 @@
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#ifndef __BATCHED_MATMUL_H__
+#define __BATCHED_MATMUL_H__
+
+using support::Matrix;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace batched {
+
+// `count` matrices of the same shape laid out at a fixed distance from each
+// other in one buffer, e.g. a [heads, rows, cols] tensor.
+template <typename T> struct StridedBatch {
+  T *data;
+  uint32_t width, height;
+  int64_t row_stride;
+  // Elements between the starts of consecutive matrices
+  int64_t batch_stride;
+  uint32_t count;
+
+  StridedBatch(T *data, uint32_t width, uint32_t height, int64_t row_stride,
+               int64_t batch_stride, uint32_t count)
+      : data(data), width(width), height(height), row_stride(row_stride),
+        batch_stride(batch_stride), count(count) {}
+
+  template <typename U, typename = std::enable_if_t<
+                            std::is_same<const U, T>::value>>
+  StridedBatch(const StridedBatch<U> &other)
+      : StridedBatch(other.data, other.width, other.height, other.row_stride,
+                     other.batch_stride, other.count) {}
+
+  MatrixView<T> operator[](uint32_t i) const {
+    return MatrixView<T>(data + i * batch_stride, width, height, row_stride);
+  }
+};
+
+// Runs get(i) -> (A, B, C) for every item of the batch. One parallel_for
+// covers the whole batch, each task takes a contiguous run of items, and
+// every item is a packed GEMM on the worker's own workspace, so the packing
+// buffers are allocated once per worker rather than once per item.
+template <size_t tileMC, size_t tileKC, size_t tileNC, typename Get>
+void runBatch(uint32_t count, uint32_t threads, Get &&get) {
+  if (count == 0) {
+    return;
+  }
+
+  ThreadPool &pool = ThreadPool::global();
+  uint32_t workers =
+      threads == 0 ? pool.size() : std::min(threads, pool.size());
+  // A few tasks per worker to even out the tail
+  uint32_t tasks = std::min(count, workers * 4);
+  pool.parallel_for(
+      tasks,
+      [&](uint32_t task, uint32_t) {
+        uint32_t begin = uint64_t(count) * task / tasks;
+        uint32_t end = uint64_t(count) * (task + 1) / tasks;
+        Workspace &workspace = Workspace::local();
+        for (uint32_t i = begin; i < end; i++) {
+          auto item = get(i);
+          packed::packed_matmul_ws<tileMC, tileKC, tileNC>(
+              std::get<0>(item), std::get<1>(item), std::get<2>(item),
+              workspace);
+        }
+      },
+      workers);
+}
+
+// C[i] = A[i] @ B[i] for i in [0, count). Items may differ in shape and
+// layout. threads == 0 uses the whole global pool.
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void batched_matmul(const MatrixView<const float> *A,
+                    const MatrixView<const float> *B,
+                    const MatrixView<float> *C, uint32_t count,
+                    uint32_t threads = 0) {
+  runBatch<tileMC, tileKC, tileNC>(count, threads, [&](uint32_t i) {
+    return std::make_tuple(A[i], B[i], C[i]);
+  });
+}
+
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void batched_matmul(const std::vector<MatrixView<const float>> &A,
+                    const std::vector<MatrixView<const float>> &B,
+                    const std::vector<MatrixView<float>> &C,
+                    uint32_t threads = 0) {
+  batched_matmul<tileMC, tileKC, tileNC>(A.data(), B.data(), C.data(),
+                                         uint32_t(C.size()), threads);
+}
+
+// As batched_matmul, on matrices in strided 3-D buffers
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void batched_matmul_strided(StridedBatch<const float> A,
+                            StridedBatch<const float> B,
+                            StridedBatch<float> C, uint32_t threads = 0) {
+  runBatch<tileMC, tileKC, tileNC>(C.count, threads, [&](uint32_t i) {
+    return std::make_tuple(A[i], B[i], C[i]);
+  });
+}
+
+} // namespace batched
+} // namespace algo
+#endif
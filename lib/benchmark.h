@@ -0,0 +1,305 @@
+#include "matrix.h"
+#include "perf_counters.h"
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+namespace support {
+
+using MatmulFn = std::function<void(MatrixView<const float>, MatrixView<const float>,
+                                    MatrixView<float>)>;
+
+struct KernelEntry {
+    // Name including template parameters, e.g. "tiled_ijk_matmul_kij<float, 32, 32, 32>"
+    std::string name;
+    MatmulFn fn;
+    // Largest accepted |C - golden| / max(|golden|, 1)
+    double tolerance;
+    // Uses the whole thread pool, compared against the all-core peak
+    bool parallel;
+};
+
+// Named set of benchmarkable matmul kernels
+class KernelRegistry {
+public:
+    static KernelRegistry& global() {
+        static KernelRegistry registry;
+        return registry;
+    }
+
+    void add(const std::string& name, MatmulFn fn, double tolerance = 1e-4,
+             bool parallel = false) {
+        _kernels.push_back({name, std::move(fn), tolerance, parallel});
+    }
+
+    const std::vector<KernelEntry>& kernels() const {
+        return _kernels;
+    }
+
+    const KernelEntry* find(const std::string& name) const {
+        for (const KernelEntry& entry : _kernels) {
+            if (entry.name == name) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Kernels whose name contains any of the filters, all kernels if empty
+    std::vector<const KernelEntry*> match(const std::vector<std::string>& filters) const {
+        std::vector<const KernelEntry*> result;
+        for (const KernelEntry& entry : _kernels) {
+            bool selected = filters.empty();
+            for (const std::string& filter : filters) {
+                selected |= entry.name.find(filter) != std::string::npos;
+            }
+            if (selected) {
+                result.push_back(&entry);
+            }
+        }
+        return result;
+    }
+
+private:
+    std::vector<KernelEntry> _kernels;
+};
+
+// Registers a kernel under its own spelling, template arguments included:
+//   REGISTER_MATMUL(registry, algo::naive::tiled_ijk_matmul_kij<float, 8, 8, 8>);
+#define REGISTER_MATMUL(registry, ...) (registry).add(#__VA_ARGS__, __VA_ARGS__)
+#define REGISTER_PARALLEL_MATMUL(registry, ...) \
+    (registry).add(#__VA_ARGS__, __VA_ARGS__, 1e-4, true)
+
+struct TimingStats {
+    double min_us = 0, median_us = 0, mean_us = 0, p90_us = 0, p99_us = 0;
+};
+
+// Nearest-rank percentiles over the per-run samples
+inline TimingStats summarize(std::vector<double> samples_us) {
+    TimingStats stats;
+    if (samples_us.empty()) {
+        return stats;
+    }
+
+    std::sort(samples_us.begin(), samples_us.end());
+    auto percentile = [&](double p) {
+        size_t rank = size_t(std::ceil(p / 100.0 * samples_us.size()));
+        return samples_us[std::min(std::max<size_t>(rank, 1), samples_us.size()) - 1];
+    };
+
+    stats.min_us = samples_us.front();
+    stats.median_us = percentile(50);
+    stats.p90_us = percentile(90);
+    stats.p99_us = percentile(99);
+    double total = 0;
+    for (double sample : samples_us) {
+        total += sample;
+    }
+    stats.mean_us = total / samples_us.size();
+    return stats;
+}
+
+// C = A @ B accumulated in double, used as the golden result
+inline void reference_matmul(MatrixView<const float> A, MatrixView<const float> B,
+                             MatrixView<float> C) {
+    uint32_t N = A.get_height(), M = B.get_width(), K = A.get_width();
+    std::vector<double> row(M);
+    for (uint32_t i = 0; i < N; i++) {
+        std::fill(row.begin(), row.end(), 0.0);
+        for (uint32_t k = 0; k < K; k++) {
+            double a = A.r(i, k);
+            for (uint32_t j = 0; j < M; j++) {
+                row[j] += a * B.r(k, j);
+            }
+        }
+        for (uint32_t j = 0; j < M; j++) {
+            C.a(i, j) = row[j];
+        }
+    }
+}
+
+// Largest |C - golden| / max(|golden|, 1), the relative error for large
+// entries and the absolute error for entries near zero. NaNs compare as
+// infinitely wrong.
+inline double max_error(MatrixView<const float> C, MatrixView<const float> golden) {
+    double worst = 0;
+    for (uint32_t i = 0; i < golden.get_height(); i++) {
+        for (uint32_t j = 0; j < golden.get_width(); j++) {
+            double expected = golden.r(i, j);
+            double err = std::fabs(C.r(i, j) - expected) / std::max(std::fabs(expected), 1.0);
+            if (!(err <= worst)) {
+                worst = std::isnan(err) ? INFINITY : err;
+            }
+        }
+    }
+    return worst;
+}
+
+struct BenchmarkResult {
+    std::string kernel;
+    uint32_t M = 0, N = 0, K = 0;
+    uint32_t warmups = 0, repeats = 0;
+    TimingStats stats;
+    // 2 * M * N * K / median time
+    double gflops = 0;
+    double error = 0;
+    bool correct = false;
+    // Additional named metrics reported as extra columns
+    std::vector<std::pair<std::string, double>> extra;
+};
+
+// Times `repeats` individual runs of fn after `warmups` untimed ones. When
+// counters is given, hardware counters cover exactly the timed runs.
+template <typename F>
+std::vector<double> time_runs(F&& fn, uint32_t warmups, uint32_t repeats,
+                              PerfCounters* counters = nullptr,
+                              PerfCounters::Sample* sample = nullptr) {
+    for (uint32_t i = 0; i < warmups; i++) {
+        fn();
+    }
+
+    if (counters != nullptr) {
+        counters->start();
+    }
+
+    std::vector<double> samples_us;
+    samples_us.reserve(repeats);
+    for (uint32_t i = 0; i < repeats; i++) {
+        auto t1 = std::chrono::steady_clock::now();
+        fn();
+        auto t2 = std::chrono::steady_clock::now();
+        samples_us.push_back(std::chrono::duration<double, std::micro>(t2 - t1).count());
+    }
+
+    if (counters != nullptr) {
+        *sample = counters->stop();
+    }
+    return samples_us;
+}
+
+// Runs one kernel on A @ B -> C and checks the result against golden. With
+// counters, the derived counter metrics are appended to result.extra.
+inline BenchmarkResult run_benchmark(const KernelEntry& kernel, MatrixView<const float> A,
+                                     MatrixView<const float> B, MatrixView<float> C,
+                                     MatrixView<const float> golden, uint32_t warmups,
+                                     uint32_t repeats, PerfCounters* counters = nullptr) {
+    BenchmarkResult result;
+    result.kernel = kernel.name;
+    result.M = A.get_height();
+    result.N = B.get_width();
+    result.K = A.get_width();
+    result.warmups = warmups;
+    result.repeats = repeats;
+
+    PerfCounters::Sample sample;
+    result.stats = summarize(
+        time_runs([&] { kernel.fn(A, B, C); }, warmups, repeats, counters, &sample));
+    double flop = 2.0 * result.M * result.N * result.K;
+    result.gflops = result.stats.median_us > 0 ? flop / result.stats.median_us / 1e3 : 0;
+    if (counters != nullptr) {
+        result.extra = PerfCounters::metrics(sample, flop * repeats);
+    }
+
+    result.error = max_error(C, golden);
+    result.correct = result.error <= kernel.tolerance;
+    return result;
+}
+
+enum class ReportFormat { TEXT, CSV, JSON };
+
+inline std::string json_escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+inline void write_report(std::ostream& os, const std::vector<BenchmarkResult>& results,
+                         ReportFormat format) {
+    if (format == ReportFormat::TEXT) {
+        for (const BenchmarkResult& r : results) {
+            os << r.M << "x" << r.N << "x" << r.K << "\t" << r.kernel << std::fixed
+               << std::setprecision(1) << "\n\tmin " << r.stats.min_us << " us, median "
+               << r.stats.median_us << " us, p90 " << r.stats.p90_us << " us, p99 "
+               << r.stats.p99_us << " us, " << std::setprecision(2) << r.gflops
+               << " GFLOPS";
+            os.unsetf(std::ios::floatfield);
+            for (const auto& metric : r.extra) {
+                os << ", " << metric.first << " " << metric.second;
+            }
+            os << "\n\t" << (r.correct ? "OK" : "MISMATCH") << " (max error " << r.error
+               << ")" << std::endl;
+        }
+    } else if (format == ReportFormat::CSV) {
+        // One column per extra metric any result has, in order of first
+        // appearance; results without it leave the cell empty
+        std::vector<std::string> columns;
+        for (const BenchmarkResult& r : results) {
+            for (const auto& metric : r.extra) {
+                if (std::find(columns.begin(), columns.end(), metric.first) == columns.end()) {
+                    columns.push_back(metric.first);
+                }
+            }
+        }
+
+        os << "kernel,M,N,K,warmups,repeats,min_us,median_us,mean_us,p90_us,p99_us,gflops,"
+              "max_error,correct";
+        for (const std::string& column : columns) {
+            os << "," << column;
+        }
+        os << std::endl;
+        for (const BenchmarkResult& r : results) {
+            os << "\"" << r.kernel << "\"," << r.M << "," << r.N << "," << r.K << ","
+               << r.warmups << "," << r.repeats << "," << r.stats.min_us << ","
+               << r.stats.median_us << "," << r.stats.mean_us << "," << r.stats.p90_us << ","
+               << r.stats.p99_us << "," << r.gflops << "," << r.error << "," << r.correct;
+            for (const std::string& column : columns) {
+                os << ",";
+                auto metric = std::find_if(r.extra.begin(), r.extra.end(),
+                                           [&](const auto& m) { return m.first == column; });
+                if (metric != r.extra.end()) {
+                    os << metric->second;
+                }
+            }
+            os << std::endl;
+        }
+    } else {
+        os << "[" << std::endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult& r = results[i];
+            os << "  {\"kernel\": \"" << json_escape(r.kernel) << "\", \"M\": " << r.M
+               << ", \"N\": " << r.N << ", \"K\": " << r.K << ", \"warmups\": " << r.warmups
+               << ", \"repeats\": " << r.repeats << ", \"min_us\": " << r.stats.min_us
+               << ", \"median_us\": " << r.stats.median_us << ", \"mean_us\": "
+               << r.stats.mean_us << ", \"p90_us\": " << r.stats.p90_us
+               << ", \"p99_us\": " << r.stats.p99_us << ", \"gflops\": " << r.gflops
+               << ", \"max_error\": " << (std::isfinite(r.error) ? r.error : 1e308)
+               << ", \"correct\": " << (r.correct ? "true" : "false");
+            for (const auto& metric : r.extra) {
+                os << ", \"" << json_escape(metric.first) << "\": "
+                   << (std::isfinite(metric.second) ? metric.second : 0.0);
+            }
+            os << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+        }
+        os << "]" << std::endl;
+    }
+}
+
+} // namespace support
+
+#endif
@@ -0,0 +1,481 @@
+#include "epilogue.h"
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "parallel_matmul.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifndef __CONV2D_H__
+#define __CONV2D_H__
+
+using algo::epilogue::Activation;
+using algo::epilogue::Epilogue;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace conv {
+
+// 2-D convolution (cross-correlation, as in deep learning frameworks) as a
+// GEMM over the unfolded input. With P = out_height * out_width pixels and
+// K = channels * kernel_h * kernel_w values per patch:
+//
+//  - NCHW: out[n] [filters, P] = weights [filters, K] @ cols(n) [K, P], where
+//    row (c, kh, kw) of cols holds that input value under every output pixel.
+//  - NHWC: out [batch * P, filters] = cols [batch * P, K] @ weights^T, where
+//    row (n, oh, ow) of cols is the patch of that pixel in (kh, kw, c) order.
+//
+// So weights are [filters, K] row-major, K in (c, kh, kw) order for NCHW
+// (OIHW) and (kh, kw, c) for NHWC (OHWI). Tensors are dense in their layout.
+// The unfolded matrix is kernel_h * kernel_w times the input, so neither
+// mode below builds it whole.
+
+enum class Layout { NCHW, NHWC };
+
+enum class ConvMode {
+  // Unfolds IM2COL_TILE_BYTES of cols at a time into workspace and runs the
+  // packed GEMM on each tile
+  IM2COL,
+  // Gathers patches straight into the packed panels of the parallel GEMM,
+  // in place of packing cols
+  IMPLICIT,
+};
+
+// Bytes of cols unfolded at a time by ConvMode::IM2COL, about an L3 slice
+constexpr size_t IM2COL_TILE_BYTES = size_t(4) << 20;
+
+struct Conv2dShape {
+  uint32_t batch = 1, channels = 0, height = 0, width = 0;
+  uint32_t filters = 0, kernel_h = 1, kernel_w = 1;
+  uint32_t stride_h = 1, stride_w = 1;
+  uint32_t pad_h = 0, pad_w = 0;
+  uint32_t dilation_h = 1, dilation_w = 1;
+  Layout layout = Layout::NCHW;
+
+  uint32_t out_height() const {
+    return outExtent(height, pad_h, kernel_h, dilation_h, stride_h);
+  }
+
+  uint32_t out_width() const {
+    return outExtent(width, pad_w, kernel_w, dilation_w, stride_w);
+  }
+
+  // Output pixels per image
+  uint32_t pixels() const { return out_height() * out_width(); }
+
+  // Values per patch, the K of the GEMM
+  uint32_t patch() const { return channels * kernel_h * kernel_w; }
+
+  size_t input_size() const {
+    return size_t(batch) * channels * height * width;
+  }
+
+  size_t output_size() const { return size_t(batch) * filters * pixels(); }
+
+  double flops() const { return 2.0 * batch * filters * pixels() * patch(); }
+
+  // A 1x1 stride 1 convolution with no padding is a plain GEMM on the input
+  bool is_pointwise() const {
+    return kernel_h == 1 && kernel_w == 1 && stride_h == 1 && stride_w == 1 &&
+           pad_h == 0 && pad_w == 0;
+  }
+
+private:
+  static uint32_t outExtent(uint32_t size, uint32_t pad, uint32_t kernel,
+                            uint32_t dilation, uint32_t stride) {
+    uint64_t span = uint64_t(dilation) * (kernel - 1) + 1;
+    uint64_t padded = uint64_t(size) + 2 * pad;
+    return padded < span ? 0 : uint32_t((padded - span) / stride + 1);
+  }
+};
+
+namespace detail {
+
+// Writes n values of a row of the input, starting at column `first` and
+// `stride` apart, to out[t * step], with zeros where the column falls in the
+// padding
+inline void copyRow(const float *row, uint32_t width, int64_t first,
+                    uint32_t stride, uint32_t n, float *out, uint32_t step) {
+  int64_t lo = first >= 0 ? 0 : (-first + stride - 1) / stride;
+  int64_t hi = int64_t(width) - first <= 0
+                   ? 0
+                   : (int64_t(width) - first + stride - 1) / stride;
+  lo = std::min<int64_t>(lo, n);
+  hi = std::max(lo, std::min<int64_t>(hi, n));
+  for (int64_t t = 0; t < lo; t++) {
+    out[t * step] = 0;
+  }
+  if (stride == 1 && step == 1) {
+    if (lo < hi) {
+      std::memcpy(out + lo, row + first + lo, sizeof(float) * (hi - lo));
+    }
+  } else {
+    for (int64_t t = lo; t < hi; t++) {
+      out[t * step] = row[first + t * stride];
+    }
+  }
+  for (int64_t t = hi; t < n; t++) {
+    out[t * step] = 0;
+  }
+}
+
+// cols [K, P] of one NCHW image, read in place
+struct NchwPatches {
+  const Conv2dShape *shape;
+  const float *image;
+
+  // Row k of cols over columns [p0, p0 + n), to out[t * step]
+  void row(uint32_t k, uint32_t p0, uint32_t n, float *out,
+           uint32_t step) const {
+    const Conv2dShape &s = *shape;
+    uint32_t taps = s.kernel_h * s.kernel_w;
+    uint32_t c = k / taps, kh = k % taps / s.kernel_w, kw = k % s.kernel_w;
+    uint32_t outW = s.out_width();
+    uint32_t oh = p0 / outW, ow = p0 % outW;
+    const float *plane = image + size_t(c) * s.height * s.width;
+
+    // One output row at a time, a strided run of one input row
+    for (uint32_t done = 0; done < n; oh++, ow = 0) {
+      uint32_t len = std::min(n - done, outW - ow);
+      int64_t ih = int64_t(oh) * s.stride_h - s.pad_h + kh * s.dilation_h;
+      float *o = out + size_t(done) * step;
+      if (ih < 0 || ih >= s.height) {
+        for (uint32_t t = 0; t < len; t++) {
+          o[t * step] = 0;
+        }
+      } else {
+        copyRow(plane + ih * s.width, s.width,
+                int64_t(ow) * s.stride_w - s.pad_w + kw * s.dilation_w,
+                s.stride_w, len, o, step);
+      }
+      done += len;
+    }
+  }
+
+  // packB's panels of cols, each k of a panel being a run of one row
+  template <uint32_t nR>
+  void pack(uint32_t k0, uint32_t j0, uint32_t kc, uint32_t nc,
+            float *packed) const {
+    for (uint32_t jr = 0; jr < nc; jr += nR) {
+      uint32_t nr = std::min(nR, nc - jr);
+      for (uint32_t k = 0; k < kc; k++) {
+        row(k0 + k, j0 + jr, nr, packed, 1);
+        for (uint32_t j = nr; j < nR; j++) {
+          packed[j] = 0;
+        }
+        packed += nR;
+      }
+    }
+  }
+};
+
+// cols [batch * P, K] of an NHWC batch, read in place
+struct NhwcPatches {
+  const Conv2dShape *shape;
+  const float *input;
+
+  // Row p of cols over columns [k0, k0 + n), to out[t * step]. Consecutive k
+  // of one (kh, kw) tap are consecutive channels, contiguous in the input.
+  void row(uint32_t p, uint32_t k0, uint32_t n, float *out,
+           uint32_t step) const {
+    const Conv2dShape &s = *shape;
+    uint32_t pixels = s.pixels(), outW = s.out_width();
+    uint32_t image = p / pixels, oh = p % pixels / outW, ow = p % outW;
+    int64_t ih0 = int64_t(oh) * s.stride_h - s.pad_h;
+    int64_t iw0 = int64_t(ow) * s.stride_w - s.pad_w;
+
+    // Divisions only for the first value, the rest step (kh, kw, c) along
+    uint32_t c = k0 % s.channels, tap = k0 / s.channels;
+    uint32_t kh = tap / s.kernel_w, kw = tap % s.kernel_w;
+    const float *base =
+        input + size_t(image) * s.height * s.width * s.channels;
+    for (uint32_t done = 0; done < n;) {
+      int64_t ih = ih0 + kh * s.dilation_h;
+      float *o = out + size_t(done) * step;
+      if (s.dilation_w == 1) {
+        // The taps of one kernel row are kernel_w * channels contiguous
+        // values of input row ih, the ones in the padding at either end
+        // zero: one run per kernel row
+        int64_t first = int64_t(kw) * s.channels + c;
+        uint32_t len = std::min<int64_t>(
+            n - done, int64_t(s.kernel_w) * s.channels - first);
+        int64_t lo = std::max<int64_t>(-iw0, 0) * s.channels;
+        int64_t hi = std::max<int64_t>(
+            std::min<int64_t>(s.kernel_w, int64_t(s.width) - iw0), 0) *
+            s.channels;
+        if (ih < 0 || ih >= s.height) {
+          lo = hi = first;
+        }
+        lo = std::min(std::max(lo, first), first + len);
+        hi = std::min(std::max(hi, lo), first + len);
+        for (int64_t t = first; t < lo; t++) {
+          o[(t - first) * step] = 0;
+        }
+        if (lo < hi) {
+          // Input element of value lo
+          const float *src = base + (ih * s.width + iw0) * s.channels + lo;
+          if (step == 1) {
+            std::memcpy(o + (lo - first), src, sizeof(float) * (hi - lo));
+          } else {
+            for (int64_t t = lo; t < hi; t++) {
+              o[(t - first) * step] = src[t - lo];
+            }
+          }
+        }
+        for (int64_t t = hi; t < first + len; t++) {
+          o[(t - first) * step] = 0;
+        }
+        done += len;
+        c = 0;
+        kw = 0;
+        kh++;
+        continue;
+      }
+
+      uint32_t len = std::min(n - done, s.channels - c);
+      int64_t iw = iw0 + kw * s.dilation_w;
+      if (ih < 0 || ih >= s.height || iw < 0 || iw >= s.width) {
+        for (uint32_t t = 0; t < len; t++) {
+          o[t * step] = 0;
+        }
+      } else {
+        const float *src = base + (ih * s.width + iw) * s.channels + c;
+        for (uint32_t t = 0; t < len; t++) {
+          o[t * step] = src[t];
+        }
+      }
+      done += len;
+      c = 0;
+      if (++kw == s.kernel_w) {
+        kw = 0;
+        kh++;
+      }
+    }
+  }
+
+  // packA's panels of cols: row i of a panel lands every mR floats
+  template <uint32_t mR>
+  void pack(uint32_t i0, uint32_t k0, uint32_t mc, uint32_t kc,
+            float *packed) const {
+    for (uint32_t ir = 0; ir < mc; ir += mR) {
+      uint32_t mr = std::min(mR, mc - ir);
+      for (uint32_t i = 0; i < mR; i++) {
+        if (i < mr) {
+          row(i0 + ir + i, k0, kc, packed + i, mR);
+        } else {
+          for (uint32_t k = 0; k < kc; k++) {
+            packed[k * mR + i] = 0;
+          }
+        }
+      }
+      packed += kc * mR;
+    }
+  }
+};
+
+// Runs fn(first, last) over [0, rows) in tasks of about 16 rows
+template <typename F> void forRows(uint32_t rows, uint32_t threads, F &&fn) {
+  const uint32_t chunk = 16;
+  ThreadPool::global().parallel_for(
+      (rows + chunk - 1) / chunk,
+      [&](uint32_t task, uint32_t) {
+        fn(task * chunk, std::min(rows, (task + 1) * chunk));
+      },
+      threads);
+}
+
+inline void checkWeights(const Conv2dShape &shape,
+                         MatrixView<const float> weights) {
+  if (weights.get_height() != shape.filters ||
+      weights.get_width() != shape.patch()) {
+    throw std::invalid_argument(
+        "conv2d: weights are [" + std::to_string(weights.get_height()) +
+        ", " + std::to_string(weights.get_width()) + "], expected [" +
+        std::to_string(shape.filters) + ", " + std::to_string(shape.patch()) +
+        "]");
+  }
+}
+
+} // namespace detail
+
+// Unfolds image n of input into cols: [K, P] for NCHW, [P, K] for NHWC. This
+// is the whole matrix, kernel_h * kernel_w times the input; conv2d never
+// builds it.
+inline void im2col(const Conv2dShape &shape, const float *input, uint32_t n,
+                   MatrixView<float> cols, uint32_t threads = 0) {
+  uint32_t K = shape.patch(), P = shape.pixels();
+  if (shape.layout == Layout::NCHW) {
+    size_t imageSize = size_t(shape.channels) * shape.height * shape.width;
+    detail::NchwPatches patches{&shape, input + n * imageSize};
+    detail::forRows(K, threads, [&](uint32_t k0, uint32_t k1) {
+      for (uint32_t k = k0; k < k1; k++) {
+        patches.row(k, 0, P, &cols.a(k, 0), cols.get_col_stride());
+      }
+    });
+  } else {
+    detail::NhwcPatches patches{&shape, input};
+    detail::forRows(P, threads, [&](uint32_t p0, uint32_t p1) {
+      for (uint32_t p = p0; p < p1; p++) {
+        patches.row(n * P + p, 0, K, &cols.a(p, 0), cols.get_col_stride());
+      }
+    });
+  }
+}
+
+// output = act(conv(input, weights) + bias), bias holding one value per
+// filter or null, on `threads` workers of the global pool (0 for all). See
+// the top of the file for the layouts. Throws std::invalid_argument if
+// weights are not [filters, patch()].
+inline void conv2d(const Conv2dShape &shape, const float *input,
+                   MatrixView<const float> weights, float *output,
+                   const float *bias = nullptr,
+                   Activation activation = Activation::NONE,
+                   ConvMode mode = ConvMode::IMPLICIT, uint32_t threads = 0,
+                   Workspace &workspace = Workspace::local()) {
+  detail::checkWeights(shape, weights);
+  uint32_t K = shape.patch(), P = shape.pixels(), F = shape.filters;
+  if (P == 0 || shape.batch == 0 || F == 0) {
+    return;
+  }
+
+  Epilogue epilogue;
+  epilogue.activation = activation;
+  ThreadPool &pool = ThreadPool::global();
+  uint32_t workers =
+      threads == 0 ? pool.size() : std::min(threads, pool.size());
+  size_t imageSize = size_t(shape.channels) * shape.height * shape.width;
+  // Pointwise convolutions multiply the input as it is. So do those with no
+  // channels, K = 0, which parallelGemm does not take: there is nothing to
+  // gather and the output is act(bias).
+  bool direct = shape.is_pointwise() || K == 0;
+
+  if (shape.layout == Layout::NCHW) {
+    // One GEMM per image, filters along the rows of C
+    epilogue.row_bias = bias;
+    for (uint32_t n = 0; n < shape.batch; n++) {
+      const float *image = input + n * imageSize;
+      MatrixView<float> C(output + size_t(n) * F * P, P, F, P);
+      if (direct) {
+        MatrixView<const float> B(image, P, K, P);
+        parallel::packed_matmul_fused_threads(weights, B, C, epilogue, threads,
+                                              workspace);
+      } else if (mode == ConvMode::IMPLICIT) {
+        detail::NchwPatches patches{&shape, image};
+        packed::withKernel([&](auto kernel) {
+          parallel::parallelGemm<72, 256, 4080, 128, decltype(kernel)>(
+              F, P, K, packed::ViewPackerA{weights}, patches, C, epilogue,
+              workers, workspace);
+        });
+      } else {
+        // Tiles of whole columns of cols, so each is a full-K GEMM
+        uint32_t tile = uint32_t(std::max<size_t>(
+            IM2COL_TILE_BYTES / (sizeof(float) * K), 16));
+        tile = std::min(tile, P);
+        Workspace::Scope scope(workspace);
+        float *buffer = workspace.alloc<float>(size_t(K) * tile);
+        detail::NchwPatches patches{&shape, image};
+        for (uint32_t p0 = 0; p0 < P; p0 += tile) {
+          uint32_t np = std::min(tile, P - p0);
+          detail::forRows(K, threads, [&](uint32_t k0, uint32_t k1) {
+            for (uint32_t k = k0; k < k1; k++) {
+              patches.row(k, p0, np, buffer + size_t(k) * np, 1);
+            }
+          });
+          parallel::packed_matmul_fused_threads(
+              weights, MatrixView<const float>(buffer, np, K, np),
+              C.block(0, p0, F, np), epilogue, threads, workspace);
+        }
+      }
+    }
+    return;
+  }
+
+  // NHWC: one GEMM over every pixel of the batch, filters along the columns
+  epilogue.col_bias = bias;
+  uint32_t rows = shape.batch * P;
+  MatrixView<float> C(output, F, rows, F);
+  MatrixView<const float> B = weights.t();
+  if (direct) {
+    MatrixView<const float> A(input, K, rows, K);
+    parallel::packed_matmul_fused_threads(A, B, C, epilogue, threads,
+                                          workspace);
+  } else if (mode == ConvMode::IMPLICIT) {
+    detail::NhwcPatches patches{&shape, input};
+    packed::withKernel([&](auto kernel) {
+      parallel::parallelGemm<72, 256, 4080, 128, decltype(kernel)>(
+          rows, F, K, patches, packed::ViewPackerB{B}, C, epilogue, workers,
+          workspace);
+    });
+  } else {
+    uint32_t tile = uint32_t(
+        std::max<size_t>(IM2COL_TILE_BYTES / (sizeof(float) * K), 16));
+    tile = std::min(tile, rows);
+    Workspace::Scope scope(workspace);
+    float *buffer = workspace.alloc<float>(size_t(tile) * K);
+    detail::NhwcPatches patches{&shape, input};
+    for (uint32_t r0 = 0; r0 < rows; r0 += tile) {
+      uint32_t nr = std::min(tile, rows - r0);
+      detail::forRows(nr, threads, [&](uint32_t i0, uint32_t i1) {
+        for (uint32_t i = i0; i < i1; i++) {
+          patches.row(r0 + i, 0, K, buffer + size_t(i) * K, 1);
+        }
+      });
+      parallel::packed_matmul_fused_threads(
+          MatrixView<const float>(buffer, K, nr, K), B, C.block(r0, 0, nr, F),
+          epilogue, threads, workspace);
+    }
+  }
+}
+
+// Direct convolution with double accumulation, the reference for conv2d
+inline void conv2d_reference(const Conv2dShape &shape, const float *input,
+                             MatrixView<const float> weights, float *output,
+                             const float *bias = nullptr) {
+  detail::checkWeights(shape, weights);
+  uint32_t outH = shape.out_height(), outW = shape.out_width();
+  uint32_t C = shape.channels, H = shape.height, W = shape.width;
+  bool nchw = shape.layout == Layout::NCHW;
+  for (uint32_t n = 0; n < shape.batch; n++) {
+    for (uint32_t f = 0; f < shape.filters; f++) {
+      for (uint32_t oh = 0; oh < outH; oh++) {
+        for (uint32_t ow = 0; ow < outW; ow++) {
+          double sum = bias == nullptr ? 0 : bias[f];
+          for (uint32_t c = 0; c < C; c++) {
+            for (uint32_t kh = 0; kh < shape.kernel_h; kh++) {
+              int64_t ih = int64_t(oh) * shape.stride_h - shape.pad_h +
+                           kh * shape.dilation_h;
+              for (uint32_t kw = 0; kw < shape.kernel_w; kw++) {
+                int64_t iw = int64_t(ow) * shape.stride_w - shape.pad_w +
+                             kw * shape.dilation_w;
+                if (ih < 0 || ih >= H || iw < 0 || iw >= W) {
+                  continue;
+                }
+                size_t at = nchw ? ((size_t(n) * C + c) * H + ih) * W + iw
+                                 : ((size_t(n) * H + ih) * W + iw) * C + c;
+                uint32_t k = nchw ? (c * shape.kernel_h + kh) * shape.kernel_w +
+                                        kw
+                                  : (kh * shape.kernel_w + kw) * C + c;
+                sum += double(input[at]) * weights.r(f, k);
+              }
+            }
+          }
+          size_t out = nchw ? ((size_t(n) * shape.filters + f) * outH + oh) *
+                                      outW + ow
+                            : ((size_t(n) * outH + oh) * outW + ow) *
+                                      shape.filters + f;
+          output[out] = float(sum);
+        }
+      }
+    }
+  }
+}
+
+} // namespace conv
+} // namespace algo
+#endif
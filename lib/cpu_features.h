@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <cpuid.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#ifndef __CPU_FEATURES_H__
+#define __CPU_FEATURES_H__
+
+// The library is built for baseline x86-64. Kernels that need more carry
+// these target attributes and only run after active_isa() said so. A target
+// function can inline baseline code but not the other way around, so every
+// function using AVX intrinsics must be marked, and is reached by a call.
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512                                                          \
+    __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,fma,f16c")))
+
+namespace support {
+
+// Kernel variants, each a superset of the one before
+enum class Isa {
+    // SSE2, every x86-64 CPU
+    SSE,
+    // AVX2 + FMA + F16C, Haswell and Zen onwards
+    AVX2,
+    // AVX-512 F/BW/DQ/VL, Skylake-X and Zen4 onwards
+    AVX512,
+};
+
+inline const char* isa_name(Isa isa) {
+    switch (isa) {
+    case Isa::SSE:
+        return "sse";
+    case Isa::AVX2:
+        return "avx2";
+    case Isa::AVX512:
+        return "avx512";
+    }
+    return "?";
+}
+
+inline bool parse_isa(const std::string& name, Isa& isa) {
+    for (Isa candidate : {Isa::SSE, Isa::AVX2, Isa::AVX512}) {
+        if (name == isa_name(candidate)) {
+            isa = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// CPUID feature bits, cleared when the OS does not save the register state
+struct CpuFeatures {
+    bool avx2 = false, fma = false, f16c = false;
+    bool avx512f = false, avx512bw = false, avx512dq = false, avx512vl = false;
+    bool avx512vnni = false, avxvnni = false;
+};
+
+inline CpuFeatures detect_cpu_features() {
+    CpuFeatures features;
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return features;
+    }
+    bool osxsave = ecx & (1u << 27), avx = ecx & (1u << 28);
+    features.fma = ecx & (1u << 12);
+    features.f16c = ecx & (1u << 29);
+
+    // XCR0 says which register files the OS saves on a context switch
+    uint64_t xcr0 = 0;
+    if (osxsave) {
+        uint32_t lo, hi;
+        asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        xcr0 = (uint64_t(hi) << 32) | lo;
+    }
+    bool ymm = avx && (xcr0 & 0x6) == 0x6;
+    bool zmm = ymm && (xcr0 & 0xe0) == 0xe0;
+    features.fma &= ymm;
+    features.f16c &= ymm;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        features.avx2 = ymm && (ebx & (1u << 5));
+        features.avx512f = zmm && (ebx & (1u << 16));
+        features.avx512dq = zmm && (ebx & (1u << 17));
+        features.avx512bw = zmm && (ebx & (1u << 30));
+        features.avx512vl = zmm && (ebx & (1u << 31));
+        features.avx512vnni = zmm && (ecx & (1u << 11));
+    }
+    if (__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx)) {
+        features.avxvnni = ymm && (eax & (1u << 4));
+    }
+    return features;
+}
+
+inline const CpuFeatures& cpu_features() {
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
+
+// Widest kernel variant this CPU can run
+inline Isa detect_isa() {
+    const CpuFeatures& f = cpu_features();
+    if (f.avx512f && f.avx512bw && f.avx512dq && f.avx512vl && f.avx2 && f.fma && f.f16c) {
+        return Isa::AVX512;
+    }
+    if (f.avx2 && f.fma && f.f16c) {
+        return Isa::AVX2;
+    }
+    return Isa::SSE;
+}
+
+// Kernel variant used by every dispatching kernel, chosen once: the detected
+// one, or MATMUL_ISA=sse|avx2|avx512 if set. Asking for more than the CPU has
+// falls back to the detected variant with a warning.
+inline Isa active_isa() {
+    static const Isa isa = [] {
+        Isa detected = detect_isa();
+        const char* name = std::getenv("MATMUL_ISA");
+        if (name == nullptr || *name == '\0') {
+            return detected;
+        }
+        Isa requested;
+        if (!parse_isa(name, requested)) {
+            std::cerr << "MATMUL_ISA=" << name << " is not sse, avx2 or avx512, using "
+                      << isa_name(detected) << std::endl;
+            return detected;
+        }
+        if (requested > detected) {
+            std::cerr << "MATMUL_ISA=" << name << " is not supported by this CPU, using "
+                      << isa_name(detected) << std::endl;
+            return detected;
+        }
+        return requested;
+    }();
+    return isa;
+}
+
+} // namespace support
+
+#endif
@@ -0,0 +1,148 @@
+#include "matrix.h"
+#include <stdint.h>
+#include <algorithm>
+
+#ifndef __EPILOGUE_H__
+#define __EPILOGUE_H__
+
+using support::MatrixView;
+
+namespace algo {
+namespace epilogue {
+
+enum class Activation { NONE, RELU, GELU };
+
+// Elementwise ops fused into the write-back of C:
+//   C = act(alpha * A @ B + beta * C + row_bias[i] + col_bias[j])
+// C is only read when beta != 0, so it may start uninitialized. The default
+// is a plain C = A @ B. Bias pointers are borrowed, and null means no bias.
+struct Epilogue {
+  float alpha = 1;
+  float beta = 0;
+  // One per row of C
+  const float *row_bias = nullptr;
+  // One per column of C
+  const float *col_bias = nullptr;
+  Activation activation = Activation::NONE;
+
+  // Bias or activation to apply after alpha and beta
+  bool has_post() const {
+    return row_bias != nullptr || col_bias != nullptr ||
+           activation != Activation::NONE;
+  }
+
+  bool is_identity() const { return alpha == 1 && beta == 0 && !has_post(); }
+
+  // The same ops for C^T, computed as B^T @ A^T
+  Epilogue transposed() const {
+    Epilogue e = *this;
+    std::swap(e.row_bias, e.col_bias);
+    return e;
+  }
+
+  // The part that applies to the [row, col] block of C for one K block. Every
+  // K block scales its product by alpha, the first also scales C by beta and
+  // later ones add to it; bias and activation wait for the last.
+  Epilogue block(uint32_t row, uint32_t col, bool first, bool last) const {
+    Epilogue e;
+    e.alpha = alpha;
+    e.beta = first ? beta : 1;
+    if (last) {
+      e.row_bias = row_bias == nullptr ? nullptr : row_bias + row;
+      e.col_bias = col_bias == nullptr ? nullptr : col_bias + col;
+      e.activation = activation;
+    }
+    return e;
+  }
+};
+
+// GELU with the tanh approximation of Hendrycks and Gimpel. tanh is a clamped
+// rational approximation (as in Eigen's fast tanh) rather than std::tanh, so
+// loops over it have no calls and vectorize; it is within a few ulp.
+__attribute__((always_inline)) inline float gelu(float x) {
+  float u = 0.7978845608f * (x + 0.044715f * x * x * x);
+  u = std::min(std::max(u, -7.90531110763549805f), 7.90531110763549805f);
+  float u2 = u * u;
+  float p = -2.76076847742355e-16f;
+  p = p * u2 + 2.00018790482477e-13f;
+  p = p * u2 - 8.60467152213735e-11f;
+  p = p * u2 + 5.12229709037114e-08f;
+  p = p * u2 + 1.48572235717979e-05f;
+  p = p * u2 + 6.37261928875436e-04f;
+  p = p * u2 + 4.89352455891786e-03f;
+  float q = 1.19825839466702e-06f;
+  q = q * u2 + 1.18534705686654e-04f;
+  q = q * u2 + 2.26843463243900e-03f;
+  q = q * u2 + 4.89352518554385e-03f;
+  return 0.5f * x * (1 + u * p / q);
+}
+
+// Bias and activation over n contiguous elements of one row of C. Always
+// inlined so the loops are vectorized at the width of the calling kernel.
+__attribute__((always_inline)) inline void
+finishRow(float *c, uint32_t n, float rowBias, const float *colBias,
+          Activation activation) {
+  if (colBias != nullptr) {
+    for (uint32_t j = 0; j < n; j++) {
+      c[j] += rowBias + colBias[j];
+    }
+  } else if (rowBias != 0) {
+    for (uint32_t j = 0; j < n; j++) {
+      c[j] += rowBias;
+    }
+  }
+
+  switch (activation) {
+  case Activation::RELU:
+    for (uint32_t j = 0; j < n; j++) {
+      c[j] = std::max(c[j], 0.0f);
+    }
+    break;
+  case Activation::GELU:
+    for (uint32_t j = 0; j < n; j++) {
+      c[j] = gelu(c[j]);
+    }
+    break;
+  case Activation::NONE:
+    break;
+  }
+}
+
+// finishRow over the first mr rows and nr columns of a tile of C whose rows
+// are ldc apart, with e's bias pointers at the tile's (0, 0). Kernels call it
+// right after storing a tile, while it is still in L1.
+__attribute__((always_inline)) inline void
+finishTile(float *C, uint32_t ldc, uint32_t mr, uint32_t nr,
+           const Epilogue &e) {
+  for (uint32_t i = 0; i < mr; i++) {
+    finishRow(C + i * ldc, nr, e.row_bias == nullptr ? 0 : e.row_bias[i],
+              e.col_bias, e.activation);
+  }
+}
+
+// C = e(P, C) for a product P computed separately, for the paths that do not
+// go through a micro-kernel
+inline void apply(MatrixView<const float> P, MatrixView<float> C,
+                  const Epilogue &e) {
+  for (uint32_t i = 0; i < C.get_height(); i++) {
+    for (uint32_t j = 0; j < C.get_width(); j++) {
+      float value = e.alpha * P.r(i, j);
+      C.a(i, j) = e.beta == 0 ? value : value + e.beta * C.r(i, j);
+    }
+    if (C.get_col_stride() == 1) {
+      finishRow(&C.a(i, 0), C.get_width(),
+                e.row_bias == nullptr ? 0 : e.row_bias[i], e.col_bias,
+                e.activation);
+    } else {
+      for (uint32_t j = 0; j < C.get_width(); j++) {
+        finishRow(&C.a(i, j), 1, e.row_bias == nullptr ? 0 : e.row_bias[i],
+                  e.col_bias == nullptr ? nullptr : e.col_bias + j,
+                  e.activation);
+      }
+    }
+  }
+}
+
+} // namespace epilogue
+} // namespace algo
+#endif
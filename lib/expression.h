@@ -0,0 +1,542 @@
+#include "epilogue.h"
+#include "matrix.h"
+#include "parallel_matmul.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <stdint.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef __EXPRESSION_H__
+#define __EXPRESSION_H__
+
+using algo::epilogue::Epilogue;
+using support::Matrix;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace expr {
+
+// Lazy float matrix expressions. The operators below build a tree of views
+// and compute nothing; assigning it through into() evaluates it straight into
+// the destination:
+//
+//   using namespace algo::expr;
+//   into(D) = A * B + C;       // C copied into D, then one GEMM with beta = 1
+//   into(C) += 0.5f * A * B;   // one GEMM with alpha = 0.5, beta = 1
+//   into(y) = A * B * x;       // A @ (B @ x): two GEMVs, no [M, N] product
+//
+// The tree is flattened into a sum of scaled terms, each a single matrix or a
+// chain of factors. Chains are multiplied in the order of fewest flops
+// (plan_chain), and every term is folded into D through the GEMM's alpha and
+// beta, so D is written once per term and never copied out of a temporary.
+// Only the inner products of a chain of three or more and a sum used as a
+// factor, like (A + B) * C, need scratch, which comes from the workspace
+// rather than the heap. An operand overlapping D, as in into(A) = A * B, is
+// detected and the result is staged in scratch first.
+//
+// Operands are held by view, so the matrices must outlive the expression;
+// temporary Matrix operands are rejected.
+
+// Cheapest order to multiply a chain of n matrices, factor i being
+// dims[i] x dims[i + 1], by the classic O(n^3) dynamic program over where the
+// last multiplication splits the chain
+struct ChainPlan {
+  uint32_t count = 0;
+  // 2 m n k summed over every product of the chain
+  double flops = 0;
+  // split[i * count + j] = k: factors i..j multiply as (i..k) @ (k+1..j)
+  std::vector<uint32_t> split;
+
+  uint32_t at(uint32_t i, uint32_t j) const { return split[i * count + j]; }
+
+  // The order as nested parentheses, e.g. "(A (B x))"
+  std::string describe(const std::vector<std::string> &names) const {
+    return count == 0 ? "" : describe(names, 0, count - 1);
+  }
+
+private:
+  std::string describe(const std::vector<std::string> &names, uint32_t i,
+                       uint32_t j) const {
+    if (i == j) {
+      return i < names.size() ? names[i] : "M" + std::to_string(i);
+    }
+    return "(" + describe(names, i, at(i, j)) + " " +
+           describe(names, at(i, j) + 1, j) + ")";
+  }
+};
+
+inline ChainPlan plan_chain(const std::vector<uint32_t> &dims) {
+  ChainPlan plan;
+  plan.count = dims.size() < 2 ? 0 : uint32_t(dims.size() - 1);
+  uint32_t n = plan.count;
+  plan.split.assign(size_t(n) * n, 0);
+  std::vector<double> cost(size_t(n) * n, 0);
+  for (uint32_t length = 2; length <= n; length++) {
+    for (uint32_t i = 0; i + length <= n; i++) {
+      uint32_t j = i + length - 1;
+      double best = -1;
+      for (uint32_t k = i; k < j; k++) {
+        double c = cost[i * n + k] + cost[(k + 1) * n + j] +
+                   2.0 * dims[i] * dims[k + 1] * dims[j + 1];
+        if (best < 0 || c < best) {
+          best = c;
+          plan.split[i * n + j] = k;
+        }
+      }
+      cost[i * n + j] = best;
+    }
+  }
+  plan.flops = n == 0 ? 0 : cost[n - 1];
+  return plan;
+}
+
+// Expression nodes. rows() and cols() give the shape of the result.
+
+struct Leaf {
+  MatrixView<const float> view;
+
+  uint32_t rows() const { return view.get_height(); }
+  uint32_t cols() const { return view.get_width(); }
+};
+
+template <typename L, typename R> struct Product {
+  L left;
+  R right;
+
+  uint32_t rows() const { return left.rows(); }
+  uint32_t cols() const { return right.cols(); }
+};
+
+template <typename L, typename R> struct Sum {
+  L left;
+  R right;
+
+  uint32_t rows() const { return left.rows(); }
+  uint32_t cols() const { return left.cols(); }
+};
+
+template <typename E> struct Scaled {
+  float scale;
+  E expr;
+
+  uint32_t rows() const { return expr.rows(); }
+  uint32_t cols() const { return expr.cols(); }
+};
+
+template <typename T> struct IsNode : std::false_type {};
+template <> struct IsNode<Leaf> : std::true_type {};
+template <typename L, typename R>
+struct IsNode<Product<L, R>> : std::true_type {};
+template <typename L, typename R> struct IsNode<Sum<L, R>> : std::true_type {};
+template <typename E> struct IsNode<Scaled<E>> : std::true_type {};
+
+// What the operators accept: nodes, float matrices and views of them
+template <typename T> struct IsOperand : IsNode<T> {};
+template <> struct IsOperand<Matrix<float>> : std::true_type {};
+template <> struct IsOperand<MatrixView<float>> : std::true_type {};
+template <> struct IsOperand<MatrixView<const float>> : std::true_type {};
+
+template <typename T>
+using EnableOperand = std::enable_if_t<
+    IsOperand<std::remove_cv_t<std::remove_reference_t<T>>>::value>;
+
+inline Leaf node(MatrixView<const float> view) { return Leaf{view}; }
+
+inline Leaf node(const Matrix<float> &m) { return Leaf{m.view()}; }
+
+// The view would dangle as soon as the full expression ends
+void node(Matrix<float> &&m) = delete;
+
+template <typename E, typename = std::enable_if_t<IsNode<E>::value>>
+const E &node(const E &e) {
+  return e;
+}
+
+template <typename T>
+using NodeOf = std::decay_t<decltype(node(std::declval<T>()))>;
+
+template <typename L, typename R, typename = EnableOperand<L>,
+          typename = EnableOperand<R>>
+Product<NodeOf<L>, NodeOf<R>> operator*(L &&l, R &&r) {
+  return {node(std::forward<L>(l)), node(std::forward<R>(r))};
+}
+
+template <typename E, typename = EnableOperand<E>>
+Scaled<NodeOf<E>> operator*(float scale, E &&e) {
+  return {scale, node(std::forward<E>(e))};
+}
+
+template <typename E, typename = EnableOperand<E>>
+Scaled<NodeOf<E>> operator*(E &&e, float scale) {
+  return {scale, node(std::forward<E>(e))};
+}
+
+template <typename E, typename = EnableOperand<E>>
+Scaled<NodeOf<E>> operator-(E &&e) {
+  return {-1.0f, node(std::forward<E>(e))};
+}
+
+template <typename L, typename R, typename = EnableOperand<L>,
+          typename = EnableOperand<R>>
+Sum<NodeOf<L>, NodeOf<R>> operator+(L &&l, R &&r) {
+  return {node(std::forward<L>(l)), node(std::forward<R>(r))};
+}
+
+template <typename L, typename R, typename = EnableOperand<L>,
+          typename = EnableOperand<R>>
+Sum<NodeOf<L>, Scaled<NodeOf<R>>> operator-(L &&l, R &&r) {
+  return {node(std::forward<L>(l)), {-1.0f, node(std::forward<R>(r))}};
+}
+
+namespace detail {
+
+// scale * factors[0] @ factors[1] @ ..., a single matrix when there is one
+struct Term {
+  float scale;
+  std::vector<MatrixView<const float>> factors;
+};
+
+inline void checkShapes(const Leaf &) {}
+template <typename L, typename R> void checkShapes(const Product<L, R> &e);
+template <typename L, typename R> void checkShapes(const Sum<L, R> &e);
+template <typename E> void checkShapes(const Scaled<E> &e);
+
+template <typename L, typename R> void checkShapes(const Product<L, R> &e) {
+  checkShapes(e.left);
+  checkShapes(e.right);
+  if (e.left.cols() != e.right.rows()) {
+    throw std::invalid_argument(
+        "expr: [" + std::to_string(e.left.rows()) + ", " +
+        std::to_string(e.left.cols()) + "] @ [" +
+        std::to_string(e.right.rows()) + ", " +
+        std::to_string(e.right.cols()) + "]");
+  }
+}
+
+template <typename L, typename R> void checkShapes(const Sum<L, R> &e) {
+  checkShapes(e.left);
+  checkShapes(e.right);
+  if (e.left.rows() != e.right.rows() || e.left.cols() != e.right.cols()) {
+    throw std::invalid_argument(
+        "expr: [" + std::to_string(e.left.rows()) + ", " +
+        std::to_string(e.left.cols()) + "] + [" +
+        std::to_string(e.right.rows()) + ", " +
+        std::to_string(e.right.cols()) + "]");
+  }
+}
+
+template <typename E> void checkShapes(const Scaled<E> &e) {
+  checkShapes(e.expr);
+}
+
+// First and one past the last element a view can touch
+inline std::pair<const float *, const float *>
+extent(MatrixView<const float> v) {
+  int64_t last = int64_t(v.get_height() - 1) * v.get_row_stride() +
+                 int64_t(v.get_width() - 1) * v.get_col_stride();
+  const float *a = v.data(), *b = v.data() + last;
+  return {std::min(a, b), std::max(a, b) + 1};
+}
+
+inline bool overlaps(MatrixView<const float> a, MatrixView<const float> b) {
+  if (a.get_width() == 0 || a.get_height() == 0 || b.get_width() == 0 ||
+      b.get_height() == 0) {
+    return false;
+  }
+  auto ea = extent(a), eb = extent(b);
+  return ea.first < eb.second && eb.first < ea.second;
+}
+
+inline bool sameView(MatrixView<const float> a, MatrixView<const float> b) {
+  return a.data() == b.data() && a.get_width() == b.get_width() &&
+         a.get_height() == b.get_height() &&
+         a.get_row_stride() == b.get_row_stride() &&
+         a.get_col_stride() == b.get_col_stride();
+}
+
+// Flattens expression trees into terms and evaluates them into a destination
+class Evaluator {
+public:
+  Evaluator(uint32_t threads, Workspace &workspace)
+      : _threads(threads), _workspace(workspace) {}
+
+  // Appends the terms of scale * e
+  void collectTerms(const Leaf &e, float scale, std::vector<Term> &terms) {
+    terms.push_back({scale, {e.view}});
+  }
+
+  template <typename L, typename R>
+  void collectTerms(const Product<L, R> &e, float scale,
+                    std::vector<Term> &terms) {
+    Term term{scale, {}};
+    collectFactors(e, term.scale, term.factors);
+    terms.push_back(std::move(term));
+  }
+
+  template <typename L, typename R>
+  void collectTerms(const Sum<L, R> &e, float scale,
+                    std::vector<Term> &terms) {
+    collectTerms(e.left, scale, terms);
+    collectTerms(e.right, scale, terms);
+  }
+
+  template <typename E>
+  void collectTerms(const Scaled<E> &e, float scale, std::vector<Term> &terms) {
+    collectTerms(e.expr, scale * e.scale, terms);
+  }
+
+  // D = keep * D + the sum of terms
+  void assign(MatrixView<float> D, std::vector<Term> terms, float keep) {
+    bool overlap = false;
+    for (const Term &term : terms) {
+      for (const MatrixView<const float> &factor : term.factors) {
+        bool alias = term.factors.size() == 1 && sameView(factor, D);
+        overlap |= !alias && overlaps(factor, D);
+      }
+    }
+    if (!overlap) {
+      accumulate(D, terms, keep);
+      return;
+    }
+
+    // Evaluated into scratch, with D's old value an operand like any other
+    Workspace::Scope scope(_workspace);
+    uint32_t rows = D.get_height(), cols = D.get_width();
+    MatrixView<float> staged(_workspace.alloc<float>(size_t(rows) * cols),
+                             cols, rows, cols);
+    if (keep != 0) {
+      terms.push_back({keep, {D}});
+    }
+    accumulate(staged, terms, 0);
+    axpby(D, 0, 1, staged);
+  }
+
+private:
+  void collectFactors(const Leaf &e, float &,
+                      std::vector<MatrixView<const float>> &factors) {
+    factors.push_back(e.view);
+  }
+
+  template <typename L, typename R>
+  void collectFactors(const Product<L, R> &e, float &scale,
+                      std::vector<MatrixView<const float>> &factors) {
+    collectFactors(e.left, scale, factors);
+    collectFactors(e.right, scale, factors);
+  }
+
+  template <typename E>
+  void collectFactors(const Scaled<E> &e, float &scale,
+                      std::vector<MatrixView<const float>> &factors) {
+    scale *= e.scale;
+    collectFactors(e.expr, scale, factors);
+  }
+
+  // A sum inside a product is evaluated into scratch that lives as long as
+  // the caller's workspace scope
+  template <typename L, typename R>
+  void collectFactors(const Sum<L, R> &e, float &,
+                      std::vector<MatrixView<const float>> &factors) {
+    MatrixView<float> value(
+        _workspace.alloc<float>(size_t(e.rows()) * e.cols()), e.cols(),
+        e.rows(), e.cols());
+    std::vector<Term> terms;
+    collectTerms(e, 1, terms);
+    assign(value, std::move(terms), 0);
+    factors.push_back(value);
+  }
+
+  // D = beta * D + alpha * X, not reading D when beta is 0 nor X when alpha
+  // is 0
+  void axpby(MatrixView<float> D, float beta, float alpha,
+             MatrixView<const float> X) {
+    if (alpha == 0) {
+      X = D;
+    }
+    uint32_t rows = D.get_height(), cols = D.get_width();
+    bool contiguous = D.get_col_stride() == 1 && X.get_col_stride() == 1;
+    uint32_t tasks = std::max(1u, (rows + ROWS_PER_TASK - 1) / ROWS_PER_TASK);
+    ThreadPool::global().parallel_for(
+        tasks,
+        [&](uint32_t task, uint32_t) {
+          uint32_t r0 = task * ROWS_PER_TASK;
+          uint32_t r1 = std::min(rows, r0 + ROWS_PER_TASK);
+          for (uint32_t i = r0; i < r1; i++) {
+            if (!contiguous) {
+              for (uint32_t j = 0; j < cols; j++) {
+                float x = alpha == 0 ? 0 : alpha * X.r(i, j);
+                D.a(i, j) = beta == 0 ? x : beta * D.r(i, j) + x;
+              }
+              continue;
+            }
+            float *d = &D.a(i, 0);
+            const float *x = &X.r(i, 0);
+            if (alpha == 0) {
+              for (uint32_t j = 0; j < cols; j++) {
+                d[j] = beta == 0 ? 0 : beta * d[j];
+              }
+            } else if (beta == 0) {
+              for (uint32_t j = 0; j < cols; j++) {
+                d[j] = alpha * x[j];
+              }
+            } else {
+              for (uint32_t j = 0; j < cols; j++) {
+                d[j] = beta * d[j] + alpha * x[j];
+              }
+            }
+          }
+        },
+        _threads);
+  }
+
+  // factors[i] @ ... @ factors[j] by plan, into dest
+  void multiply(const std::vector<MatrixView<const float>> &factors,
+                const ChainPlan &plan, uint32_t i, uint32_t j,
+                MatrixView<float> dest, const Epilogue &epilogue) {
+    uint32_t k = plan.at(i, j);
+    MatrixView<const float> left = operand(factors, plan, i, k);
+    MatrixView<const float> right = operand(factors, plan, k + 1, j);
+    parallel::packed_matmul_fused_threads(left, right, dest, epilogue,
+                                          _threads, _workspace);
+  }
+
+  MatrixView<const float>
+  operand(const std::vector<MatrixView<const float>> &factors,
+          const ChainPlan &plan, uint32_t i, uint32_t j) {
+    if (i == j) {
+      return factors[i];
+    }
+    uint32_t rows = factors[i].get_height(), cols = factors[j].get_width();
+    MatrixView<float> value(_workspace.alloc<float>(size_t(rows) * cols), cols,
+                            rows, cols);
+    multiply(factors, plan, i, j, value, Epilogue());
+    return value;
+  }
+
+  // As assign, for a D no operand overlaps, except terms that are D itself
+  void accumulate(MatrixView<float> D, const std::vector<Term> &terms,
+                  float keep) {
+    // D's current value counts with weight beta, when live
+    float beta = keep;
+    bool live = keep != 0;
+    for (const Term &term : terms) {
+      if (term.factors.size() == 1 && sameView(term.factors[0], D)) {
+        beta += term.scale;
+        live = true;
+      }
+    }
+
+    for (const Term &term : terms) {
+      if (term.factors.size() == 1 && !sameView(term.factors[0], D)) {
+        axpby(D, live ? beta : 0, term.scale, term.factors[0]);
+        beta = 1;
+        live = true;
+      }
+    }
+
+    for (const Term &term : terms) {
+      if (term.factors.size() < 2) {
+        continue;
+      }
+      std::vector<uint32_t> dims{term.factors[0].get_height()};
+      for (const MatrixView<const float> &factor : term.factors) {
+        dims.push_back(factor.get_width());
+      }
+      ChainPlan plan = plan_chain(dims);
+
+      Workspace::Scope scope(_workspace);
+      Epilogue epilogue;
+      epilogue.alpha = term.scale;
+      epilogue.beta = live ? beta : 0;
+      multiply(term.factors, plan, 0, plan.count - 1, D, epilogue);
+      beta = 1;
+      live = true;
+    }
+
+    if (!live) {
+      axpby(D, 0, 0, D);
+    } else if (beta != 1) {
+      axpby(D, beta, 0, D);
+    }
+  }
+
+  static constexpr uint32_t ROWS_PER_TASK = 64;
+
+  uint32_t _threads;
+  Workspace &_workspace;
+};
+
+} // namespace detail
+
+// D = e, or D = keep * D + e, on `threads` workers of the global pool (0 for
+// all of them). Throws std::invalid_argument when the shapes do not match.
+template <typename E, typename = EnableOperand<E>>
+void assign(MatrixView<float> D, const E &e, float keep = 0,
+            uint32_t threads = 0, Workspace &workspace = Workspace::local()) {
+  const auto &root = node(e);
+  detail::checkShapes(root);
+  if (root.rows() != D.get_height() || root.cols() != D.get_width()) {
+    throw std::invalid_argument(
+        "expr: assigning [" + std::to_string(root.rows()) + ", " +
+        std::to_string(root.cols()) + "] to [" +
+        std::to_string(D.get_height()) + ", " + std::to_string(D.get_width()) +
+        "]");
+  }
+
+  Workspace::Scope scope(workspace);
+  detail::Evaluator evaluator(threads, workspace);
+  std::vector<detail::Term> terms;
+  evaluator.collectTerms(root, 1, terms);
+  evaluator.assign(D, std::move(terms), keep);
+}
+
+// Destination of an expression, so that into(D) = A * B + C reads naturally
+class Target {
+public:
+  Target(MatrixView<float> D, uint32_t threads) : _D(D), _threads(threads) {}
+
+  template <typename E, typename = EnableOperand<E>>
+  Target &operator=(const E &e) {
+    assign(_D, e, 0, _threads);
+    return *this;
+  }
+
+  template <typename E, typename = EnableOperand<E>>
+  Target &operator+=(const E &e) {
+    assign(_D, e, 1, _threads);
+    return *this;
+  }
+
+  template <typename E, typename = EnableOperand<E>>
+  Target &operator-=(const E &e) {
+    assign(_D, -1.0f * e, 1, _threads);
+    return *this;
+  }
+
+private:
+  MatrixView<float> _D;
+  uint32_t _threads;
+};
+
+inline Target into(MatrixView<float> D, uint32_t threads = 0) {
+  return Target(D, threads);
+}
+
+// A new matrix holding e
+template <typename E, typename = EnableOperand<E>>
+Matrix<float> evaluate(const E &e, uint32_t threads = 0) {
+  const auto &root = node(e);
+  Matrix<float> result(root.cols(), root.rows());
+  assign(result, root, 0, threads);
+  return result;
+}
+
+} // namespace expr
+} // namespace algo
+#endif
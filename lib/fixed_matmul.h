@@ -0,0 +1,208 @@
+#include "cpu_features.h"
+#include "matrix.h"
+#include <algorithm>
+#include <immintrin.h>
+#include <type_traits>
+#include <utility>
+
+#ifndef __FIXED_MATMUL_H__
+#define __FIXED_MATMUL_H__
+
+using support::DYNAMIC;
+using support::Matrix;
+
+namespace algo {
+namespace fixed {
+
+// Calls f(std::integral_constant<uint32_t, I>()) for I = 0 .. N - 1, expanded
+// at compile time so every index is a constant
+template <typename F, uint32_t... I>
+inline void unrollImpl(F &f, std::integer_sequence<uint32_t, I...>) {
+  (f(std::integral_constant<uint32_t, I>()), ...);
+}
+
+template <uint32_t N, typename F> inline void unroll(F &&f) {
+  unrollImpl(f, std::make_integer_sequence<uint32_t, N>());
+}
+
+template <typename T> struct ScalarLanes {
+  static constexpr uint32_t WIDTH = 1;
+  using Vec = T;
+  static Vec zero() { return T(); }
+  static Vec broadcast(T x) { return x; }
+  static Vec load(const T *p) { return *p; }
+  static void store(T *p, Vec v) { *p = v; }
+  static Vec fmadd(Vec a, Vec b, Vec c) { return a * b + c; }
+};
+
+// The widest vector dividing a row of Cols elements. Rows of 8n floats use
+// ymm registers, 4n floats xmm registers, anything else scalars. These
+// kernels are inlined into the caller, so unlike the runtime kernels they
+// follow the caller's compile flags: ymm and FMA only when built with AVX2
+// and FMA enabled (e.g. -march=native), SSE multiply-adds otherwise. Float
+// rows of 8n in a baseline build go to matmulAvx2 instead when the CPU has
+// AVX2.
+template <typename T, uint32_t Cols> struct Lanes : ScalarLanes<T> {};
+
+#if defined(__AVX2__) && defined(__FMA__)
+constexpr bool FIXED_YMM = true;
+#else
+constexpr bool FIXED_YMM = false;
+#endif
+
+template <uint32_t Cols, uint32_t Width = FIXED_YMM && Cols % 8 == 0 ? 8
+                                          : Cols % 4 == 0             ? 4
+                                                                      : 1>
+struct FloatLanes : ScalarLanes<float> {};
+
+#if defined(__AVX2__) && defined(__FMA__)
+template <uint32_t Cols> struct FloatLanes<Cols, 8> {
+  static constexpr uint32_t WIDTH = 8;
+  using Vec = __m256;
+  static Vec zero() { return _mm256_setzero_ps(); }
+  static Vec broadcast(float x) { return _mm256_set1_ps(x); }
+  static Vec load(const float *p) { return _mm256_loadu_ps(p); }
+  static void store(float *p, Vec v) { _mm256_storeu_ps(p, v); }
+  static Vec fmadd(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); }
+};
+#endif
+
+template <uint32_t Cols> struct FloatLanes<Cols, 4> {
+  static constexpr uint32_t WIDTH = 4;
+  using Vec = __m128;
+  static Vec zero() { return _mm_setzero_ps(); }
+  static Vec broadcast(float x) { return _mm_set1_ps(x); }
+  static Vec load(const float *p) { return _mm_loadu_ps(p); }
+  static void store(float *p, Vec v) { _mm_storeu_ps(p, v); }
+#ifdef __FMA__
+  static Vec fmadd(Vec a, Vec b, Vec c) { return _mm_fmadd_ps(a, b, c); }
+#else
+  static Vec fmadd(Vec a, Vec b, Vec c) {
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+  }
+#endif
+};
+
+template <uint32_t Cols> struct Lanes<float, Cols> : FloatLanes<Cols> {};
+
+// Accumulator registers per step: rows of C are computed a few at a time so
+// every B vector loaded is used by several FMAs
+constexpr uint32_t ACCUMULATORS = 12;
+
+// C[ROWS, M] = A[ROWS, K] @ B[K, M] for contiguous rows, M a multiple of 8,
+// in ROWS * M / 8 ymm accumulators. Plain loops rather than unroll(): lambdas
+// do not take on the target of the function they are in, and every trip
+// count is a constant, so the compiler unrolls them all the same.
+template <uint32_t K, uint32_t M, uint32_t ROWS>
+TARGET_AVX2 inline void rowStepAvx2(const float *A, const float *B, float *C) {
+  constexpr uint32_t VECS = M / 8;
+  __m256 acc[ROWS][VECS];
+  for (uint32_t r = 0; r < ROWS; r++) {
+    for (uint32_t j = 0; j < VECS; j++) {
+      acc[r][j] = _mm256_setzero_ps();
+    }
+  }
+  for (uint32_t k = 0; k < K; k++) {
+    __m256 b[VECS];
+    for (uint32_t j = 0; j < VECS; j++) {
+      b[j] = _mm256_loadu_ps(B + k * M + j * 8);
+    }
+    for (uint32_t r = 0; r < ROWS; r++) {
+      __m256 a = _mm256_set1_ps(A[r * K + k]);
+      for (uint32_t j = 0; j < VECS; j++) {
+        acc[r][j] = _mm256_fmadd_ps(a, b[j], acc[r][j]);
+      }
+    }
+  }
+  for (uint32_t r = 0; r < ROWS; r++) {
+    for (uint32_t j = 0; j < VECS; j++) {
+      _mm256_storeu_ps(C + r * M + j * 8, acc[r][j]);
+    }
+  }
+}
+
+// The ymm kernel of matmul for builds without AVX2, called once the running
+// CPU was found to have it
+template <uint32_t N, uint32_t K, uint32_t M>
+TARGET_AVX2 void matmulAvx2(const float *A, const float *B, float *C) {
+  constexpr uint32_t R =
+      std::max<uint32_t>(1, std::min<uint32_t>(N, ACCUMULATORS / (M / 8)));
+  uint32_t i = 0;
+  for (; i + R <= N; i += R) {
+    rowStepAvx2<K, M, R>(A + i * K, B, C + i * M);
+  }
+  for (; i < N; i++) {
+    rowStepAvx2<K, M, 1>(A + i * K, B, C + i * M);
+  }
+}
+
+// C = A @ B for matrices with compile time shapes. A is [N, K], B [K, M] and
+// C [N, M]; mismatched shapes fail to compile. R rows of C are accumulated in
+// R * M / WIDTH vector registers with the row, k and column loops fully
+// unrolled, so small products compile to straight-line FMAs. C must not
+// alias A or B.
+template <typename T, uint32_t N, uint32_t K, uint32_t KB, uint32_t M,
+          uint32_t NC, uint32_t MC>
+inline void matmul(const Matrix<T, N, K> &A, const Matrix<T, KB, M> &B,
+                   Matrix<T, NC, MC> &C) {
+  static_assert(N != DYNAMIC && K != DYNAMIC && M != DYNAMIC,
+                "fixed kernels need compile time shapes, use the runtime "
+                "kernels for Matrix<T>");
+  static_assert(K == KB, "A is [N, K] so B must have K rows");
+  static_assert(NC == N && MC == M, "C must be [N, M]");
+
+  if constexpr (std::is_same<T, float>::value && !FIXED_YMM && M % 8 == 0) {
+    if (support::active_isa() >= support::Isa::AVX2) {
+      matmulAvx2<N, K, M>(A.data(), B.data(), C.data());
+      return;
+    }
+  }
+
+  using L = Lanes<T, M>;
+  using Vec = typename L::Vec;
+  constexpr uint32_t W = L::WIDTH;
+  constexpr uint32_t VECS = M / W;
+  constexpr uint32_t R = std::max<uint32_t>(
+      1, std::min<uint32_t>(N, ACCUMULATORS / VECS));
+
+  // C[i : i + rows] = A[i : i + rows] @ B
+  auto rowStep = [&](uint32_t i, auto rows) {
+    constexpr uint32_t ROWS = decltype(rows)::value;
+    Vec acc[ROWS][VECS];
+    unroll<ROWS>([&](auto r) {
+      unroll<VECS>([&](auto j) { acc[r][j] = L::zero(); });
+    });
+    unroll<K>([&](auto k) {
+      Vec b[VECS];
+      unroll<VECS>([&](auto j) { b[j] = L::load(&B.r(k, j * W)); });
+      unroll<ROWS>([&](auto r) {
+        Vec a = L::broadcast(A.r(i + r, k));
+        unroll<VECS>([&](auto j) { acc[r][j] = L::fmadd(a, b[j], acc[r][j]); });
+      });
+    });
+    unroll<ROWS>([&](auto r) {
+      unroll<VECS>([&](auto j) { L::store(&C.a(i + r, j * W), acc[r][j]); });
+    });
+  };
+
+  uint32_t i = 0;
+  for (; i + R <= N; i += R) {
+    rowStep(i, std::integral_constant<uint32_t, R>());
+  }
+  for (; i < N; i++) {
+    rowStep(i, std::integral_constant<uint32_t, 1>());
+  }
+}
+
+// As matmul, returning C by value
+template <typename T, uint32_t N, uint32_t K, uint32_t KB, uint32_t M>
+inline Matrix<T, N, M> matmul(const Matrix<T, N, K> &A,
+                              const Matrix<T, KB, M> &B) {
+  Matrix<T, N, M> C;
+  matmul(A, B, C);
+  return C;
+}
+
+} // namespace fixed
+} // namespace algo
+#endif
@@ -0,0 +1,271 @@
+#include "cpu_features.h"
+#include "half.h"
+#include "matrix.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cstring>
+#include <immintrin.h>
+#include <type_traits>
+
+#ifndef __GEMV_H__
+#define __GEMV_H__
+
+using support::FloatLoad;
+using support::Matrix;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace gemv {
+
+// GEMV is bound by the bandwidth of streaming A once, so every kernel here is
+// about keeping enough loads in flight: several rows at a time, two
+// accumulators per row, and software prefetch far enough ahead to cover DRAM
+// latency. On a 9216x9216 A this reads at the STREAM triad bandwidth of one
+// core. Prefetching with the NTA hint instead of T0 halved it.
+constexpr uint32_t ROWS = 4;
+// Floats ahead of the current load that are prefetched, 2KB per row
+constexpr uint32_t PREFETCH = 512;
+// Rows per task of the dot product kernel
+constexpr uint32_t ROW_BLOCK = 64;
+// Columns of y owned by a task of the axpy kernel, 8KB that stay in L1
+constexpr uint32_t COL_BLOCK = 2048;
+
+// Horizontal sum of the 8 lanes, sum8 in old_archive/matvec.cc
+TARGET_AVX2 inline float hsum(__m256 x) {
+  __m128 quad =
+      _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+  __m128 dual = _mm_add_ps(quad, _mm_movehl_ps(quad, quad));
+  return _mm_cvtss_f32(_mm_add_ss(dual, _mm_shuffle_ps(dual, dual, 0x1)));
+}
+
+// y[i] = A[i, :] . x for `rows` rows of A, whose rows are contiguous. ROWS
+// rows share each load of x; the k loop is never blocked, so unlike matvec_4
+// nothing depends on K fitting in registers. Load widens A's elements to
+// float (see support::FloatLoad), so 16-bit A streams half the bytes.
+template <typename Load, typename T>
+TARGET_AVX2 inline void dotRows(const T *A, int64_t lda, const float *x,
+                                float *y, uint32_t rows, uint32_t K) {
+  uint32_t K16 = K / 16 * 16;
+  uint32_t i = 0;
+  for (; i + ROWS <= rows; i += ROWS) {
+    const T *a[ROWS];
+    __m256 acc[ROWS][2];
+    for (uint32_t r = 0; r < ROWS; r++) {
+      a[r] = A + (i + r) * lda;
+      acc[r][0] = _mm256_setzero_ps();
+      acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (uint32_t k = 0; k < K16; k += 16) {
+      __m256 x0 = _mm256_loadu_ps(x + k);
+      __m256 x1 = _mm256_loadu_ps(x + k + 8);
+      for (uint32_t r = 0; r < ROWS; r++) {
+        _mm_prefetch(reinterpret_cast<const char *>(a[r] + k + PREFETCH),
+                     _MM_HINT_T0);
+        acc[r][0] = _mm256_fmadd_ps(Load::load8(a[r] + k), x0, acc[r][0]);
+        acc[r][1] = _mm256_fmadd_ps(Load::load8(a[r] + k + 8), x1, acc[r][1]);
+      }
+    }
+
+    for (uint32_t r = 0; r < ROWS; r++) {
+      float sum = hsum(_mm256_add_ps(acc[r][0], acc[r][1]));
+      for (uint32_t k = K16; k < K; k++) {
+        sum += Load::load1(a[r] + k) * x[k];
+      }
+      y[i + r] = sum;
+    }
+  }
+
+  for (; i < rows; i++) {
+    const T *a = A + i * lda;
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (uint32_t k = 0; k < K16; k += 16) {
+      acc0 = _mm256_fmadd_ps(Load::load8(a + k), _mm256_loadu_ps(x + k), acc0);
+      acc1 = _mm256_fmadd_ps(Load::load8(a + k + 8), _mm256_loadu_ps(x + k + 8),
+                             acc1);
+    }
+    float sum = hsum(_mm256_add_ps(acc0, acc1));
+    for (uint32_t k = K16; k < K; k++) {
+      sum += Load::load1(a + k) * x[k];
+    }
+    y[i] = sum;
+  }
+}
+
+// y[j] = sum_k x[k] * A[k, j] for `cols` columns, the vectorized matvecT_5.
+// A's rows are contiguous; ROWS rows are folded into each load/store of y,
+// which stays in L1 while all of K streams past it. The ROWS segments of A
+// are long enough for the hardware prefetcher, software prefetch only slowed
+// this loop down.
+template <typename Load, typename T>
+TARGET_AVX2 inline void axpyRows(const T *A, int64_t lda, const float *x,
+                                 float *y, uint32_t K, uint32_t cols) {
+  uint32_t cols8 = cols / 8 * 8;
+  std::memset(y, 0, sizeof(float) * cols);
+
+  uint32_t k = 0;
+  for (; k + ROWS <= K; k += ROWS) {
+    const T *a[ROWS];
+    __m256 xk[ROWS];
+    for (uint32_t r = 0; r < ROWS; r++) {
+      a[r] = A + (k + r) * lda;
+      xk[r] = _mm256_set1_ps(x[k + r]);
+    }
+
+    for (uint32_t j = 0; j < cols8; j += 8) {
+      __m256 acc = _mm256_loadu_ps(y + j);
+      for (uint32_t r = 0; r < ROWS; r++) {
+        acc = _mm256_fmadd_ps(Load::load8(a[r] + j), xk[r], acc);
+      }
+      _mm256_storeu_ps(y + j, acc);
+    }
+    for (uint32_t j = cols8; j < cols; j++) {
+      for (uint32_t r = 0; r < ROWS; r++) {
+        y[j] += Load::load1(a[r] + j) * x[k + r];
+      }
+    }
+  }
+
+  for (; k < K; k++) {
+    const T *a = A + k * lda;
+    __m256 xk = _mm256_set1_ps(x[k]);
+    for (uint32_t j = 0; j < cols8; j += 8) {
+      _mm256_storeu_ps(y + j, _mm256_fmadd_ps(Load::load8(a + j), xk,
+                                              _mm256_loadu_ps(y + j)));
+    }
+    for (uint32_t j = cols8; j < cols; j++) {
+      y[j] += Load::load1(a + j) * x[k];
+    }
+  }
+}
+
+// Distance between consecutive elements of a row or column vector view
+template <typename T> inline int64_t vectorStride(const MatrixView<T> &v) {
+  return v.get_width() == 1 ? v.get_row_stride() : v.get_col_stride();
+}
+
+// Runs fn(task) on up to `threads` workers of the global pool. A single
+// thread runs inline and never starts the pool.
+template <typename F>
+void forTasks(uint32_t tasks, uint32_t threads, F &&fn) {
+  if (threads == 1) {
+    for (uint32_t task = 0; task < tasks; task++) {
+      fn(task);
+    }
+    return;
+  }
+  ThreadPool::global().parallel_for(
+      tasks, [&](uint32_t task, uint32_t) { fn(task); }, threads);
+}
+
+// y = A @ x, with A [M, K], x a row or column vector of K elements and y one
+// of M elements. Row-major A runs the dot product kernel split by rows,
+// column-major A (a transposed view) the axpy kernel split by columns of
+// y, and anything else (or any layout without AVX2) a scalar loop. x is
+// staged through workspace when strided or not float. threads == 0 uses the
+// whole global pool. LoadA and LoadX give the storage types of A and x.
+template <typename LoadA, typename LoadX>
+void gemvImpl(MatrixView<const typename LoadA::type> A,
+              MatrixView<const typename LoadX::type> x, MatrixView<float> y,
+              uint32_t threads, Workspace &workspace) {
+  uint32_t M = A.get_height(), K = A.get_width();
+  int64_t strideX = vectorStride(x), strideY = vectorStride(y);
+  if (M == 0) {
+    return;
+  }
+
+  Workspace::Scope scope(workspace);
+  const float *xs = nullptr;
+  if constexpr (std::is_same<typename LoadX::type, float>::value) {
+    xs = x.data();
+  }
+  if (xs == nullptr || (strideX != 1 && K > 1)) {
+    float *staged = workspace.alloc<float>(K);
+    for (uint32_t k = 0; k < K; k++) {
+      staged[k] = LoadX::load1(x.data() + k * strideX);
+    }
+    xs = staged;
+  }
+  float *ys = strideY == 1 || M == 1 ? y.data() : workspace.alloc<float>(M);
+
+  if (threads != 1) {
+    threads = threads == 0 ? ThreadPool::global().size()
+                           : std::min(threads, ThreadPool::global().size());
+  }
+
+  bool vector = support::active_isa() >= support::Isa::AVX2;
+  if (vector && A.get_col_stride() == 1) {
+    int64_t lda = A.get_row_stride();
+    forTasks((M + ROW_BLOCK - 1) / ROW_BLOCK, threads, [&](uint32_t task) {
+      uint32_t i0 = task * ROW_BLOCK;
+      dotRows<LoadA>(A.data() + i0 * lda, lda, xs, ys + i0,
+                     std::min(ROW_BLOCK, M - i0), K);
+    });
+  } else if (vector && A.get_row_stride() == 1) {
+    int64_t lda = A.get_col_stride();
+    forTasks((M + COL_BLOCK - 1) / COL_BLOCK, threads, [&](uint32_t task) {
+      uint32_t j0 = task * COL_BLOCK;
+      axpyRows<LoadA>(A.data() + j0, lda, xs, ys + j0, K,
+                      std::min(COL_BLOCK, M - j0));
+    });
+  } else {
+    for (uint32_t i = 0; i < M; i++) {
+      float sum = 0;
+      for (uint32_t k = 0; k < K; k++) {
+        sum += LoadA::load1(&A.r(i, k)) * xs[k];
+      }
+      ys[i] = sum;
+    }
+  }
+
+  if (ys != y.data()) {
+    for (uint32_t i = 0; i < M; i++) {
+      y.data()[i * strideY] = ys[i];
+    }
+  }
+}
+
+inline void gemv_threads(MatrixView<const float> A, MatrixView<const float> x,
+                         MatrixView<float> y, uint32_t threads,
+                         Workspace &workspace = Workspace::local()) {
+  gemvImpl<FloatLoad, FloatLoad>(A, x, y, threads, workspace);
+}
+
+// y = A @ x on every worker of the global pool
+inline void gemv(MatrixView<const float> A, MatrixView<const float> x,
+                 MatrixView<float> y) {
+  gemv_threads(A, x, y, 0);
+}
+
+// y = A^T @ x, with A [K, M]
+inline void gemv_t(MatrixView<const float> A, MatrixView<const float> x,
+                   MatrixView<float> y) {
+  gemv_threads(A.t(), x, y, 0);
+}
+
+// Runs A @ B -> C as a GEMV when C is a single row or column and returns
+// true, false for a real GEMM. Used by the GEMM entry points.
+template <typename LoadA = FloatLoad, typename LoadB = FloatLoad>
+bool matmul_as_gemv(MatrixView<const typename LoadA::type> A,
+                    MatrixView<const typename LoadB::type> B,
+                    MatrixView<float> C, uint32_t threads,
+                    Workspace &workspace) {
+  if (C.get_width() == 1) {
+    // C[:, 0] = A @ B[:, 0]
+    gemvImpl<LoadA, LoadB>(A, B, C, threads, workspace);
+    return true;
+  }
+  if (C.get_height() == 1) {
+    // C[0, :] = B^T @ A[0, :]
+    gemvImpl<LoadB, LoadA>(B.t(), A, C, threads, workspace);
+    return true;
+  }
+  return false;
+}
+
+} // namespace gemv
+} // namespace algo
+#endif
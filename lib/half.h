@@ -0,0 +1,173 @@
+#include "cpu_features.h"
+#include "matrix.h"
+#include <stdint.h>
+#include <cstring>
+#include <immintrin.h>
+
+#ifndef __HALF_H__
+#define __HALF_H__
+
+namespace support {
+
+// 16-bit floating point formats a Matrix<uint16_t> can hold. Both are
+// converted to float on load and every product is accumulated in float.
+enum class HalfFormat {
+    // bfloat16: the top half of a float, 8 exponent and 7 mantissa bits
+    BF16,
+    // IEEE 754 binary16: 5 exponent and 10 mantissa bits
+    FP16,
+};
+
+inline const char* half_format_name(HalfFormat format) {
+    return format == HalfFormat::BF16 ? "bf16" : "fp16";
+}
+
+inline float bf16_to_float(uint16_t h) {
+    uint32_t bits = uint32_t(h) << 16;
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// Rounds to nearest even, NaNs stay NaN
+inline uint16_t float_to_bf16(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return uint16_t((bits >> 16) | 0x40);
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return uint16_t(bits >> 16);
+}
+
+// fp16 <-> float in integer arithmetic, so scalar code needs no F16C. Both
+// round to nearest even and agree with _mm256_cvtph_ps / _mm256_cvtps_ph.
+inline float fp16_to_float(uint16_t h) {
+    const uint32_t exponent = 0x7c00u << 13;
+    uint32_t bits = uint32_t(h & 0x7fff) << 13;
+    uint32_t e = bits & exponent;
+    // Rebias the exponent from 15 to 127
+    bits += (127 - 15) << 23;
+    if (e == exponent) {
+        // Inf and NaN keep the maximum exponent
+        bits += (128 - 16) << 23;
+    } else if (e == 0) {
+        // Subnormals are renormalized by a float subtraction
+        const uint32_t magic_bits = 113u << 23;
+        float value, magic;
+        bits += 1 << 23;
+        std::memcpy(&value, &bits, sizeof(value));
+        std::memcpy(&magic, &magic_bits, sizeof(magic));
+        value -= magic;
+        std::memcpy(&bits, &value, sizeof(bits));
+    }
+    bits |= uint32_t(h & 0x8000) << 16;
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// Out of range values become infinity, NaNs the quiet NaN 0x7e00
+inline uint16_t float_to_fp16(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    bits &= 0x7fffffff;
+
+    uint16_t h;
+    if (bits >= (127u + 16) << 23) {
+        h = bits > 0x7f800000 ? 0x7e00 : 0x7c00;
+    } else if (bits < 113u << 23) {
+        // Below the smallest normal fp16: adding 0.5 shifts the value to the
+        // bottom of the mantissa, rounded by the float addition
+        const uint32_t magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+        float value, magic;
+        std::memcpy(&value, &bits, sizeof(value));
+        std::memcpy(&magic, &magic_bits, sizeof(magic));
+        value += magic;
+        std::memcpy(&bits, &value, sizeof(bits));
+        h = uint16_t(bits - magic_bits);
+    } else {
+        uint32_t odd = (bits >> 13) & 1;
+        bits += ((15u - 127) << 23) + 0xfff + odd;
+        h = uint16_t(bits >> 13);
+    }
+    return h | sign;
+}
+
+// Element loaders used by the kernels that accept several storage types.
+// load8 widens 8 consecutive elements to floats and is only for AVX2 kernels,
+// load1 a single one.
+struct FloatLoad {
+    using type = float;
+
+    TARGET_AVX2 static __m256 load8(const float* p) {
+        return _mm256_loadu_ps(p);
+    }
+
+    static float load1(const float* p) {
+        return *p;
+    }
+};
+
+struct BF16Load {
+    using type = uint16_t;
+
+    // Zero extend to 32 bits and shift into the top half
+    TARGET_AVX2 static __m256 load8(const uint16_t* p) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+    }
+
+    static float load1(const uint16_t* p) {
+        return bf16_to_float(*p);
+    }
+};
+
+struct FP16Load {
+    using type = uint16_t;
+
+    // F16C conversion
+    TARGET_AVX2 static __m256 load8(const uint16_t* p) {
+        return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    static float load1(const uint16_t* p) {
+        return fp16_to_float(*p);
+    }
+};
+
+// Calls fn(BF16Load()) or fn(FP16Load()), turning the runtime format into a
+// loader type the kernels are instantiated with
+template <typename F>
+void with_half_load(HalfFormat format, F&& fn) {
+    if (format == HalfFormat::BF16) {
+        fn(BF16Load());
+    } else {
+        fn(FP16Load());
+    }
+}
+
+// dst = src rounded to the 16-bit format, shapes must match
+inline void to_half(MatrixView<const float> src, MatrixView<uint16_t> dst, HalfFormat format) {
+    for (uint32_t r = 0; r < src.get_height(); r++) {
+        for (uint32_t c = 0; c < src.get_width(); c++) {
+            float x = src.r(r, c);
+            dst.a(r, c) = format == HalfFormat::BF16 ? float_to_bf16(x) : float_to_fp16(x);
+        }
+    }
+}
+
+// dst = src widened to float, shapes must match
+inline void from_half(MatrixView<const uint16_t> src, MatrixView<float> dst, HalfFormat format) {
+    for (uint32_t r = 0; r < src.get_height(); r++) {
+        for (uint32_t c = 0; c < src.get_width(); c++) {
+            uint16_t h = src.r(r, c);
+            dst.a(r, c) = format == HalfFormat::BF16 ? bf16_to_float(h) : fp16_to_float(h);
+        }
+    }
+}
+
+} // namespace support
+
+#endif
@@ -0,0 +1,73 @@
+#include "gemv.h"
+#include "half.h"
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "workspace.h"
+
+#ifndef __HALF_MATMUL_H__
+#define __HALF_MATMUL_H__
+
+using support::HalfFormat;
+using support::MatrixView;
+using support::Workspace;
+
+namespace algo {
+namespace half {
+
+// Mixed precision GEMM/GEMV on bf16 or fp16 storage. Operands stay 16-bit in
+// memory; the packed GEMM widens them while packing panels (bf16 by shifting
+// into the top half of a float, fp16 with F16C) and the GEMV widens A as it
+// streams it, so weights cost half the bandwidth of float. All products are
+// accumulated in float and C is float.
+
+// C = A @ B with both operands 16-bit
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void half_matmul_ws(MatrixView<const uint16_t> A, MatrixView<const uint16_t> B,
+                    MatrixView<float> C, HalfFormat format,
+                    Workspace &workspace) {
+  support::with_half_load(format, [&](auto load) {
+    using Load = decltype(load);
+    packed::packedGemm<tileMC, tileKC, tileNC, Load, Load>(A, B, C,
+                                                           workspace);
+  });
+}
+
+// C = A @ B with float activations A and 16-bit weights B
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void half_matmul_ws(MatrixView<const float> A, MatrixView<const uint16_t> B,
+                    MatrixView<float> C, HalfFormat format,
+                    Workspace &workspace) {
+  support::with_half_load(format, [&](auto load) {
+    using Load = decltype(load);
+    packed::packedGemm<tileMC, tileKC, tileNC, support::FloatLoad, Load>(
+        A, B, C, workspace);
+  });
+}
+
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void half_matmul(MatrixView<const uint16_t> A, MatrixView<const uint16_t> B,
+                 MatrixView<float> C, HalfFormat format) {
+  half_matmul_ws<tileMC, tileKC, tileNC>(A, B, C, format, Workspace::local());
+}
+
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void half_matmul(MatrixView<const float> A, MatrixView<const uint16_t> B,
+                 MatrixView<float> C, HalfFormat format) {
+  half_matmul_ws<tileMC, tileKC, tileNC>(A, B, C, format, Workspace::local());
+}
+
+// y = A @ x for 16-bit A [M, K] and float x, on `threads` workers of the
+// global pool (0 means all). See gemv::gemv_threads.
+inline void half_gemv(MatrixView<const uint16_t> A, MatrixView<const float> x,
+                      MatrixView<float> y, HalfFormat format,
+                      uint32_t threads = 0) {
+  support::with_half_load(format, [&](auto load) {
+    using Load = decltype(load);
+    gemv::gemvImpl<Load, support::FloatLoad>(A, x, y, threads,
+                                              Workspace::local());
+  });
+}
+
+} // namespace half
+} // namespace algo
+#endif
@@ -0,0 +1,690 @@
+#include "cpu_features.h"
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <immintrin.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef __INT8_MATMUL_H__
+#define __INT8_MATMUL_H__
+
+using support::Matrix;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace quant {
+
+// Affine quantization, real = scale * (q - zero_point). Either one value for
+// the whole matrix or one per row of A, per column of B and per column of a
+// requantized C.
+struct QuantParams {
+  std::vector<float> scale{1.0f};
+  std::vector<int32_t> zero_point{0};
+
+  QuantParams() = default;
+  QuantParams(float scale, int32_t zero_point)
+      : scale{scale}, zero_point{zero_point} {}
+  QuantParams(std::vector<float> scale, std::vector<int32_t> zero_point)
+      : scale(std::move(scale)), zero_point(std::move(zero_point)) {}
+
+  float scale_at(uint32_t i) const {
+    return scale.size() == 1 ? scale[0] : scale[i];
+  }
+  int32_t zero_point_at(uint32_t i) const {
+    return zero_point.size() == 1 ? zero_point[0] : zero_point[i];
+  }
+};
+
+// Which values share a scale and zero point
+enum class QuantAxis { TENSOR, ROWS, COLUMNS };
+
+inline int8_t saturate_int8(int32_t x) {
+  return int8_t(std::min(127, std::max(-128, x)));
+}
+
+// dst = src quantized to int8 over the full [-128, 127] range, returning the
+// parameters. Every range is widened to include 0 so zero is exact.
+inline QuantParams quantize(MatrixView<const float> src, MatrixView<int8_t> dst,
+                            QuantAxis axis) {
+  uint32_t height = src.get_height(), width = src.get_width();
+  uint32_t groups = axis == QuantAxis::TENSOR ? 1
+                    : axis == QuantAxis::ROWS ? height
+                                              : width;
+  auto group = [&](uint32_t i, uint32_t j) {
+    return axis == QuantAxis::TENSOR ? 0 : axis == QuantAxis::ROWS ? i : j;
+  };
+
+  std::vector<float> lo(groups, 0.0f), hi(groups, 0.0f);
+  for (uint32_t i = 0; i < height; i++) {
+    for (uint32_t j = 0; j < width; j++) {
+      uint32_t g = group(i, j);
+      lo[g] = std::min(lo[g], src.r(i, j));
+      hi[g] = std::max(hi[g], src.r(i, j));
+    }
+  }
+
+  QuantParams params{std::vector<float>(groups),
+                     std::vector<int32_t>(groups)};
+  for (uint32_t g = 0; g < groups; g++) {
+    float scale = hi[g] > lo[g] ? (hi[g] - lo[g]) / 255.0f : 1.0f;
+    params.scale[g] = scale;
+    params.zero_point[g] = std::min<int32_t>(
+        127, std::max<int32_t>(-128, int32_t(std::nearbyint(-128.0f -
+                                                            lo[g] / scale))));
+  }
+
+  for (uint32_t i = 0; i < height; i++) {
+    for (uint32_t j = 0; j < width; j++) {
+      uint32_t g = group(i, j);
+      dst.a(i, j) = saturate_int8(
+          int32_t(std::nearbyint(src.r(i, j) / params.scale[g])) +
+          params.zero_point[g]);
+    }
+  }
+  return params;
+}
+
+// dst = scale * (src - zero_point)
+inline void dequantize(MatrixView<const int8_t> src, MatrixView<float> dst,
+                       const QuantParams &params, QuantAxis axis) {
+  for (uint32_t i = 0; i < src.get_height(); i++) {
+    for (uint32_t j = 0; j < src.get_width(); j++) {
+      uint32_t g = axis == QuantAxis::TENSOR ? 0
+                   : axis == QuantAxis::ROWS ? i
+                                             : j;
+      dst.a(i, j) =
+          params.scale_at(g) * float(src.r(i, j) - params.zero_point_at(g));
+    }
+  }
+}
+
+// C = (A - zero_point_a) @ (B - zero_point_b) in int32, one multiply at a time.
+// The golden result for the kernels below; naive::* would accumulate in int8.
+inline void reference_int8_matmul(MatrixView<const int8_t> A,
+                                  MatrixView<const int8_t> B,
+                                  MatrixView<int32_t> C,
+                                  const QuantParams &a = QuantParams(),
+                                  const QuantParams &b = QuantParams()) {
+  for (uint32_t i = 0; i < A.get_height(); i++) {
+    for (uint32_t j = 0; j < B.get_width(); j++) {
+      int32_t sum = 0;
+      for (uint32_t k = 0; k < A.get_width(); k++) {
+        sum += (A.r(i, k) - a.zero_point_at(i)) *
+               (B.r(k, j) - b.zero_point_at(j));
+      }
+      C.a(i, j) = sum;
+    }
+  }
+}
+
+// Instruction sets the int8 micro-kernel can use
+enum class Int8Isa { SCALAR, AVX2, AVX512_VNNI, AVX_VNNI };
+
+inline const char *int8_isa_name(Int8Isa isa) {
+  switch (isa) {
+  case Int8Isa::SCALAR:
+    return "scalar";
+  case Int8Isa::AVX2:
+    return "avx2";
+  case Int8Isa::AVX512_VNNI:
+    return "avx512_vnni";
+  case Int8Isa::AVX_VNNI:
+    return "avx_vnni";
+  }
+  return "?";
+}
+
+// Best instruction set within support::active_isa(), chosen once. Without
+// AVX2 every product runs through the reference loop.
+inline Int8Isa int8_isa() {
+  static const Int8Isa isa = [] {
+    const support::CpuFeatures &features = support::cpu_features();
+    support::Isa active = support::active_isa();
+    if (active < support::Isa::AVX2) {
+      return Int8Isa::SCALAR;
+    }
+    if (features.avxvnni) {
+      return Int8Isa::AVX_VNNI;
+    }
+    if (active == support::Isa::AVX512 && features.avx512vnni) {
+      return Int8Isa::AVX512_VNNI;
+    }
+    return Int8Isa::AVX2;
+  }();
+  return isa;
+}
+
+// The micro-kernel multiplies groups of GROUP consecutive k values, one group
+// per 32-bit lane: a broadcast group of A against one group per column of B.
+//
+// AVX2 widens both operands to int16 and uses _mm256_madd_epi16 on pairs.
+// _mm256_maddubs_epi16 would take 4 int8 values per lane but saturates the
+// int16 sum of each pair of products, and needs a second madd to widen, so it
+// is no faster than pairs of int16 while being inexact.
+struct Avx2Dot {
+  using TypeA = int16_t;
+  using TypeB = int16_t;
+  static constexpr uint32_t GROUP = 2;
+  // Added to A while packing
+  static constexpr int32_t A_OFFSET = 0;
+
+  TARGET_AVX2 static __m256i dot(__m256i acc, __m256i a, __m256i b) {
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+  }
+};
+
+// VNNI vpdpbusd multiplies 4 unsigned bytes of A by 4 signed bytes of B and
+// adds the sum to the 32-bit lane without saturating. A is shifted into
+// [0, 255] while packing and 128 * column sum of B is subtracted afterwards.
+// Written as inline assembly so the kernel needs no avxvnni target; it only
+// runs after int8_isa() found the instruction. EVEX picks the AVX-512 encoding.
+template <bool EVEX> struct VnniDot {
+  using TypeA = uint8_t;
+  using TypeB = int8_t;
+  static constexpr uint32_t GROUP = 4;
+  static constexpr int32_t A_OFFSET = 128;
+
+  TARGET_AVX2 static __m256i dot(__m256i acc, __m256i a, __m256i b) {
+    if (EVEX) {
+      asm("vpdpbusd %2, %1, %0" : "+x"(acc) : "x"(a), "x"(b));
+    } else {
+      asm("%{vex%} vpdpbusd %2, %1, %0" : "+x"(acc) : "x"(a), "x"(b));
+    }
+    return acc;
+  }
+};
+
+using packed::MR;
+using packed::NR;
+
+// Packs the [mc, kc] block of A at (i0, k0) into panels of MR rows. Each panel
+// holds, per group of k, MR groups of GROUP values, so the kernel broadcasts
+// one 32-bit group per row. Rows and k past the block are zero.
+template <typename Dot>
+inline void packA(const MatrixView<const int8_t> &A, uint32_t i0, uint32_t k0,
+                  uint32_t mc, uint32_t kc, typename Dot::TypeA *packed) {
+  using TypeA = typename Dot::TypeA;
+  constexpr uint32_t G = Dot::GROUP;
+  uint32_t full = kc / G, groups = (kc + G - 1) / G;
+  int64_t step = A.get_col_stride();
+  for (uint32_t ir = 0; ir < mc; ir += MR) {
+    uint32_t mr = std::min(MR, mc - ir);
+    for (uint32_t i = 0; i < MR; i++) {
+      TypeA *out = packed + i * G;
+      if (i >= mr) {
+        for (uint32_t g = 0; g < groups; g++) {
+          std::fill(out + g * MR * G, out + g * MR * G + G, TypeA(0));
+        }
+        continue;
+      }
+      const int8_t *row = &A.r(i0 + ir + i, k0);
+      uint32_t g = 0;
+      if (step == 1) {
+        for (; g < full; g++) {
+          for (uint32_t u = 0; u < G; u++) {
+            out[g * MR * G + u] = TypeA(row[g * G + u] + Dot::A_OFFSET);
+          }
+        }
+      }
+      for (; g < groups; g++) {
+        for (uint32_t u = 0; u < G; u++) {
+          uint32_t k = g * G + u;
+          out[g * MR * G + u] =
+              k < kc ? TypeA(row[k * step] + Dot::A_OFFSET) : TypeA(0);
+        }
+      }
+    }
+    packed += groups * MR * G;
+  }
+}
+
+// Interleaves 16 columns of the GROUP rows of B into one group of a packed
+// panel: column j of row u goes to out[j * GROUP + u]
+inline void interleaveB(const int8_t *const *rows, int8_t *out) {
+  __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[0]));
+  __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[1]));
+  __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[2]));
+  __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[3]));
+  __m128i lo01 = _mm_unpacklo_epi8(r0, r1), hi01 = _mm_unpackhi_epi8(r0, r1);
+  __m128i lo23 = _mm_unpacklo_epi8(r2, r3), hi23 = _mm_unpackhi_epi8(r2, r3);
+  __m128i *dst = reinterpret_cast<__m128i *>(out);
+  _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo01, lo23));
+  _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo01, lo23));
+  _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi01, hi23));
+  _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi01, hi23));
+}
+
+// As above for pairs widened to int16, sign extending by an arithmetic shift
+// of each byte doubled into both halves of a 16-bit lane
+inline void interleaveB(const int8_t *const *rows, int16_t *out) {
+  __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[0]));
+  __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[1]));
+  __m128i lo = _mm_unpacklo_epi8(r0, r1), hi = _mm_unpackhi_epi8(r0, r1);
+  __m128i *dst = reinterpret_cast<__m128i *>(out);
+  _mm_storeu_si128(dst, _mm_srai_epi16(_mm_unpacklo_epi8(lo, lo), 8));
+  _mm_storeu_si128(dst + 1, _mm_srai_epi16(_mm_unpackhi_epi8(lo, lo), 8));
+  _mm_storeu_si128(dst + 2, _mm_srai_epi16(_mm_unpacklo_epi8(hi, hi), 8));
+  _mm_storeu_si128(dst + 3, _mm_srai_epi16(_mm_unpackhi_epi8(hi, hi), 8));
+}
+
+// Packs the [kc, nc] block of B at (k0, j0) into panels of NR columns. Each
+// panel holds, per group of k, NR groups of GROUP values, one 32-bit lane per
+// column. Columns and k past the block are zero.
+template <typename Dot>
+inline void packB(const MatrixView<const int8_t> &B, uint32_t k0, uint32_t j0,
+                  uint32_t kc, uint32_t nc, typename Dot::TypeB *packed) {
+  static_assert(NR == 16, "interleaveB packs 16 columns");
+  constexpr uint32_t G = Dot::GROUP;
+  uint32_t groups = (kc + G - 1) / G;
+  int64_t step = B.get_col_stride();
+  for (uint32_t jr = 0; jr < nc; jr += NR) {
+    uint32_t nr = std::min(NR, nc - jr);
+    for (uint32_t g = 0; g < groups; g++) {
+      if (step == 1 && nr == NR && g * G + G <= kc) {
+        const int8_t *rows[G];
+        for (uint32_t u = 0; u < G; u++) {
+          rows[u] = &B.r(k0 + g * G + u, j0 + jr);
+        }
+        interleaveB(rows, packed);
+        packed += NR * G;
+        continue;
+      }
+      for (uint32_t u = 0; u < G; u++) {
+        uint32_t k = g * G + u;
+        if (k < kc) {
+          const int8_t *row = &B.r(k0 + k, j0 + jr);
+          for (uint32_t j = 0; j < nr; j++) {
+            packed[j * G + u] = row[j * step];
+          }
+        } else {
+          for (uint32_t j = 0; j < nr; j++) {
+            packed[j * G + u] = 0;
+          }
+        }
+        for (uint32_t j = nr; j < NR; j++) {
+          packed[j * G + u] = 0;
+        }
+      }
+      packed += NR * G;
+    }
+  }
+}
+
+// C[MR, NR] (+)= packedA @ packedB over `groups` groups of k. C is the int32
+// scratch block, rows ldc apart and always padded to whole tiles.
+template <typename Dot>
+TARGET_AVX2 inline void kernel_6x16(uint32_t groups, const typename Dot::TypeA *packedA,
+                        const typename Dot::TypeB *packedB, int32_t *C,
+                        uint32_t ldc, bool accumulate) {
+  constexpr uint32_t G = Dot::GROUP;
+  __m256i c[MR][2];
+  for (uint32_t i = 0; i < MR; i++) {
+    if (accumulate) {
+      c[i][0] = _mm256_loadu_si256(reinterpret_cast<__m256i *>(C + i * ldc));
+      c[i][1] =
+          _mm256_loadu_si256(reinterpret_cast<__m256i *>(C + i * ldc + 8));
+    } else {
+      c[i][0] = _mm256_setzero_si256();
+      c[i][1] = _mm256_setzero_si256();
+    }
+  }
+
+  for (uint32_t g = 0; g < groups; g++) {
+    __m256i b0 = _mm256_load_si256(reinterpret_cast<const __m256i *>(packedB));
+    __m256i b1 =
+        _mm256_load_si256(reinterpret_cast<const __m256i *>(packedB + 8 * G));
+    for (uint32_t i = 0; i < MR; i++) {
+      int32_t group;
+      std::memcpy(&group, packedA + i * G, sizeof(group));
+      __m256i a = _mm256_set1_epi32(group);
+      c[i][0] = Dot::dot(c[i][0], a, b0);
+      c[i][1] = Dot::dot(c[i][1], a, b1);
+    }
+    packedA += MR * G;
+    packedB += NR * G;
+  }
+
+  for (uint32_t i = 0; i < MR; i++) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(C + i * ldc), c[i][0]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(C + i * ldc + 8),
+                        c[i][1]);
+  }
+}
+
+// Goto style blocking as in parallel::parallelGemm, on `workers` workers of
+// the global pool. For every column panel of C, B is packed cooperatively over
+// all of K, the panel being narrowed so that this stays within tileKC * tileNC
+// values. Each task then takes a [tileMC, nt] block of C through the whole of
+// K in its worker's int32 scratch, so no scratch grows with N. Once all of K
+// is in, the zero points (and the VNNI offset of A) are folded out of the
+// block,
+//   sum (A - za)(B - zb) = sum A B - za colsum(B) - zb rowsum(A) + K za zb,
+// and store(i, j0, row, count) writes count exact int32 results of row i,
+// starting at column j0, to the output. Stores of different blocks run
+// concurrently. tileKC must be a multiple of 4. Results are exact while
+// K * 255 * 255 fits int32.
+template <size_t tileMC, size_t tileKC, size_t tileNC, typename Dot,
+          typename Store>
+void int8Gemm(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+              const QuantParams &a, const QuantParams &b, Store &&store,
+              uint32_t workers, Workspace &workspace) {
+  static_assert(tileMC % MR == 0, "tileMC must be a multiple of MR");
+  static_assert(tileNC % NR == 0, "tileNC must be a multiple of NR");
+  static_assert(tileKC % Dot::GROUP == 0,
+                "tileKC must be a multiple of the k group");
+  constexpr uint32_t G = Dot::GROUP;
+
+  uint32_t N = A.get_height(), M = B.get_width(), K = A.get_width();
+  uint32_t groupsK = (K + G - 1) / G;
+  uint32_t panelNC = std::max<uint32_t>(
+      NR, std::min<size_t>(tileNC, size_t(tileKC) * tileNC /
+                                       std::max(groupsK * G, 1u)) /
+              NR * NR);
+  uint32_t colsNC = std::min<uint32_t>(panelNC, (M + NR - 1) / NR * NR);
+  uint32_t rowTiles = (N + tileMC - 1) / tileMC;
+  // With fewer row tiles than workers the panel is split into column blocks
+  // as well, each of which packs its rows of A again
+  uint32_t splits = std::max<uint32_t>(
+      1, std::min<uint32_t>(colsNC / NR, (workers + rowTiles - 1) /
+                                             std::max(rowTiles, 1u)));
+  uint32_t blockNC = (colsNC / NR + splits - 1) / splits * NR;
+
+  ThreadPool &pool = ThreadPool::global();
+  Workspace::Scope scope(workspace);
+  auto *packedB =
+      workspace.alloc<typename Dot::TypeB>(size_t(colsNC) * groupsK * G);
+  auto *packedA =
+      workspace.alloc<typename Dot::TypeA>(size_t(workers) * tileMC * tileKC);
+  int32_t *blocks = workspace.alloc<int32_t>(size_t(workers) * tileMC * blockNC);
+  int32_t *rowSumA = workspace.alloc<int32_t>(N);
+  int32_t *colSumB = workspace.alloc<int32_t>(M);
+  int32_t *zeroB = workspace.alloc<int32_t>(M);
+
+  pool.parallel_for(
+      rowTiles,
+      [&](uint32_t tile, uint32_t) {
+        uint32_t i1 = std::min<uint32_t>(N, (tile + 1) * tileMC);
+        for (uint32_t i = tile * tileMC; i < i1; i++) {
+          int32_t sum = 0;
+          for (uint32_t k = 0; k < K; k++) {
+            sum += A.r(i, k);
+          }
+          rowSumA[i] = sum;
+        }
+      },
+      workers);
+  pool.parallel_for(
+      (M + tileNC - 1) / tileNC,
+      [&](uint32_t tile, uint32_t) {
+        uint32_t j0 = tile * tileNC, j1 = std::min<uint32_t>(M, j0 + tileNC);
+        for (uint32_t j = j0; j < j1; j++) {
+          colSumB[j] = 0;
+          zeroB[j] = b.zero_point_at(j);
+        }
+        for (uint32_t k = 0; k < K; k++) {
+          for (uint32_t j = j0; j < j1; j++) {
+            colSumB[j] += B.r(k, j);
+          }
+        }
+      },
+      workers);
+
+  for (uint32_t jc = 0; jc < M; jc += panelNC) {
+    uint32_t nc = std::min<uint32_t>(panelNC, M - jc);
+    uint32_t colTiles = (nc + blockNC - 1) / blockNC;
+
+    // In tileKC rows at a time, every panel of them, so the rows of B are
+    // read while they are in cache
+    uint32_t panels = (nc + NR - 1) / NR;
+    pool.parallel_for(
+        (K + tileKC - 1) / tileKC * panels,
+        [&](uint32_t task, uint32_t) {
+          uint32_t pc = task / panels * tileKC, jr = task % panels * NR;
+          packB<Dot>(B, pc, jc + jr, std::min<uint32_t>(tileKC, K - pc),
+                     std::min(NR, nc - jr),
+                     packedB + size_t(jr) * groupsK * G + size_t(pc) * NR);
+        },
+        workers);
+
+    pool.parallel_for(
+        rowTiles * colTiles,
+        [&](uint32_t task, uint32_t worker) {
+          uint32_t ic = task / colTiles * tileMC;
+          uint32_t jt = task % colTiles * blockNC;
+          uint32_t mc = std::min<uint32_t>(tileMC, N - ic);
+          uint32_t nt = std::min<uint32_t>(blockNC, nc - jt);
+          auto *workerA = packedA + size_t(worker) * tileMC * tileKC;
+          int32_t *block = blocks + size_t(worker) * tileMC * blockNC;
+
+          if (K == 0) {
+            std::fill(block, block + size_t(tileMC) * blockNC, 0);
+          }
+          for (uint32_t pc = 0; pc < K; pc += tileKC) {
+            uint32_t kc = std::min<uint32_t>(tileKC, K - pc);
+            uint32_t groups = (kc + G - 1) / G;
+            packA<Dot>(A, ic, pc, mc, kc, workerA);
+            for (uint32_t jr = 0; jr < nt; jr += NR) {
+              const auto *panelB =
+                  packedB + size_t(jt + jr) * groupsK * G + size_t(pc) * NR;
+              for (uint32_t ir = 0; ir < mc; ir += MR) {
+                kernel_6x16<Dot>(groups, workerA + ir * groups * G, panelB,
+                                 block + size_t(ir) * blockNC + jr, blockNC,
+                                 pc != 0);
+              }
+            }
+          }
+
+          // -zb rowsum(A) + K za zb is folded into -zb (rowsum(A) - K za)
+          uint32_t j0 = jc + jt;
+          for (uint32_t i = 0; i < mc; i++) {
+            int32_t za = a.zero_point_at(ic + i);
+            int32_t offsetA = za + Dot::A_OFFSET;
+            int32_t rowTerm = rowSumA[ic + i] - int32_t(K) * za;
+            int32_t *row = block + size_t(i) * blockNC;
+            for (uint32_t j = 0; j < nt; j++) {
+              row[j] -= offsetA * colSumB[j0 + j] + zeroB[j0 + j] * rowTerm;
+            }
+            store(ic + i, j0, row, nt);
+          }
+        },
+        workers);
+  }
+}
+
+// int8Gemm for CPUs without AVX2, one row of C per task
+template <typename Store>
+void int8Scalar(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                const QuantParams &a, const QuantParams &b, Store &&store,
+                uint32_t workers, Workspace &workspace) {
+  uint32_t N = A.get_height(), M = B.get_width(), K = A.get_width();
+  Workspace::Scope scope(workspace);
+  int32_t *rows = workspace.alloc<int32_t>(size_t(workers) * M);
+  ThreadPool::global().parallel_for(
+      N,
+      [&](uint32_t i, uint32_t worker) {
+        int32_t *row = rows + size_t(worker) * M;
+        std::fill(row, row + M, 0);
+        int32_t za = a.zero_point_at(i);
+        for (uint32_t k = 0; k < K; k++) {
+          int32_t x = A.r(i, k) - za;
+          for (uint32_t j = 0; j < M; j++) {
+            row[j] += x * (B.r(k, j) - b.zero_point_at(j));
+          }
+        }
+        store(i, 0, row, M);
+      },
+      workers);
+}
+
+// Runs int8Gemm with the micro-kernel for the running CPU on `threads`
+// workers of the global pool, 0 meaning all of them
+template <size_t tileMC, size_t tileKC, size_t tileNC, typename Store>
+void int8Dispatch(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                  const QuantParams &a, const QuantParams &b, Store &&store,
+                  uint32_t threads, Workspace &workspace) {
+  uint32_t size = ThreadPool::global().size();
+  uint32_t workers = threads == 0 ? size : std::min(threads, size);
+  switch (int8_isa()) {
+  case Int8Isa::SCALAR:
+    int8Scalar(A, B, a, b, store, workers, workspace);
+    break;
+  case Int8Isa::AVX_VNNI:
+    int8Gemm<tileMC, tileKC, tileNC, VnniDot<false>>(A, B, a, b, store,
+                                                      workers, workspace);
+    break;
+  case Int8Isa::AVX512_VNNI:
+    int8Gemm<tileMC, tileKC, tileNC, VnniDot<true>>(A, B, a, b, store,
+                                                     workers, workspace);
+    break;
+  case Int8Isa::AVX2:
+    int8Gemm<tileMC, tileKC, tileNC, Avx2Dot>(A, B, a, b, store, workers,
+                                              workspace);
+    break;
+  }
+}
+
+// C = (A - za) @ (B - zb) accumulated in int32 on `threads` workers of the
+// global pool (0 means all). A [N, K] takes per row zero points, B [K, M] per
+// column ones; scales are ignored.
+template <size_t tileMC = 72, size_t tileKC = 1024, size_t tileNC = 1024>
+void int8_matmul_threads(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                         MatrixView<int32_t> C, const QuantParams &a,
+                         const QuantParams &b, uint32_t threads,
+                         Workspace &workspace = Workspace::local()) {
+  int64_t step = C.get_col_stride();
+  int8Dispatch<tileMC, tileKC, tileNC>(
+      A, B, a, b,
+      [&](uint32_t i, uint32_t j0, const int32_t *row, uint32_t count) {
+        int32_t *out = &C.a(i, j0);
+        for (uint32_t j = 0; j < count; j++) {
+          out[j * step] = row[j];
+        }
+      },
+      threads, workspace);
+}
+
+// C = scale_a * scale_b * (A - za) @ (B - zb), dequantized to float
+template <size_t tileMC = 72, size_t tileKC = 1024, size_t tileNC = 1024>
+void int8_matmul_threads(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                         MatrixView<float> C, const QuantParams &a,
+                         const QuantParams &b, uint32_t threads,
+                         Workspace &workspace = Workspace::local()) {
+  Workspace::Scope scope(workspace);
+  uint32_t M = B.get_width();
+  float *scaleB = workspace.alloc<float>(M);
+  for (uint32_t j = 0; j < M; j++) {
+    scaleB[j] = b.scale_at(j);
+  }
+
+  int64_t step = C.get_col_stride();
+  int8Dispatch<tileMC, tileKC, tileNC>(
+      A, B, a, b,
+      [&](uint32_t i, uint32_t j0, const int32_t *row, uint32_t count) {
+        float scaleA = a.scale_at(i);
+        float *out = &C.a(i, j0);
+        for (uint32_t j = 0; j < count; j++) {
+          out[j * step] = float(row[j]) * (scaleA * scaleB[j0 + j]);
+        }
+      },
+      threads, workspace);
+}
+
+// Requantized values are clamped to this before converting to int, far enough
+// out that adding any zero point still saturates
+constexpr float REQUANT_CLAMP = 1024.0f;
+
+// out[j] = saturate(round(row[j] * scaleA * scaleB[j]) + zero[j]) 8 at a time,
+// packing to int8 with signed saturation. Returns how many were written.
+TARGET_AVX2 inline uint32_t requantize8(const int32_t *row, uint32_t count,
+                                        float scaleA, const float *scaleB,
+                                        const int32_t *zero, int8_t *out) {
+  __m256 scale = _mm256_set1_ps(scaleA);
+  uint32_t j = 0;
+  for (; j + 8 <= count; j += 8) {
+    __m256 x = _mm256_mul_ps(
+        _mm256_cvtepi32_ps(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + j))),
+        _mm256_mul_ps(scale, _mm256_loadu_ps(scaleB + j)));
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-REQUANT_CLAMP)),
+                      _mm256_set1_ps(REQUANT_CLAMP));
+    __m256i q = _mm256_add_epi32(
+        _mm256_cvtps_epi32(x),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(zero + j)));
+    __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                  _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + j),
+                     _mm_packs_epi16(q16, q16));
+  }
+  return j;
+}
+
+// As the float version, requantized to int8 with the per column (or per
+// tensor) parameters c: round(result / scale_c) + zc, rounding half to even
+// and saturating.
+template <size_t tileMC = 72, size_t tileKC = 1024, size_t tileNC = 1024>
+void int8_matmul_threads(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                         MatrixView<int8_t> C, const QuantParams &a,
+                         const QuantParams &b, const QuantParams &c,
+                         uint32_t threads,
+                         Workspace &workspace = Workspace::local()) {
+  Workspace::Scope scope(workspace);
+  uint32_t M = B.get_width();
+  float *scaleB = workspace.alloc<float>(M);
+  int32_t *zeroC = workspace.alloc<int32_t>(M);
+  for (uint32_t j = 0; j < M; j++) {
+    scaleB[j] = b.scale_at(j) / c.scale_at(j);
+    zeroC[j] = c.zero_point_at(j);
+  }
+
+  int64_t step = C.get_col_stride();
+  int8Dispatch<tileMC, tileKC, tileNC>(
+      A, B, a, b,
+      [&](uint32_t i, uint32_t j0, const int32_t *row, uint32_t count) {
+        float scaleA = a.scale_at(i);
+        int8_t *out = &C.a(i, j0);
+        uint32_t j = 0;
+        if (step == 1 && support::active_isa() >= support::Isa::AVX2) {
+          j = requantize8(row, count, scaleA, scaleB + j0, zeroC + j0, out);
+        }
+        for (; j < count; j++) {
+          float x = float(row[j]) * (scaleA * scaleB[j0 + j]);
+          x = std::min(std::max(x, -REQUANT_CLAMP), REQUANT_CLAMP);
+          out[j * step] =
+              saturate_int8(int32_t(std::nearbyint(x)) + zeroC[j0 + j]);
+        }
+      },
+      threads, workspace);
+}
+
+// As int8_matmul_threads, using every worker of the global pool
+template <size_t tileMC = 72, size_t tileKC = 1024, size_t tileNC = 1024>
+void int8_matmul(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                 MatrixView<int32_t> C, const QuantParams &a = QuantParams(),
+                 const QuantParams &b = QuantParams()) {
+  int8_matmul_threads<tileMC, tileKC, tileNC>(A, B, C, a, b, 0);
+}
+
+template <size_t tileMC = 72, size_t tileKC = 1024, size_t tileNC = 1024>
+void int8_matmul(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                 MatrixView<float> C, const QuantParams &a,
+                 const QuantParams &b) {
+  int8_matmul_threads<tileMC, tileKC, tileNC>(A, B, C, a, b, 0);
+}
+
+template <size_t tileMC = 72, size_t tileKC = 1024, size_t tileNC = 1024>
+void int8_matmul(MatrixView<const int8_t> A, MatrixView<const int8_t> B,
+                 MatrixView<int8_t> C, const QuantParams &a,
+                 const QuantParams &b, const QuantParams &c) {
+  int8_matmul_threads<tileMC, tileKC, tileNC>(A, B, C, a, b, c, 0);
+}
+
+} // namespace quant
+} // namespace algo
+#endif
@@ -1,61 +1,287 @@
+#include "numa.h"
 #include <stdint.h>
 #include <stdlib.h>
-#include <iostream>
+#include <sys/mman.h>
+#include <algorithm>
 #include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 #ifndef __MATRIX_H__
 #define __MATRIX_H__
 
 namespace support {
 
+// Controls how a Matrix lays out and backs its storage.
+struct AllocPolicy {
+    // Byte alignment of the buffer and of every row, a power of two
+    size_t alignment = 64;
+
+    // Pad each row to a multiple of alignment and, when the padded row is a
+    // multiple of 512 bytes (every power of two width from 128 floats up), add
+    // one more alignment unit so consecutive rows do not map to the same cache
+    // sets.
+    bool pad_stride = true;
+
+    // Back buffers of at least huge_page_bytes with 2 MB pages via
+    // madvise(MADV_HUGEPAGE). Set to 0 to disable.
+    size_t huge_page_bytes = size_t(8) << 20;
+
+    // NUMA placement of the pages, see numa.h. Only takes effect on buffers
+    // large enough to get fresh pages from the allocator.
+    Placement placement = Placement::DEFAULT;
+
+    // Rows back to back, stride == width
+    static AllocPolicy contiguous() {
+        AllocPolicy policy;
+        policy.pad_stride = false;
+        return policy;
+    }
+};
+
+static const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+// Non-owning, strided window onto matrix storage. Element (r, c) lives at
+// data[offset + r * row_stride + c * col_stride]. Sub-blocks and transposes
+// only change the offset, strides and shape, so neither copies any data.
+// The transpose flag records that the view is the transpose of its row-major
+// source (its columns are contiguous), which packing routines use to pick a
+// fast path.
 template <typename T>
-class Matrix {
+class MatrixView {
 private:
     T* _data;
+    size_t _offset;
     uint32_t _width, _height;
+    int64_t _row_stride, _col_stride;
+    bool _transposed;
 
 public:
+    MatrixView(T* data, uint32_t width, uint32_t height, int64_t row_stride,
+               int64_t col_stride = 1, size_t offset = 0, bool transposed = false)
+        : _data(data), _offset(offset), _width(width), _height(height),
+          _row_stride(row_stride), _col_stride(col_stride), _transposed(transposed) {}
+
+    // A view of T converts to a read-only view of const T
+    template <typename U, typename = std::enable_if_t<std::is_same<const U, T>::value>>
+    MatrixView(const MatrixView<U>& other)
+        : MatrixView(other.base(), other.get_width(), other.get_height(),
+                     other.get_row_stride(), other.get_col_stride(), other.get_offset(),
+                     other.is_transposed()) {}
+
+    inline T& access(uint32_t r, uint32_t c) const {
+        // NOTE: does not check indices are valid, be careful!
+        return _data[_offset + r * _row_stride + c * _col_stride];
+    }
+
+    inline T& a(uint32_t r, uint32_t c) const {
+        return access(r, c);
+    }
+
+    inline const T& read(uint32_t r, uint32_t c) const {
+        return access(r, c);
+    }
+
+    inline const T& r(uint32_t r, uint32_t c) const {
+        return read(r, c);
+    }
+
+    // [height, width] window whose top left corner is (r, c) of this view
+    MatrixView<T> block(uint32_t r, uint32_t c, uint32_t height, uint32_t width) const {
+        return MatrixView<T>(_data, width, height, _row_stride, _col_stride,
+                             _offset + r * _row_stride + c * _col_stride, _transposed);
+    }
+
+    MatrixView<T> t() const {
+        return MatrixView<T>(_data, _height, _width, _col_stride, _row_stride, _offset,
+                             !_transposed);
+    }
+
+    // Pointer to element (0, 0)
+    inline T* data() const {
+        return _data + _offset;
+    }
+
+    inline T* base() const {
+        return _data;
+    }
+
+    size_t get_offset() const {
+        return _offset;
+    }
+
+    uint32_t get_height() const {
+        return _height;
+    }
+
+    uint32_t get_width() const {
+        return _width;
+    }
+
+    int64_t get_row_stride() const {
+        return _row_stride;
+    }
+
+    int64_t get_col_stride() const {
+        return _col_stride;
+    }
+
+    bool is_transposed() const {
+        return _transposed;
+    }
+};
+
+// Extent of a Matrix whose shape is only known at run time
+static constexpr uint32_t DYNAMIC = UINT32_MAX;
+
+// Matrix<T> is sized at run time and heap allocated. Matrix<T, Rows, Cols>
+// has its shape in the type and its elements inline, for small matrices
+// handled by the thousands (see algo::fixed).
+template <typename T, uint32_t Rows = DYNAMIC, uint32_t Cols = DYNAMIC>
+class Matrix;
+
+template <typename T>
+class Matrix<T, DYNAMIC, DYNAMIC> {
+private:
+    T* _data;
+    uint32_t _width, _height;
+    // Elements between the starts of consecutive rows, >= _width
+    uint32_t _stride;
+    AllocPolicy _policy;
+    // Set when the storage is a file mapping rather than a heap buffer
+    void* _mapping = nullptr;
+    size_t _mapping_bytes = 0;
+
+    Matrix(T* data, uint32_t width, uint32_t height, uint32_t stride, void* mapping,
+           size_t mapping_bytes)
+        : _data(data), _width(width), _height(height), _stride(stride), _mapping(mapping),
+          _mapping_bytes(mapping_bytes) {}
+
+    void allocate() {
+        size_t count = size_t(_stride) * _height;
+        size_t bytes = count * sizeof(T);
+        size_t alignment = std::max(_policy.alignment, alignof(T));
+
+        bool huge = _policy.huge_page_bytes != 0 && bytes >= _policy.huge_page_bytes;
+        if (huge) {
+            alignment = HUGE_PAGE_SIZE;
+        }
+
+        // aligned_alloc wants the size to be a multiple of the alignment
+        bytes = std::max<size_t>((bytes + alignment - 1) / alignment * alignment, alignment);
+        void* memory = std::aligned_alloc(alignment, bytes);
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (huge) {
+            // Only a hint, transparent huge pages may be disabled
+            madvise(memory, bytes, MADV_HUGEPAGE);
+        }
+#endif
+
+        if (_policy.placement == Placement::INTERLEAVE) {
+            interleave_pages(memory, bytes);
+        }
+
+        _data = static_cast<T*>(memory);
+        std::uninitialized_default_construct_n(_data, count);
+        if (_policy.placement == Placement::FIRST_TOUCH) {
+            first_touch_rows(_data, size_t(_stride) * sizeof(T), _height);
+        }
+    }
+
+    void release() {
+        if (_mapping != nullptr) {
+            munmap(_mapping, _mapping_bytes);
+            _mapping = nullptr;
+            _data = nullptr;
+        } else if (_data != nullptr) {
+            std::destroy_n(_data, size_t(_stride) * _height);
+            std::free(_data);
+            _data = nullptr;
+        }
+    }
+
+public:
+    // Row stride, in elements, that policy gives a matrix of this width
+    static uint32_t stride_for(uint32_t width, const AllocPolicy& policy) {
+        if (!policy.pad_stride || policy.alignment % sizeof(T) != 0) {
+            return width;
+        }
+        size_t bytes = (size_t(width) * sizeof(T) + policy.alignment - 1) /
+                       policy.alignment * policy.alignment;
+        if (bytes != 0 && bytes % 512 == 0) {
+            bytes += policy.alignment;
+        }
+        return bytes / sizeof(T);
+    }
+
+    // Adopts an mmap'd region of mapping_bytes, unmapped on destruction, whose
+    // elements start at data. Used by support::map_matrix_file.
+    static Matrix from_mapping(void* mapping, size_t mapping_bytes, T* data, uint32_t width,
+                               uint32_t height, uint32_t stride) {
+        return Matrix(data, width, height, stride, mapping, mapping_bytes);
+    }
+
     // Constructor
-    Matrix(uint32_t width, uint32_t height) : _width(width), _height(height) {
-        _data = new T[_width * _height];
+    Matrix(uint32_t width, uint32_t height, const AllocPolicy& policy = AllocPolicy())
+        : _width(width), _height(height), _stride(stride_for(width, policy)), _policy(policy) {
+        allocate();
     }
 
     // Destructor
     ~Matrix() {
-        if (_data != nullptr) {
-            delete[] _data;
-        }
+        release();
     }
 
     // Move constructor
-    Matrix(Matrix&& other) : _width(other._width), _height(other._height) {
+    Matrix(Matrix&& other)
+        : _width(other._width), _height(other._height), _stride(other._stride), _policy(other._policy),
+          _mapping(other._mapping), _mapping_bytes(other._mapping_bytes) {
         _data = other._data;
         other._data = nullptr;      
+        other._mapping = nullptr;
     }
 
-    Matrix<T>&& copy() {
-        Matrix<T> result(_width, _height);
-        std::memcpy(result._data, _data, sizeof(T) * _width * _height);
+    // Heap copy, also of a mapped matrix
+    Matrix<T> copy() const {
+        Matrix<T> result(_width, _height, _policy);
+        if (result._stride == _stride) {
+            std::memcpy(result._data, _data, sizeof(T) * _stride * _height);
+        } else {
+            for (uint32_t r = 0; r < _height; r++) {
+                std::memcpy(result._data + size_t(r) * result._stride,
+                            _data + size_t(r) * _stride, sizeof(T) * _width);
+            }
+        }
         return result;
     }
 
     // Move assignment constructor
     Matrix<T>& operator=(Matrix&& other) {
-        if (_data != nullptr) {
-            delete[] _data;
-        }
+        release();
         
         _data = other._data;
         _width = other._width;
         _height = other._height;
+        _stride = other._stride;
+        _policy = other._policy;
+        _mapping = other._mapping;
+        _mapping_bytes = other._mapping_bytes;
 
         other._data = nullptr;    
+        other._mapping = nullptr;
         return *this;
     }
 
     inline T& access(uint32_t r, uint32_t c) {
         // NOTE: does not check indices are valid, be careful!
-        uint32_t flat_index = r * _width + c;
+        size_t flat_index = size_t(r) * _stride + c;
         return _data[flat_index];         
     }
 
@@ -65,7 +291,7 @@ public:
 
     inline const T& read(uint32_t r, uint32_t c) const{
         // NOTE: does not check indices are valid, be careful!
-        uint32_t flat_index = r * _width + c;
+        size_t flat_index = size_t(r) * _stride + c;
         return _data[flat_index];    
     }
 
@@ -73,6 +299,15 @@ public:
         return read(r, c);
     }
 
+    // Raw row-major storage, rows are get_stride() elements apart
+    inline T* data() {
+        return _data;
+    }
+
+    inline const T* data() const {
+        return _data;
+    }
+
     uint32_t get_height() const {
         return _height;
     };
@@ -80,10 +315,132 @@ public:
     uint32_t get_width() const {
         return _width;
     }
+
+    uint32_t get_stride() const {
+        return _stride;
+    }
+
+    const AllocPolicy& get_policy() const {
+        return _policy;
+    }
+
+    // Storage is a file mapping, see matrix_file.h
+    bool is_mapped() const {
+        return _mapping != nullptr;
+    }
+
+    MatrixView<T> view() {
+        return MatrixView<T>(_data, _width, _height, _stride);
+    }
+
+    MatrixView<const T> view() const {
+        return MatrixView<const T>(_data, _width, _height, _stride);
+    }
+
+    MatrixView<T> block(uint32_t r, uint32_t c, uint32_t height, uint32_t width) {
+        return view().block(r, c, height, width);
+    }
+
+    MatrixView<T> t() {
+        return view().t();
+    }
+
+    // Lets every kernel taking a MatrixView be called with a Matrix directly
+    operator MatrixView<T>() {
+        return view();
+    }
+
+    operator MatrixView<const T>() const {
+        return view();
+    }
+};
+
+// Fixed size, row-major, stored inline with no padding and no allocation.
+// Constructed zero filled or from a row-major list of values. Shapes are
+// compile time constants, so kernels written for it can check dimensions and
+// unroll every loop.
+template <typename T, uint32_t Rows, uint32_t Cols>
+class Matrix {
+    static_assert(Rows != DYNAMIC && Cols != DYNAMIC, "both extents must be fixed");
+    static_assert(Rows > 0 && Cols > 0, "fixed size matrices cannot be empty");
+
+private:
+    alignas(32) alignas(T) T _data[size_t(Rows) * Cols];
+
+public:
+    static constexpr uint32_t ROWS = Rows;
+    static constexpr uint32_t COLS = Cols;
+
+    Matrix() : _data() {}
+
+    Matrix(std::initializer_list<T> values) : _data() {
+        std::copy_n(values.begin(), std::min(values.size(), size_t(Rows) * Cols), _data);
+    }
+
+    inline T& access(uint32_t r, uint32_t c) {
+        return _data[r * Cols + c];
+    }
+
+    inline T& a(uint32_t r, uint32_t c) {
+        return access(r, c);
+    }
+
+    inline const T& read(uint32_t r, uint32_t c) const {
+        return _data[r * Cols + c];
+    }
+
+    inline const T& r(uint32_t r, uint32_t c) const {
+        return read(r, c);
+    }
+
+    inline T* data() {
+        return _data;
+    }
+
+    inline const T* data() const {
+        return _data;
+    }
+
+    static constexpr uint32_t get_height() {
+        return Rows;
+    }
+
+    static constexpr uint32_t get_width() {
+        return Cols;
+    }
+
+    static constexpr uint32_t get_stride() {
+        return Cols;
+    }
+
+    MatrixView<T> view() {
+        return MatrixView<T>(_data, Cols, Rows, Cols);
+    }
+
+    MatrixView<const T> view() const {
+        return MatrixView<const T>(_data, Cols, Rows, Cols);
+    }
+
+    MatrixView<T> block(uint32_t r, uint32_t c, uint32_t height, uint32_t width) {
+        return view().block(r, c, height, width);
+    }
+
+    MatrixView<T> t() {
+        return view().t();
+    }
+
+    // Every runtime-shaped kernel accepts fixed size matrices too
+    operator MatrixView<T>() {
+        return view();
+    }
+
+    operator MatrixView<const T>() const {
+        return view();
+    }
 };
 
 template<typename T>
-void print(std::ostream& os, const Matrix<T>& arr) {
+void print(std::ostream& os, const MatrixView<T>& arr) {
     static const uint32_t MAX_ROWS = 10;
     static const uint32_t MAX_COLS = 10;
 
@@ -101,8 +458,19 @@ void print(std::ostream& os, const Matrix<T>& arr) {
     os << (fit_rows ? "" : "...") << std::endl;;
 }
 
+template<typename T, uint32_t Rows, uint32_t Cols>
+void print(std::ostream& os, const Matrix<T, Rows, Cols>& arr) {
+    print(os, arr.view());
+}
+
+template<typename T, uint32_t Rows, uint32_t Cols>
+std::ostream& operator<<(std::ostream& os, const Matrix<T, Rows, Cols>& arr) {
+    print(os, arr);
+    return os;
+}
+
 template<typename T>
-std::ostream& operator<<(std::ostream& os, const Matrix<T>& arr) {
+std::ostream& operator<<(std::ostream& os, const MatrixView<T>& arr) {
     print(os, arr);
     return os;
 }
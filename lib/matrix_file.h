@@ -0,0 +1,309 @@
+#include "matrix.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef __MATRIX_FILE_H__
+#define __MATRIX_FILE_H__
+
+namespace support {
+
+// On-disk matrix: a fixed header, then the rows from data_offset on, stride
+// elements apart, exactly as a Matrix lays them out in memory. data_offset is
+// page aligned, so mapping the file gives the same row alignment as the heap
+// allocator and a Matrix can use the mapping in place. Fields are in the
+// byte order of the machine that wrote the file.
+//
+//   offset  size  field
+//        0     8  magic "HWMATRIX"
+//        8     4  version (1)
+//       12     4  dtype (MatrixDType)
+//       16     4  width
+//       20     4  height
+//       24     8  stride, elements between row starts
+//       32     8  data_offset, bytes from the start of the file
+
+enum class MatrixDType : uint32_t {
+    F32 = 1,
+    // Raw 16-bit patterns in a Matrix<uint16_t>, see half.h
+    BF16 = 2,
+    F16 = 3,
+    I8 = 4,
+    U8 = 5,
+    I32 = 6,
+};
+
+inline const char* dtype_name(MatrixDType dtype) {
+    switch (dtype) {
+    case MatrixDType::F32:
+        return "f32";
+    case MatrixDType::BF16:
+        return "bf16";
+    case MatrixDType::F16:
+        return "f16";
+    case MatrixDType::I8:
+        return "i8";
+    case MatrixDType::U8:
+        return "u8";
+    case MatrixDType::I32:
+        return "i32";
+    }
+    return "unknown";
+}
+
+inline size_t dtype_size(MatrixDType dtype) {
+    switch (dtype) {
+    case MatrixDType::F32:
+    case MatrixDType::I32:
+        return 4;
+    case MatrixDType::BF16:
+    case MatrixDType::F16:
+        return 2;
+    case MatrixDType::I8:
+    case MatrixDType::U8:
+        return 1;
+    }
+    return 0;
+}
+
+// The dtype a Matrix<T> is written as by default. uint16_t has no default,
+// bf16 and fp16 share it, so pass the format explicitly.
+template <typename T>
+constexpr MatrixDType default_dtype();
+
+template <>
+constexpr MatrixDType default_dtype<float>() {
+    return MatrixDType::F32;
+}
+
+template <>
+constexpr MatrixDType default_dtype<int8_t>() {
+    return MatrixDType::I8;
+}
+
+template <>
+constexpr MatrixDType default_dtype<uint8_t>() {
+    return MatrixDType::U8;
+}
+
+template <>
+constexpr MatrixDType default_dtype<int32_t>() {
+    return MatrixDType::I32;
+}
+
+struct MatrixFileHeader {
+    char magic[8];
+    uint32_t version;
+    MatrixDType dtype;
+    uint32_t width;
+    uint32_t height;
+    uint64_t stride;
+    uint64_t data_offset;
+};
+
+static_assert(sizeof(MatrixFileHeader) == 40, "the header is part of the file format");
+
+static const char MATRIX_FILE_MAGIC[8] = {'H', 'W', 'M', 'A', 'T', 'R', 'I', 'X'};
+static const uint32_t MATRIX_FILE_VERSION = 1;
+
+namespace file_detail {
+
+inline std::runtime_error error(const std::string& path, const std::string& what) {
+    return std::runtime_error(path + ": " + what);
+}
+
+inline std::runtime_error system_error(const std::string& path, const char* call) {
+    return error(path, std::string(call) + " failed: " + std::strerror(errno));
+}
+
+inline size_t page_size() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// Header for a width x height matrix of dtype with Matrix's default padding
+template <typename T>
+MatrixFileHeader make_header(uint32_t width, uint32_t height, MatrixDType dtype) {
+    if (dtype_size(dtype) != sizeof(T)) {
+        throw std::invalid_argument(std::string("dtype ") + dtype_name(dtype) +
+                                    " does not match the element size");
+    }
+    MatrixFileHeader header;
+    std::memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.version = MATRIX_FILE_VERSION;
+    header.dtype = dtype;
+    header.width = width;
+    header.height = height;
+    header.stride = Matrix<T>::stride_for(width, AllocPolicy());
+    header.data_offset = std::max(page_size(), sizeof(MatrixFileHeader));
+    return header;
+}
+
+// Size of the whole file, false if it overflows size_t
+inline bool file_bytes(const MatrixFileHeader& header, size_t& bytes) {
+    size_t elements, data;
+    return !__builtin_mul_overflow(header.stride, header.height, &elements) &&
+           !__builtin_mul_overflow(elements, dtype_size(header.dtype), &data) &&
+           !__builtin_add_overflow(data, header.data_offset, &bytes);
+}
+
+// Maps the whole file and wraps it in a Matrix, closing fd either way
+template <typename T>
+Matrix<T> map_fd(const std::string& path, int fd, const MatrixFileHeader& header,
+                 bool writable, size_t bytes) {
+    void* mapping = mmap(nullptr, bytes, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED,
+                         fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw system_error(path, "mmap");
+    }
+    T* data = reinterpret_cast<T*>(static_cast<char*>(mapping) + header.data_offset);
+    return Matrix<T>::from_mapping(mapping, bytes, data, header.width, header.height,
+                                   header.stride);
+}
+
+} // namespace file_detail
+
+// Reads and checks the header of a matrix file, throwing std::runtime_error if
+// it is not one, is truncated, or describes a matrix a Matrix cannot address
+inline MatrixFileHeader read_matrix_header(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw file_detail::system_error(path, "open");
+    }
+    MatrixFileHeader header;
+    ssize_t got = pread(fd, &header, sizeof(header), 0);
+    struct stat st;
+    int stat_result = fstat(fd, &st);
+    close(fd);
+
+    if (got != ssize_t(sizeof(header)) ||
+        std::memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        throw file_detail::error(path, "not a matrix file");
+    }
+    if (header.version != MATRIX_FILE_VERSION) {
+        throw file_detail::error(path, "unsupported version " + std::to_string(header.version));
+    }
+    size_t bytes;
+    if (dtype_size(header.dtype) == 0 || header.stride < header.width ||
+        header.stride > UINT32_MAX || header.data_offset < sizeof(header) ||
+        header.data_offset % file_detail::page_size() != 0 ||
+        !file_detail::file_bytes(header, bytes)) {
+        throw file_detail::error(path, "corrupt header");
+    }
+    if (stat_result != 0 || uint64_t(st.st_size) < bytes) {
+        throw file_detail::error(path, "truncated");
+    }
+    return header;
+}
+
+// Writes m to path in the matrix file format, padding rows as a Matrix would.
+// Returns false if the file could not be written.
+template <typename T>
+bool write_matrix_file(const std::string& path, MatrixView<const T> m,
+                       MatrixDType dtype = default_dtype<T>()) {
+    MatrixFileHeader header = file_detail::make_header<T>(m.get_width(), m.get_height(), dtype);
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    std::vector<char> padding(header.data_offset - sizeof(header));
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok &= std::fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+    std::vector<T> row(header.stride);
+    for (uint32_t r = 0; ok && r < m.get_height(); r++) {
+        for (uint32_t c = 0; c < m.get_width(); c++) {
+            row[c] = m.r(r, c);
+        }
+        ok &= std::fwrite(row.data(), sizeof(T), row.size(), file) == row.size();
+    }
+    ok &= std::fclose(file) == 0;
+    return ok;
+}
+
+template <typename T>
+bool write_matrix_file(const std::string& path, const Matrix<T>& m,
+                       MatrixDType dtype = default_dtype<T>()) {
+    return write_matrix_file<T>(path, m.view(), dtype);
+}
+
+// Creates (or truncates) a zero filled width x height matrix file and maps it
+// writable, so matrices larger than RAM can be produced in place: pages are
+// written back to the file by the kernel, not held in memory.
+template <typename T>
+Matrix<T> create_matrix_file(const std::string& path, uint32_t width, uint32_t height,
+                             MatrixDType dtype = default_dtype<T>()) {
+    MatrixFileHeader header = file_detail::make_header<T>(width, height, dtype);
+    size_t bytes;
+    if (!file_detail::file_bytes(header, bytes) || bytes > size_t(INT64_MAX)) {
+        throw file_detail::error(path, "matrix too large for a file");
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw file_detail::system_error(path, "open");
+    }
+    if (pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+        ftruncate(fd, off_t(bytes)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        throw file_detail::system_error(path, "write");
+    }
+    return file_detail::map_fd<T>(path, fd, header, true, bytes);
+}
+
+// Maps a matrix file with no copy: element (r, c) is read from the page cache
+// on first touch. Read-only mappings fault on writes, so hold them as const
+// Matrix. Throws std::runtime_error on a bad file or a dtype of another size.
+template <typename T>
+Matrix<T> map_matrix_file(const std::string& path, bool writable = false) {
+    MatrixFileHeader header = read_matrix_header(path);
+    if (dtype_size(header.dtype) != sizeof(T)) {
+        throw file_detail::error(path, std::string("holds ") + dtype_name(header.dtype) +
+                                           ", not a type of this size");
+    }
+    size_t bytes;
+    if (!file_detail::file_bytes(header, bytes)) {
+        throw file_detail::error(path, "corrupt header");
+    }
+    int fd = open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        throw file_detail::system_error(path, "open");
+    }
+    return file_detail::map_fd<T>(path, fd, header, writable, bytes);
+}
+
+// Starts reading [begin, begin + bytes) of a mapping in the background, page
+// rounded outwards
+inline void will_need(const void* begin, size_t bytes) {
+    size_t page = file_detail::page_size();
+    uintptr_t first = reinterpret_cast<uintptr_t>(begin) / page * page;
+    uintptr_t last = reinterpret_cast<uintptr_t>(begin) + bytes;
+    madvise(reinterpret_cast<void*>(first), last - first, MADV_WILLNEED);
+}
+
+// Drops the pages wholly inside [begin, begin + bytes) of a shared file
+// mapping from this process; they are read again if touched. Only for file
+// mappings: on anonymous memory this would zero the data.
+inline void dont_need(const void* begin, size_t bytes) {
+    size_t page = file_detail::page_size();
+    uintptr_t first = (reinterpret_cast<uintptr_t>(begin) + page - 1) / page * page;
+    uintptr_t last = (reinterpret_cast<uintptr_t>(begin) + bytes) / page * page;
+    if (last > first) {
+        madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+    }
+}
+
+} // namespace support
+
+#endif
@@ -1,18 +1,23 @@
 #include "matrix.h"
+#include <algorithm>
 #include <iostream>
 
 #ifndef __NAIVE_MATMUL_H__
 #define __NAIVE_MATMUL_H__
 
 using support::Matrix;
+using support::MatrixView;
 
 namespace algo {
 namespace naive {
 
 // TODO: switch N/M, M comes before M lol
+// All kernels take views, so sub-blocks and transposed operands (A.t(), as in
+// matvecT_1) are multiplied in place. A Matrix converts to a view implicitly.
 template <typename T>
-inline void verifyMatmul(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C, uint32_t &N,
-                         uint32_t &M, uint32_t &K) {
+inline void verifyMatmul(const MatrixView<const T> &A,
+                         const MatrixView<const T> &B, const MatrixView<T> &C,
+                         uint32_t &N, uint32_t &M, uint32_t &K) {
   // Checks dimension of matricies assuming we are doing
   // A @ B --> C
   // A is shape [N, K]
@@ -27,7 +32,8 @@ inline void verifyMatmul(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C, uint32_t &N,
 
 // STEP 1: The simplest implementation
 template <typename T>
-void naive_matmul_ijk(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
+void naive_matmul_ijk(MatrixView<const T> A, MatrixView<const T> B,
+                      MatrixView<T> C) {
   uint32_t N, M, K;
   verifyMatmul(A, B, C, N, M, K);
 
@@ -45,7 +51,8 @@ void naive_matmul_ijk(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
 // STEP 2: Reordering loops leads to better memory reuse inner loop
 // only advances pointers in B.
 template <typename T>
-void naive_matmul_kij(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
+void naive_matmul_kij(MatrixView<const T> A, MatrixView<const T> B,
+                      MatrixView<T> C) {
   uint32_t N, M, K;
   verifyMatmul(A, B, C, N, M, K);
 
@@ -66,44 +73,88 @@ void naive_matmul_kij(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
   }
 }
 
+// Inner kernels for one [tileN, tileM, tileK] block of the tiled matmuls.
+// Interior blocks are instantiated with full == true so every loop has a
+// compile time trip count. The fringe instantiation covers the partial blocks
+// on the bottom/right edge of C and the trailing K-slice with runtime bounds
+// n, m and kk, so any N/M/K is handled without a separate scalar pass.
+template <typename T, size_t tileN, size_t tileM, size_t tileK, bool full>
+inline void tile_ijk(const MatrixView<const T> &A, const MatrixView<const T> &B,
+                     T (&tile_buffer)[tileN][tileM],
+                     uint32_t i0, uint32_t j0, uint32_t k0, uint32_t n,
+                     uint32_t m, uint32_t kk) {
+  const uint32_t rows = full ? tileN : n;
+  const uint32_t cols = full ? tileM : m;
+  const uint32_t depth = full ? tileK : kk;
+
+  for (uint32_t inner_i = 0; inner_i < rows; inner_i++) {
+    for (uint32_t inner_j = 0; inner_j < cols; inner_j++) {
+      for (uint32_t inner_k = 0; inner_k < depth; inner_k++) {
+        tile_buffer[inner_i][inner_j] +=
+            A.r(i0 + inner_i, k0 + inner_k) * B.r(k0 + inner_k, j0 + inner_j);
+      }
+    }
+  }
+}
+
+template <typename T, size_t tileN, size_t tileM, size_t tileK, bool full>
+inline void tile_kij(const MatrixView<const T> &A, const MatrixView<const T> &B,
+                     T (&tile_buffer)[tileN][tileM],
+                     uint32_t i0, uint32_t j0, uint32_t k0, uint32_t n,
+                     uint32_t m, uint32_t kk) {
+  const uint32_t rows = full ? tileN : n;
+  const uint32_t cols = full ? tileM : m;
+  const uint32_t depth = full ? tileK : kk;
+
+  for (uint32_t inner_k = 0; inner_k < depth; inner_k++) {
+    for (uint32_t inner_i = 0; inner_i < rows; inner_i++) {
+      for (uint32_t inner_j = 0; inner_j < cols; inner_j++) {
+        tile_buffer[inner_i][inner_j] +=
+            A.r(i0 + inner_i, k0 + inner_k) * B.r(k0 + inner_k, j0 + inner_j);
+      }
+    }
+  }
+}
+
 // STEP 3: Rudimentary tiling helps with additional memory improvements
 template <typename T, size_t tileN, size_t tileM, size_t tileK>
-void tiled_ijk_matmul_ijk(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
+void tiled_ijk_matmul_ijk(MatrixView<const T> A, MatrixView<const T> B,
+                          MatrixView<T> C) {
   uint32_t N, M, K;
   verifyMatmul(A, B, C, N, M, K);
   T tile_buffer[tileN][tileM];
 
-  // TODO: assertions on divisibility of tiling for now
-  for (uint32_t tile_i = 0; tile_i < N / tileN; tile_i++) {
-    for (uint32_t tile_j = 0; tile_j < M / tileM; tile_j++) {
-      for (uint32_t tile_k = 0; tile_k < K / tileK; tile_k++) {
-
-        // Zero tile_buffer
-        for (uint32_t i = 0; i < tileN; i++) {
-          for (uint32_t j = 0; j < tileM; j++) {
-            tile_buffer[i][j] = 0;
-          }
+  for (uint32_t tile_i = 0; tile_i < (N + tileN - 1) / tileN; tile_i++) {
+    for (uint32_t tile_j = 0; tile_j < (M + tileM - 1) / tileM; tile_j++) {
+      uint32_t i0 = tile_i * tileN;
+      uint32_t j0 = tile_j * tileM;
+      uint32_t n = std::min<uint32_t>(tileN, N - i0);
+      uint32_t m = std::min<uint32_t>(tileM, M - j0);
+
+      // Zero tile_buffer
+      for (uint32_t i = 0; i < tileN; i++) {
+        for (uint32_t j = 0; j < tileM; j++) {
+          tile_buffer[i][j] = 0;
         }
+      }
 
-        // ijk
-        for (uint32_t inner_i = 0; inner_i < tileN; inner_i++) {
-          for (uint32_t inner_j = 0; inner_j < tileM; inner_j++) {
-            for (uint32_t inner_k = 0; inner_k < tileK; inner_k++) {
-              uint32_t i = tile_i * tileN + inner_i;
-              uint32_t j = tile_j * tileM + inner_j;
-              uint32_t k = tile_k * tileK + inner_k;
-              tile_buffer[inner_i][inner_j] += A.r(i, k) * B.r(k, j);
-            }
-          }
+      // ijk, accumulating every K-slice into the same tile_buffer
+      for (uint32_t tile_k = 0; tile_k < (K + tileK - 1) / tileK; tile_k++) {
+        uint32_t k0 = tile_k * tileK;
+        uint32_t kk = std::min<uint32_t>(tileK, K - k0);
+        if (n == tileN && m == tileM && kk == tileK) {
+          tile_ijk<T, tileN, tileM, tileK, true>(A, B, tile_buffer, i0, j0, k0,
+                                                 n, m, kk);
+        } else {
+          tile_ijk<T, tileN, tileM, tileK, false>(A, B, tile_buffer, i0, j0,
+                                                  k0, n, m, kk);
         }
+      }
 
-        // Write buffer back
-        for (uint32_t inner_i = 0; inner_i < tileN; inner_i++) {
-          for (uint32_t inner_j = 0; inner_j < tileM; inner_j++) {
-            uint32_t i = tile_i * tileN + inner_i;
-            uint32_t j = tile_j * tileM + inner_j;
-            C.a(i, j) = tile_buffer[inner_i][inner_j];
-          }
+      // Write buffer back
+      for (uint32_t inner_i = 0; inner_i < n; inner_i++) {
+        for (uint32_t inner_j = 0; inner_j < m; inner_j++) {
+          C.a(i0 + inner_i, j0 + inner_j) = tile_buffer[inner_i][inner_j];
         }
       }
     }
@@ -112,42 +163,43 @@ void tiled_ijk_matmul_ijk(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
 
 // STEP 4: As STEP 3, but with kij inner kernel we know is faster
 template <typename T, size_t tileN, size_t tileM, size_t tileK>
-void tiled_ijk_matmul_kij(Matrix<T> &A, Matrix<T> &B, Matrix<T> &C) {
+void tiled_ijk_matmul_kij(MatrixView<const T> A, MatrixView<const T> B,
+                          MatrixView<T> C) {
   uint32_t N, M, K;
   verifyMatmul(A, B, C, N, M, K);
   T tile_buffer[tileN][tileM];
 
-  // TODO: assertions on divisibility of tiling for now
-  for (uint32_t tile_i = 0; tile_i < N / tileN; tile_i++) {
-    for (uint32_t tile_j = 0; tile_j < M / tileM; tile_j++) {
-      for (uint32_t tile_k = 0; tile_k < K / tileK; tile_k++) {
-
-        // Zero tile_buffer
-        for (uint32_t i = 0; i < tileN; i++) {
-          for (uint32_t j = 0; j < tileM; j++) {
-            tile_buffer[i][j] = 0;
-          }
+  for (uint32_t tile_i = 0; tile_i < (N + tileN - 1) / tileN; tile_i++) {
+    for (uint32_t tile_j = 0; tile_j < (M + tileM - 1) / tileM; tile_j++) {
+      uint32_t i0 = tile_i * tileN;
+      uint32_t j0 = tile_j * tileM;
+      uint32_t n = std::min<uint32_t>(tileN, N - i0);
+      uint32_t m = std::min<uint32_t>(tileM, M - j0);
+
+      // Zero tile_buffer
+      for (uint32_t i = 0; i < tileN; i++) {
+        for (uint32_t j = 0; j < tileM; j++) {
+          tile_buffer[i][j] = 0;
         }
+      }
 
-        // kij
-        for (uint32_t inner_k = 0; inner_k < tileK; inner_k++) {
-          for (uint32_t inner_i = 0; inner_i < tileN; inner_i++) {
-            for (uint32_t inner_j = 0; inner_j < tileM; inner_j++) {
-              uint32_t i = tile_i * tileN + inner_i;
-              uint32_t j = tile_j * tileM + inner_j;
-              uint32_t k = tile_k * tileK + inner_k;
-              tile_buffer[inner_i][inner_j] += A.r(i, k) * B.r(k, j);
-            }
-          }
+      // kij, accumulating every K-slice into the same tile_buffer
+      for (uint32_t tile_k = 0; tile_k < (K + tileK - 1) / tileK; tile_k++) {
+        uint32_t k0 = tile_k * tileK;
+        uint32_t kk = std::min<uint32_t>(tileK, K - k0);
+        if (n == tileN && m == tileM && kk == tileK) {
+          tile_kij<T, tileN, tileM, tileK, true>(A, B, tile_buffer, i0, j0, k0,
+                                                 n, m, kk);
+        } else {
+          tile_kij<T, tileN, tileM, tileK, false>(A, B, tile_buffer, i0, j0,
+                                                  k0, n, m, kk);
         }
+      }
 
-        // Write buffer back
-        for (uint32_t inner_i = 0; inner_i < tileN; inner_i++) {
-          for (uint32_t inner_j = 0; inner_j < tileM; inner_j++) {
-            uint32_t i = tile_i * tileN + inner_i;
-            uint32_t j = tile_j * tileM + inner_j;
-            C.a(i, j) = tile_buffer[inner_i][inner_j];
-          }
+      // Write buffer back
+      for (uint32_t inner_i = 0; inner_i < n; inner_i++) {
+        for (uint32_t inner_j = 0; inner_j < m; inner_j++) {
+          C.a(i0 + inner_i, j0 + inner_j) = tile_buffer[inner_i][inner_j];
         }
       }
     }
@@ -0,0 +1,239 @@
+#include "thread_pool.h"
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+namespace support {
+
+// Where the pages of a large buffer end up on a multi-socket machine. Linux
+// places a page on the node of the thread that first writes it, so a matrix
+// filled by one thread lives on one node and every worker on the other
+// sockets reads it remotely.
+enum class Placement {
+    // Left to the first writer
+    DEFAULT,
+    // Row bands touched by the pool worker that owns them in the parallel
+    // kernels, see first_touch_rows
+    FIRST_TOUCH,
+    // Pages spread round robin over the nodes with memory, for data every
+    // worker reads, like B
+    INTERLEAVE,
+};
+
+inline const char* placement_name(Placement placement) {
+    switch (placement) {
+    case Placement::DEFAULT:
+        return "default";
+    case Placement::FIRST_TOUCH:
+        return "first-touch";
+    case Placement::INTERLEAVE:
+        return "interleave";
+    }
+    return "unknown";
+}
+
+inline bool parse_placement(const std::string& name, Placement& placement) {
+    for (Placement p : {Placement::DEFAULT, Placement::FIRST_TOUCH, Placement::INTERLEAVE}) {
+        if (name == placement_name(p)) {
+            placement = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct NumaNode {
+    uint32_t id;
+    // CPUs of the node this process may run on
+    std::vector<uint32_t> cpus;
+    bool has_memory;
+};
+
+// Parses a sysfs cpulist such as "0-3,8-11"
+inline std::vector<uint32_t> parse_cpulist(const std::string& list) {
+    std::vector<uint32_t> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        uint32_t first = std::stoul(range.substr(0, dash));
+        uint32_t last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+        for (uint32_t cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+namespace numa_detail {
+
+inline std::vector<NumaNode> detect_nodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto usable = [&](uint32_t cpu) {
+        return !have_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed));
+    };
+
+    std::vector<NumaNode> nodes;
+    std::vector<uint32_t> with_memory;
+    {
+        std::ifstream file("/sys/devices/system/node/has_memory");
+        std::string list;
+        if (std::getline(file, list)) {
+            with_memory = parse_cpulist(list);
+        }
+    }
+    std::ifstream online_file("/sys/devices/system/node/online");
+    std::string online;
+    std::getline(online_file, online);
+    for (uint32_t id : parse_cpulist(online)) {
+        std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        std::string list;
+        std::getline(cpulist, list);
+        NumaNode node{id, {}, std::find(with_memory.begin(), with_memory.end(), id) !=
+                                  with_memory.end()};
+        for (uint32_t cpu : parse_cpulist(list)) {
+            if (usable(cpu)) {
+                node.cpus.push_back(cpu);
+            }
+        }
+        if (!node.cpus.empty() || node.has_memory) {
+            nodes.push_back(node);
+        }
+    }
+
+    bool any_cpu = std::any_of(nodes.begin(), nodes.end(),
+                               [](const NumaNode& node) { return !node.cpus.empty(); });
+    if (!any_cpu) {
+        // No sysfs (or a container hiding it): one node with every usable CPU
+        NumaNode node{0, {}, true};
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE && node.cpus.size() < 4096; cpu++) {
+            if (have_mask ? CPU_ISSET(cpu, &allowed)
+                          : cpu < std::thread::hardware_concurrency()) {
+                node.cpus.push_back(cpu);
+            }
+        }
+        nodes.assign(1, node);
+    }
+    return nodes;
+}
+
+} // namespace numa_detail
+
+// NUMA nodes from /sys/devices/system/node, read once. Nodes with no usable
+// CPU are kept if they have memory, since they still take interleaved pages.
+inline const std::vector<NumaNode>& numa_nodes() {
+    static const std::vector<NumaNode> nodes = numa_detail::detect_nodes();
+    return nodes;
+}
+
+// Usable CPUs node by node, so that the first n workers pinned in this order
+// fill whole nodes before spilling onto the next
+inline std::vector<uint32_t> compact_cpu_order() {
+    std::vector<uint32_t> order;
+    for (const NumaNode& node : numa_nodes()) {
+        order.insert(order.end(), node.cpus.begin(), node.cpus.end());
+    }
+    return order;
+}
+
+// Index into numa_nodes() of the node holding cpu, 0 if unknown
+inline uint32_t node_of_cpu(uint32_t cpu) {
+    const std::vector<NumaNode>& nodes = numa_nodes();
+    for (uint32_t n = 0; n < nodes.size(); n++) {
+        if (std::find(nodes[n].cpus.begin(), nodes[n].cpus.end(), cpu) != nodes[n].cpus.end()) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+// Pins worker w of pool to the w-th CPU of compact_cpu_order (wrapping when
+// there are more workers than CPUs) and groups workers by node, so work
+// stealing prefers the same socket. Worker 0 is the thread that calls
+// parallel_for, so call this from that thread. Returns false if any worker
+// could not be pinned.
+inline bool pin_workers(ThreadPool& pool) {
+    std::vector<uint32_t> order = compact_cpu_order();
+    if (order.empty()) {
+        return false;
+    }
+    std::vector<uint32_t> groups(pool.size());
+    for (uint32_t w = 0; w < pool.size(); w++) {
+        groups[w] = node_of_cpu(order[w % order.size()]);
+    }
+
+    std::vector<char> pinned(pool.size(), 0);
+    pool.for_each_worker([&](uint32_t worker) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(order[worker % order.size()], &set);
+        pinned[worker] = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    });
+    pool.set_groups(groups);
+    return std::all_of(pinned.begin(), pinned.end(), [](char ok) { return ok != 0; });
+}
+
+// Interleaves the pages wholly inside [data, data + bytes) over the nodes
+// with memory. Only affects pages not yet touched. Returns false when the
+// kernel refuses, e.g. without NUMA support.
+inline bool interleave_pages(void* data, size_t bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (reinterpret_cast<uintptr_t>(data) + page - 1) / page * page;
+    uintptr_t last = (reinterpret_cast<uintptr_t>(data) + bytes) / page * page;
+    if (last <= first) {
+        return false;
+    }
+
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(1);
+    for (const NumaNode& node : numa_nodes()) {
+        if (node.has_memory) {
+            mask.resize(std::max<size_t>(mask.size(), node.id / bits + 1));
+            mask[node.id / bits] |= 1ul << (node.id % bits);
+        }
+    }
+    // maxnode counts one past the highest bit the kernel should read
+    return syscall(SYS_mbind, first, last - first, MPOL_INTERLEAVE, mask.data(),
+                   mask.size() * bits + 1, 0) == 0;
+}
+
+// Zeroes `rows` rows laid out row_bytes apart, with worker w of the global
+// pool writing rows [rows * w / n, rows * (w + 1) / n). The parallel kernels
+// hand out C tiles in row-major order as contiguous runs per worker, so each
+// worker's band lands on its own node. Inside a pool task it all runs on the
+// calling worker.
+inline void first_touch_rows(void* data, size_t row_bytes, uint32_t rows) {
+    ThreadPool& pool = ThreadPool::global();
+    char* base = static_cast<char*>(data);
+    if (ThreadPool::current_worker() >= 0) {
+        std::memset(base, 0, row_bytes * rows);
+        return;
+    }
+    uint32_t workers = pool.size();
+    pool.for_each_worker([&](uint32_t worker) {
+        uint64_t r0 = uint64_t(rows) * worker / workers;
+        uint64_t r1 = uint64_t(rows) * (worker + 1) / workers;
+        std::memset(base + r0 * row_bytes, 0, (r1 - r0) * row_bytes);
+    });
+}
+
+} // namespace support
+
+#endif
@@ -0,0 +1,599 @@
+#include "cpu_features.h"
+#include "epilogue.h"
+#include "gemv.h"
+#include "half.h"
+#include "matrix.h"
+#include "naive_matmul.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+#include <type_traits>
+
+#ifndef __PACKED_MATMUL_H__
+#define __PACKED_MATMUL_H__
+
+using algo::epilogue::Epilogue;
+using support::FloatLoad;
+using support::Matrix;
+using support::MatrixView;
+using support::Workspace;
+
+namespace algo {
+namespace packed {
+
+// Register block of the AVX2 micro-kernel. A 6x16 block of C is held in 12
+// ymm accumulators, leaving 4 registers for the two B vectors and the
+// broadcast A value. 12 independent FMA chains are enough to hide the FMA
+// latency on both ports (see peak_flops in old_archive/matvec.cc). The SSE and
+// AVX-512 kernels below use their own blocks, see SseKernel and Avx512Kernel.
+constexpr uint32_t MR = 6;
+constexpr uint32_t NR = 16;
+
+// Packs the [mc, kc] block of A at (i0, k0) into row panels of mR rows. Each
+// panel is stored k-major so the micro-kernel reads mR contiguous values per k.
+// Rows past the end of A are zero filled. A transposed float view (columns
+// contiguous) packs with straight copies, a row-major one reads each row
+// sequentially and scatters it into the panel. Load widens other storage
+// types to float as they are packed (see support::FloatLoad).
+template <typename Load = FloatLoad, uint32_t mR = MR>
+inline void packA(const MatrixView<const typename Load::type> &A, uint32_t i0,
+                  uint32_t k0, uint32_t mc, uint32_t kc, float *packed) {
+  constexpr bool isFloat = std::is_same<typename Load::type, float>::value;
+  bool columnsContiguous = A.get_row_stride() == 1;
+  bool rowsContiguous = A.get_col_stride() == 1;
+  for (uint32_t ir = 0; ir < mc; ir += mR) {
+    uint32_t mr = std::min(mR, mc - ir);
+    if (rowsContiguous && !columnsContiguous) {
+      for (uint32_t i = 0; i < mR; i++) {
+        if (i < mr) {
+          const auto *row = &A.r(i0 + ir + i, k0);
+          for (uint32_t k = 0; k < kc; k++) {
+            packed[k * mR + i] = Load::load1(row + k);
+          }
+        } else {
+          for (uint32_t k = 0; k < kc; k++) {
+            packed[k * mR + i] = 0;
+          }
+        }
+      }
+      packed += kc * mR;
+      continue;
+    }
+
+    for (uint32_t k = 0; k < kc; k++) {
+      if (isFloat && columnsContiguous) {
+        std::memcpy(packed, &A.r(i0 + ir, k0 + k), sizeof(float) * mr);
+      } else {
+        for (uint32_t i = 0; i < mr; i++) {
+          packed[i] = Load::load1(&A.r(i0 + ir + i, k0 + k));
+        }
+      }
+      for (uint32_t i = mr; i < mR; i++) {
+        packed[i] = 0;
+      }
+      packed += mR;
+    }
+  }
+}
+
+// Widens n elements of a contiguous row to float, n a multiple of 8
+template <typename Load>
+TARGET_AVX2 inline void widenRow(const typename Load::type *row, float *packed,
+                                 uint32_t n) {
+  for (uint32_t j = 0; j < n; j += 8) {
+    _mm256_store_ps(packed + j, Load::load8(row + j));
+  }
+}
+
+// Packs the [kc, nc] block of B at (k0, j0) into column panels of nR columns,
+// k-major, zero filling columns past the end of B. Rows of a row-major B are
+// copied (or widened 8 at a time with AVX2) directly, any other layout is
+// gathered element by element.
+template <typename Load = FloatLoad, uint32_t nR = NR>
+inline void packB(const MatrixView<const typename Load::type> &B, uint32_t k0,
+                  uint32_t j0, uint32_t kc, uint32_t nc, float *packed) {
+  constexpr bool isFloat = std::is_same<typename Load::type, float>::value;
+  bool rowsContiguous = B.get_col_stride() == 1;
+  bool widen = !isFloat && rowsContiguous &&
+               support::active_isa() >= support::Isa::AVX2;
+  for (uint32_t jr = 0; jr < nc; jr += nR) {
+    uint32_t nr = std::min(nR, nc - jr);
+    for (uint32_t k = 0; k < kc; k++) {
+      const auto *row = &B.r(k0 + k, j0 + jr);
+      if (isFloat && rowsContiguous) {
+        std::memcpy(packed, row, sizeof(float) * nr);
+      } else if (widen && nr == nR) {
+        widenRow<Load>(row, packed, nR);
+      } else {
+        for (uint32_t j = 0; j < nr; j++) {
+          packed[j] = Load::load1(&B.r(k0 + k, j0 + jr + j));
+        }
+      }
+      for (uint32_t j = nr; j < nR; j++) {
+        packed[j] = 0;
+      }
+      packed += nR;
+    }
+  }
+}
+
+// Operand sources for the parallel GEMM, which only sees its operands through
+// pack<R>(...) calls with the arguments of packA and packB. These two pack a
+// plain float view; conv2d.h gathers convolution patches straight into the
+// panels instead, so the unfolded matrix never exists.
+struct ViewPackerA {
+  MatrixView<const float> view;
+
+  template <uint32_t mR>
+  void pack(uint32_t i0, uint32_t k0, uint32_t mc, uint32_t kc,
+            float *packed) const {
+    packA<FloatLoad, mR>(view, i0, k0, mc, kc, packed);
+  }
+};
+
+struct ViewPackerB {
+  MatrixView<const float> view;
+
+  template <uint32_t nR>
+  void pack(uint32_t k0, uint32_t j0, uint32_t kc, uint32_t nc,
+            float *packed) const {
+    packB<FloatLoad, nR>(view, k0, j0, kc, nc, packed);
+  }
+};
+
+// Lane masks for _mm256_maskload_ps/_mm256_maskstore_ps. Loading 8 ints at
+// maskTable + 8 - n enables the first n lanes, for n in [0, 8].
+alignas(64) static const int32_t maskTable[16] = {-1, -1, -1, -1, -1, -1,
+                                                  -1, -1, 0,  0,  0,  0,
+                                                  0,  0,  0,  0};
+
+TARGET_AVX2 inline __m256i laneMask(uint32_t n) {
+  return _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(maskTable + 8 - n));
+}
+
+// c[MR][2] += packedA[kc, MR]^T @ packedB[kc, NR]
+TARGET_AVX2 inline void accumulate_6x16(uint32_t kc, const float *packedA,
+                                        const float *packedB,
+                                        __m256 (&c)[MR][2]) {
+  for (uint32_t k = 0; k < kc; k++) {
+    __m256 b0 = _mm256_load_ps(packedB);
+    __m256 b1 = _mm256_load_ps(packedB + 8);
+    for (uint32_t i = 0; i < MR; i++) {
+      __m256 a = _mm256_broadcast_ss(packedA + i);
+      c[i][0] = _mm256_fmadd_ps(a, b0, c[i][0]);
+      c[i][1] = _mm256_fmadd_ps(a, b1, c[i][1]);
+    }
+    packedA += MR;
+    packedB += NR;
+  }
+}
+
+// C[MR, NR] = alpha * packedA[kc, MR]^T @ packedB[kc, NR] + beta * C. C rows
+// are ldc apart. When beta is 0 C is overwritten instead of read.
+TARGET_AVX2 inline void kernel_6x16(uint32_t kc, const float *packedA,
+                                    const float *packedB, float *C,
+                                    uint32_t ldc, float alpha, float beta) {
+  __m256 c[MR][2];
+  for (uint32_t i = 0; i < MR; i++) {
+    c[i][0] = _mm256_setzero_ps();
+    c[i][1] = _mm256_setzero_ps();
+  }
+
+  accumulate_6x16(kc, packedA, packedB, c);
+
+  __m256 va = _mm256_set1_ps(alpha), vb = _mm256_set1_ps(beta);
+  for (uint32_t i = 0; i < MR; i++) {
+    if (alpha != 1) {
+      c[i][0] = _mm256_mul_ps(c[i][0], va);
+      c[i][1] = _mm256_mul_ps(c[i][1], va);
+    }
+    if (beta != 0) {
+      c[i][0] = _mm256_fmadd_ps(_mm256_loadu_ps(C + i * ldc), vb, c[i][0]);
+      c[i][1] = _mm256_fmadd_ps(_mm256_loadu_ps(C + i * ldc + 8), vb, c[i][1]);
+    }
+    _mm256_storeu_ps(C + i * ldc, c[i][0]);
+    _mm256_storeu_ps(C + i * ldc + 8, c[i][1]);
+  }
+}
+
+// Fringe version of kernel_6x16 for the partial tiles on the bottom/right edge
+// of C. Only the first mr rows and nr columns of C are touched: columns go
+// through masked loads/stores and rows past mr are computed from the zero
+// padding of packedA but never written.
+TARGET_AVX2 inline void kernel_6x16_masked(uint32_t kc, const float *packedA,
+                                           const float *packedB, float *C,
+                                           uint32_t ldc, uint32_t mr,
+                                           uint32_t nr, float alpha,
+                                           float beta) {
+  __m256i mask0 = laneMask(std::min<uint32_t>(nr, 8));
+  __m256i mask1 = laneMask(nr > 8 ? nr - 8 : 0);
+
+  __m256 c[MR][2];
+  for (uint32_t i = 0; i < MR; i++) {
+    c[i][0] = _mm256_setzero_ps();
+    c[i][1] = _mm256_setzero_ps();
+  }
+
+  accumulate_6x16(kc, packedA, packedB, c);
+
+  __m256 va = _mm256_set1_ps(alpha), vb = _mm256_set1_ps(beta);
+  for (uint32_t i = 0; i < mr; i++) {
+    if (alpha != 1) {
+      c[i][0] = _mm256_mul_ps(c[i][0], va);
+      c[i][1] = _mm256_mul_ps(c[i][1], va);
+    }
+    if (beta != 0) {
+      c[i][0] = _mm256_fmadd_ps(_mm256_maskload_ps(C + i * ldc, mask0), vb,
+                                c[i][0]);
+      c[i][1] = _mm256_fmadd_ps(_mm256_maskload_ps(C + i * ldc + 8, mask1), vb,
+                                c[i][1]);
+    }
+    _mm256_maskstore_ps(C + i * ldc, mask0, c[i][0]);
+    _mm256_maskstore_ps(C + i * ldc + 8, mask1, c[i][1]);
+  }
+}
+
+// Runs the micro-kernel over every [MR, NR] tile of an [mc, nc] block of C,
+// switching to the masked kernel for partial tiles on the edges. epilogue is
+// the part for this K block (see Epilogue::block) with its bias at C's (0, 0);
+// bias and activation are applied to each tile as soon as it is stored.
+TARGET_AVX2 inline void macroKernel(uint32_t mc, uint32_t nc, uint32_t kc,
+                                    const float *packedA, const float *packedB,
+                                    float *C, uint32_t ldc,
+                                    const Epilogue &epilogue) {
+  bool post = epilogue.has_post();
+  for (uint32_t jr = 0; jr < nc; jr += NR) {
+    uint32_t nr = std::min(NR, nc - jr);
+    const float *panelB = packedB + jr * kc;
+    for (uint32_t ir = 0; ir < mc; ir += MR) {
+      uint32_t mr = std::min(MR, mc - ir);
+      const float *panelA = packedA + ir * kc;
+      float *tileC = C + ir * ldc + jr;
+
+      if (mr == MR && nr == NR) {
+        kernel_6x16(kc, panelA, panelB, tileC, ldc, epilogue.alpha,
+                    epilogue.beta);
+      } else {
+        kernel_6x16_masked(kc, panelA, panelB, tileC, ldc, mr, nr,
+                           epilogue.alpha, epilogue.beta);
+      }
+      if (post) {
+        epilogue::finishTile(tileC, ldc, mr, nr,
+                             epilogue.block(ir, jr, false, true));
+      }
+    }
+  }
+}
+
+// SSE fallback: a 6x8 block of C in 12 xmm accumulators, multiply then add
+// as there is no FMA. C[6, 8] = alpha * packedA[kc, 6]^T @ packedB[kc, 8] +
+// beta * C
+inline void kernel_6x8(uint32_t kc, const float *packedA, const float *packedB,
+                       float *C, uint32_t ldc, float alpha, float beta) {
+  __m128 c[6][2];
+  for (uint32_t i = 0; i < 6; i++) {
+    c[i][0] = _mm_setzero_ps();
+    c[i][1] = _mm_setzero_ps();
+  }
+
+  for (uint32_t k = 0; k < kc; k++) {
+    __m128 b0 = _mm_load_ps(packedB);
+    __m128 b1 = _mm_load_ps(packedB + 4);
+    for (uint32_t i = 0; i < 6; i++) {
+      __m128 a = _mm_set1_ps(packedA[i]);
+      c[i][0] = _mm_add_ps(c[i][0], _mm_mul_ps(a, b0));
+      c[i][1] = _mm_add_ps(c[i][1], _mm_mul_ps(a, b1));
+    }
+    packedA += 6;
+    packedB += 8;
+  }
+
+  __m128 va = _mm_set1_ps(alpha), vb = _mm_set1_ps(beta);
+  for (uint32_t i = 0; i < 6; i++) {
+    if (alpha != 1) {
+      c[i][0] = _mm_mul_ps(c[i][0], va);
+      c[i][1] = _mm_mul_ps(c[i][1], va);
+    }
+    if (beta != 0) {
+      c[i][0] = _mm_add_ps(c[i][0], _mm_mul_ps(_mm_loadu_ps(C + i * ldc), vb));
+      c[i][1] =
+          _mm_add_ps(c[i][1], _mm_mul_ps(_mm_loadu_ps(C + i * ldc + 4), vb));
+    }
+    _mm_storeu_ps(C + i * ldc, c[i][0]);
+    _mm_storeu_ps(C + i * ldc + 4, c[i][1]);
+  }
+}
+
+// Partial tiles of the SSE kernel have no masked loads: the whole tile is
+// computed into a local buffer and only its first mr rows and nr columns are
+// written to C.
+inline void kernel_6x8_partial(uint32_t kc, const float *packedA,
+                               const float *packedB, float *C, uint32_t ldc,
+                               uint32_t mr, uint32_t nr, float alpha,
+                               float beta) {
+  alignas(16) float tile[6 * 8];
+  kernel_6x8(kc, packedA, packedB, tile, 8, alpha, 0);
+  for (uint32_t i = 0; i < mr; i++) {
+    for (uint32_t j = 0; j < nr; j++) {
+      C[i * ldc + j] = beta == 0 ? tile[i * 8 + j]
+                                 : tile[i * 8 + j] + beta * C[i * ldc + j];
+    }
+  }
+}
+
+// AVX-512: a 12x32 block of C in 24 zmm accumulators, with 2 registers for B
+// and one for the broadcast A value out of 32.
+TARGET_AVX512 inline void accumulate_12x32(uint32_t kc, const float *packedA,
+                                           const float *packedB,
+                                           __m512 (&c)[12][2]) {
+  for (uint32_t k = 0; k < kc; k++) {
+    __m512 b0 = _mm512_load_ps(packedB);
+    __m512 b1 = _mm512_load_ps(packedB + 16);
+    for (uint32_t i = 0; i < 12; i++) {
+      __m512 a = _mm512_set1_ps(packedA[i]);
+      c[i][0] = _mm512_fmadd_ps(a, b0, c[i][0]);
+      c[i][1] = _mm512_fmadd_ps(a, b1, c[i][1]);
+    }
+    packedA += 12;
+    packedB += 32;
+  }
+}
+
+// As kernel_6x16_masked for the 12x32 block, with mask registers. Full tiles
+// pass mr = 12 and nr = 32.
+TARGET_AVX512 inline void kernel_12x32(uint32_t kc, const float *packedA,
+                                       const float *packedB, float *C,
+                                       uint32_t ldc, uint32_t mr, uint32_t nr,
+                                       float alpha, float beta) {
+  __mmask16 mask0 = nr >= 16 ? 0xffff : (1u << nr) - 1;
+  __mmask16 mask1 = nr >= 32 ? 0xffff : nr > 16 ? (1u << (nr - 16)) - 1 : 0;
+
+  __m512 c[12][2];
+  for (uint32_t i = 0; i < 12; i++) {
+    c[i][0] = _mm512_setzero_ps();
+    c[i][1] = _mm512_setzero_ps();
+  }
+
+  accumulate_12x32(kc, packedA, packedB, c);
+
+  __m512 va = _mm512_set1_ps(alpha), vb = _mm512_set1_ps(beta);
+  for (uint32_t i = 0; i < mr; i++) {
+    if (alpha != 1) {
+      c[i][0] = _mm512_mul_ps(c[i][0], va);
+      c[i][1] = _mm512_mul_ps(c[i][1], va);
+    }
+    if (beta != 0) {
+      c[i][0] = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask0, C + i * ldc), vb,
+                                c[i][0]);
+      c[i][1] = _mm512_fmadd_ps(
+          _mm512_maskz_loadu_ps(mask1, C + i * ldc + 16), vb, c[i][1]);
+    }
+    _mm512_mask_storeu_ps(C + i * ldc, mask0, c[i][0]);
+    _mm512_mask_storeu_ps(C + i * ldc + 16, mask1, c[i][1]);
+  }
+}
+
+// Micro-kernel families, one per support::Isa. Each names its register block
+// and runs the micro-kernel over every tile of an [mc, nc] block of packed
+// panels, as macroKernel does for AVX2.
+struct SseKernel {
+  static constexpr uint32_t MR = 6;
+  static constexpr uint32_t NR = 8;
+
+  static void macroKernel(uint32_t mc, uint32_t nc, uint32_t kc,
+                          const float *packedA, const float *packedB, float *C,
+                          uint32_t ldc, const Epilogue &epilogue) {
+    bool post = epilogue.has_post();
+    for (uint32_t jr = 0; jr < nc; jr += NR) {
+      uint32_t nr = std::min(NR, nc - jr);
+      for (uint32_t ir = 0; ir < mc; ir += MR) {
+        uint32_t mr = std::min(MR, mc - ir);
+        const float *panelA = packedA + ir * kc;
+        const float *panelB = packedB + jr * kc;
+        float *tileC = C + ir * ldc + jr;
+        if (mr == MR && nr == NR) {
+          kernel_6x8(kc, panelA, panelB, tileC, ldc, epilogue.alpha,
+                     epilogue.beta);
+        } else {
+          kernel_6x8_partial(kc, panelA, panelB, tileC, ldc, mr, nr,
+                             epilogue.alpha, epilogue.beta);
+        }
+        if (post) {
+          epilogue::finishTile(tileC, ldc, mr, nr,
+                               epilogue.block(ir, jr, false, true));
+        }
+      }
+    }
+  }
+};
+
+struct Avx2Kernel {
+  static constexpr uint32_t MR = packed::MR;
+  static constexpr uint32_t NR = packed::NR;
+
+  static void macroKernel(uint32_t mc, uint32_t nc, uint32_t kc,
+                          const float *packedA, const float *packedB, float *C,
+                          uint32_t ldc, const Epilogue &epilogue) {
+    packed::macroKernel(mc, nc, kc, packedA, packedB, C, ldc, epilogue);
+  }
+};
+
+struct Avx512Kernel {
+  static constexpr uint32_t MR = 12;
+  static constexpr uint32_t NR = 32;
+
+  TARGET_AVX512 static void macroKernel(uint32_t mc, uint32_t nc, uint32_t kc,
+                                        const float *packedA,
+                                        const float *packedB, float *C,
+                                        uint32_t ldc,
+                                        const Epilogue &epilogue) {
+    bool post = epilogue.has_post();
+    for (uint32_t jr = 0; jr < nc; jr += NR) {
+      uint32_t nr = std::min(NR, nc - jr);
+      for (uint32_t ir = 0; ir < mc; ir += MR) {
+        uint32_t mr = std::min(MR, mc - ir);
+        float *tileC = C + ir * ldc + jr;
+        kernel_12x32(kc, packedA + ir * kc, packedB + jr * kc, tileC, ldc, mr,
+                     nr, epilogue.alpha, epilogue.beta);
+        if (post) {
+          epilogue::finishTile(tileC, ldc, mr, nr,
+                               epilogue.block(ir, jr, false, true));
+        }
+      }
+    }
+  }
+};
+
+// Calls fn(Kernel()) with the micro-kernel family of support::active_isa()
+template <typename F> void withKernel(F &&fn) {
+  switch (support::active_isa()) {
+  case support::Isa::AVX512:
+    fn(Avx512Kernel());
+    break;
+  case support::Isa::AVX2:
+    fn(Avx2Kernel());
+    break;
+  default:
+    fn(SseKernel());
+    break;
+  }
+}
+
+// The blocked loops of packedGemm for one micro-kernel family. Panels are
+// padded to whole register blocks, so the tile sizes need not be multiples of
+// Kernel::MR and Kernel::NR.
+template <size_t tileMC, size_t tileKC, size_t tileNC, typename Kernel,
+          typename LoadA, typename LoadB>
+void blockedGemm(MatrixView<const typename LoadA::type> A,
+                 MatrixView<const typename LoadB::type> B, MatrixView<float> C,
+                 const Epilogue &epilogue, Workspace &workspace) {
+  constexpr uint32_t mR = Kernel::MR, nR = Kernel::NR;
+  uint32_t N = A.get_height(), M = B.get_width(), K = A.get_width();
+  uint32_t ldc = C.get_row_stride();
+
+  Workspace::Scope scope(workspace);
+  float *packedA =
+      workspace.alloc<float>((tileMC + mR - 1) / mR * mR * tileKC);
+  float *packedB = workspace.alloc<float>(
+      (std::min<size_t>(tileNC, M) + nR - 1) / nR * nR * tileKC);
+
+  for (uint32_t jc = 0; jc < M; jc += tileNC) {
+    uint32_t nc = std::min<uint32_t>(tileNC, M - jc);
+    for (uint32_t pc = 0; pc < K; pc += tileKC) {
+      uint32_t kc = std::min<uint32_t>(tileKC, K - pc);
+      packB<LoadB, nR>(B, pc, jc, kc, nc, packedB);
+
+      for (uint32_t ic = 0; ic < N; ic += tileMC) {
+        uint32_t mc = std::min<uint32_t>(tileMC, N - ic);
+        packA<LoadA, mR>(A, ic, pc, mc, kc, packedA);
+        Kernel::macroKernel(mc, nc, kc, packedA, packedB, &C.a(ic, jc), ldc,
+                            epilogue.block(ic, jc, pc == 0, pc + kc == K));
+      }
+    }
+  }
+}
+
+// STEP 5: Goto/BLIS style GEMM. B is packed into [tileKC, tileNC] column
+// panels that stay in L3, A into [tileMC, tileKC] row panels that stay in L2,
+// and the FMA micro-kernel streams both from contiguous memory. The
+// micro-kernel is the widest one the CPU supports (see withKernel), 6x16 with
+// AVX2. Packed panels are carved out of workspace, so repeated calls do not
+// allocate. LoadA and LoadB give the storage types of A and B, which are
+// widened to float while packing; accumulation is always in float. The
+// epilogue is fused into the micro-kernel's write-back of C.
+template <size_t tileMC, size_t tileKC, size_t tileNC, typename LoadA,
+          typename LoadB>
+void packedGemm(MatrixView<const typename LoadA::type> A,
+                MatrixView<const typename LoadB::type> B, MatrixView<float> C,
+                Workspace &workspace, const Epilogue &epilogue = Epilogue()) {
+  bool vector = C.get_width() == 1 || C.get_height() == 1;
+  bool strided = C.get_col_stride() != 1 && C.get_row_stride() != 1;
+  if (!epilogue.is_identity() && (vector || strided || A.get_width() == 0)) {
+    // No micro-kernel to fuse into: compute the product, then apply
+    Workspace::Scope scope(workspace);
+    uint32_t N = C.get_height(), M = C.get_width();
+    MatrixView<float> P(workspace.alloc<float>(size_t(N) * M), M, N, M);
+    packedGemm<tileMC, tileKC, tileNC, LoadA, LoadB>(A, B, P, workspace);
+    epilogue::apply(P, C, epilogue);
+    return;
+  }
+
+  // A single row or column of C is a matrix-vector product, bound by
+  // bandwidth rather than FMA throughput
+  if (gemv::matmul_as_gemv<LoadA, LoadB>(A, B, C, 1, workspace)) {
+    return;
+  }
+
+  if (C.get_col_stride() != 1) {
+    // The micro-kernel writes contiguous rows of C. A transposed C is
+    // computed as C^T = B^T @ A^T, any other layout uses the reference kernel.
+    if (C.get_row_stride() == 1) {
+      packedGemm<tileMC, tileKC, tileNC, LoadB, LoadA>(
+          B.t(), A.t(), C.t(), workspace, epilogue.transposed());
+    } else if constexpr (std::is_same<typename LoadA::type, float>::value &&
+                         std::is_same<typename LoadB::type, float>::value) {
+      naive::naive_matmul_kij<float>(A, B, C);
+    } else {
+      for (uint32_t i = 0; i < C.get_height(); i++) {
+        for (uint32_t j = 0; j < C.get_width(); j++) {
+          float sum = 0;
+          for (uint32_t k = 0; k < A.get_width(); k++) {
+            sum += LoadA::load1(&A.r(i, k)) * LoadB::load1(&B.r(k, j));
+          }
+          C.a(i, j) = sum;
+        }
+      }
+    }
+    return;
+  }
+
+  if (A.get_width() == 0) {
+    for (uint32_t i = 0; i < C.get_height(); i++) {
+      std::memset(&C.a(i, 0), 0, sizeof(float) * C.get_width());
+    }
+    return;
+  }
+
+  withKernel([&](auto kernel) {
+    blockedGemm<tileMC, tileKC, tileNC, decltype(kernel), LoadA, LoadB>(
+        A, B, C, epilogue, workspace);
+  });
+}
+
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void packed_matmul_ws(MatrixView<const float> A, MatrixView<const float> B,
+                      MatrixView<float> C, Workspace &workspace) {
+  packedGemm<tileMC, tileKC, tileNC, FloatLoad, FloatLoad>(A, B, C, workspace);
+}
+
+// As packed_matmul_ws, on the calling thread's workspace
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void packed_matmul(MatrixView<const float> A, MatrixView<const float> B,
+                   MatrixView<float> C) {
+  packed_matmul_ws<tileMC, tileKC, tileNC>(A, B, C, Workspace::local());
+}
+
+// C = epilogue(A @ B, C): alpha/beta scaling, bias and activation applied as
+// each tile of C is written, without extra passes over C
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void packed_matmul_fused_ws(MatrixView<const float> A,
+                            MatrixView<const float> B, MatrixView<float> C,
+                            const Epilogue &epilogue, Workspace &workspace) {
+  packedGemm<tileMC, tileKC, tileNC, FloatLoad, FloatLoad>(A, B, C, workspace,
+                                                           epilogue);
+}
+
+// As packed_matmul_fused_ws, on the calling thread's workspace
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080>
+void packed_matmul_fused(MatrixView<const float> A, MatrixView<const float> B,
+                         MatrixView<float> C, const Epilogue &epilogue) {
+  packed_matmul_fused_ws<tileMC, tileKC, tileNC>(A, B, C, epilogue,
+                                                 Workspace::local());
+}
+
+} // namespace packed
+} // namespace algo
+#endif
@@ -0,0 +1,183 @@
+#include "epilogue.h"
+#include "gemv.h"
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cstring>
+
+#ifndef __PARALLEL_MATMUL_H__
+#define __PARALLEL_MATMUL_H__
+
+using algo::epilogue::Epilogue;
+using support::Matrix;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace parallel {
+
+// The tiled loops of packed_matmul_threads for one micro-kernel family, for
+// an [N, K] A and a [K, M] B packed by packerA and packerB (see
+// packed::ViewPackerA). K must not be 0.
+template <size_t tileMC, size_t tileKC, size_t tileNC, size_t tileNT,
+          typename Kernel, typename PackerA, typename PackerB>
+void parallelGemm(uint32_t N, uint32_t M, uint32_t K, const PackerA &packerA,
+                  const PackerB &packerB, MatrixView<float> C,
+                  const Epilogue &epilogue, uint32_t workers,
+                  Workspace &workspace) {
+  constexpr uint32_t mR = Kernel::MR, nR = Kernel::NR;
+  static_assert(tileNT % nR == 0,
+                "tileNT must be a multiple of every micro-kernel's NR");
+
+  uint32_t ldc = C.get_row_stride();
+  // Per worker A panels, padded to whole register blocks
+  size_t panelA = size_t(tileMC + mR - 1) / mR * mR * tileKC;
+
+  ThreadPool &pool = ThreadPool::global();
+  Workspace::Scope scope(workspace);
+  float *packedB = workspace.alloc<float>(
+      (std::min<size_t>(tileNC, M) + nR - 1) / nR * nR * tileKC);
+  float *packedA = workspace.alloc<float>(workers * panelA);
+  int64_t *packedRows = workspace.alloc<int64_t>(workers);
+
+  for (uint32_t jc = 0; jc < M; jc += tileNC) {
+    uint32_t nc = std::min<uint32_t>(tileNC, M - jc);
+    uint32_t panels = (nc + nR - 1) / nR;
+    uint32_t colTiles = (nc + tileNT - 1) / tileNT;
+    uint32_t rowTiles = (N + tileMC - 1) / tileMC;
+
+    for (uint32_t pc = 0; pc < K; pc += tileKC) {
+      uint32_t kc = std::min<uint32_t>(tileKC, K - pc);
+
+      pool.parallel_for(
+          panels,
+          [&](uint32_t panel, uint32_t) {
+            uint32_t jr = panel * nR;
+            packerB.template pack<nR>(pc, jc + jr, kc, std::min(nR, nc - jr),
+                                      packedB + jr * kc);
+          },
+          workers);
+
+      std::fill(packedRows, packedRows + workers, -1);
+      pool.parallel_for(
+          rowTiles * colTiles,
+          [&](uint32_t task, uint32_t worker) {
+            uint32_t tile_i = task / colTiles;
+            uint32_t tile_j = task % colTiles;
+            uint32_t ic = tile_i * tileMC;
+            uint32_t jt = tile_j * tileNT;
+            uint32_t mc = std::min<uint32_t>(tileMC, N - ic);
+            uint32_t nt = std::min<uint32_t>(tileNT, nc - jt);
+
+            float *workerA = packedA + worker * panelA;
+            if (packedRows[worker] != tile_i) {
+              packerA.template pack<mR>(ic, pc, mc, kc, workerA);
+              packedRows[worker] = tile_i;
+            }
+            Kernel::macroKernel(
+                mc, nt, kc, workerA, packedB + jt * kc, &C.a(ic, jc + jt), ldc,
+                epilogue.block(ic, jc + jt, pc == 0, pc + kc == K));
+          },
+          workers);
+    }
+  }
+}
+
+// STEP 6: The packed GEMM spread over the persistent thread pool. For every
+// [tileKC, tileNC] panel of B the panel is packed cooperatively, then the C
+// block is cut into a grid of [tileMC, tileNT] tiles which are handed out as
+// tasks. Each worker packs its own A block into private scratch and skips the
+// repack when consecutive tasks share the same rows. All scratch, including
+// the per-worker panels, comes from the caller's workspace. The epilogue is
+// fused into the write-back of every tile, see packed::packed_matmul_fused.
+// Tiles are numbered row-major and the pool starts each worker on its own
+// contiguous run, so a worker owns a band of C (and A) rows: the band that
+// Placement::FIRST_TOUCH puts on its NUMA node, see numa.h.
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080,
+          size_t tileNT = 128>
+void packed_matmul_fused_threads(MatrixView<const float> A,
+                                 MatrixView<const float> B,
+                                 MatrixView<float> C, const Epilogue &epilogue,
+                                 uint32_t threads,
+                                 Workspace &workspace = Workspace::local()) {
+  bool vector = C.get_width() == 1 || C.get_height() == 1;
+  bool strided = C.get_col_stride() != 1 && C.get_row_stride() != 1;
+  if (!epilogue.is_identity() && (vector || strided || A.get_width() == 0)) {
+    // No micro-kernel to fuse into: compute the product, then apply
+    Workspace::Scope scope(workspace);
+    uint32_t N = C.get_height(), M = C.get_width();
+    MatrixView<float> P(workspace.alloc<float>(size_t(N) * M), M, N, M);
+    packed_matmul_fused_threads<tileMC, tileKC, tileNC, tileNT>(
+        A, B, P, Epilogue(), threads, workspace);
+    epilogue::apply(P, C, epilogue);
+    return;
+  }
+
+  if (gemv::matmul_as_gemv(A, B, C, threads, workspace)) {
+    return;
+  }
+
+  if (C.get_col_stride() != 1) {
+    // See algo::packed::packed_matmul
+    if (C.get_row_stride() == 1) {
+      packed_matmul_fused_threads<tileMC, tileKC, tileNC, tileNT>(
+          B.t(), A.t(), C.t(), epilogue.transposed(), threads, workspace);
+    } else {
+      naive::naive_matmul_kij<float>(A, B, C);
+    }
+    return;
+  }
+
+  uint32_t N, M, K;
+  naive::verifyMatmul(A, B, C, N, M, K);
+
+  if (K == 0) {
+    for (uint32_t i = 0; i < N; i++) {
+      std::memset(&C.a(i, 0), 0, sizeof(float) * M);
+    }
+    return;
+  }
+
+  ThreadPool &pool = ThreadPool::global();
+  uint32_t workers = threads == 0 ? pool.size() : std::min(threads, pool.size());
+  packed::withKernel([&](auto kernel) {
+    parallelGemm<tileMC, tileKC, tileNC, tileNT, decltype(kernel)>(
+        N, M, K, packed::ViewPackerA{A}, packed::ViewPackerB{B}, C, epilogue,
+        workers, workspace);
+  });
+}
+
+// C = A @ B on `threads` workers of the global pool, 0 meaning all of them
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080,
+          size_t tileNT = 128>
+void packed_matmul_threads(MatrixView<const float> A,
+                           MatrixView<const float> B, MatrixView<float> C,
+                           uint32_t threads,
+                           Workspace &workspace = Workspace::local()) {
+  packed_matmul_fused_threads<tileMC, tileKC, tileNC, tileNT>(
+      A, B, C, Epilogue(), threads, workspace);
+}
+
+// As packed_matmul_threads, using every worker of the global pool
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080,
+          size_t tileNT = 128>
+void packed_matmul(MatrixView<const float> A, MatrixView<const float> B,
+                   MatrixView<float> C) {
+  packed_matmul_threads<tileMC, tileKC, tileNC, tileNT>(A, B, C, 0);
+}
+
+// As packed_matmul_fused_threads, using every worker of the global pool
+template <size_t tileMC = 72, size_t tileKC = 256, size_t tileNC = 4080,
+          size_t tileNT = 128>
+void packed_matmul_fused(MatrixView<const float> A, MatrixView<const float> B,
+                         MatrixView<float> C, const Epilogue &epilogue) {
+  packed_matmul_fused_threads<tileMC, tileKC, tileNC, tileNT>(A, B, C,
+                                                              epilogue, 0);
+}
+
+} // namespace parallel
+} // namespace algo
+#endif
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+namespace support {
+
+// Hardware counters read straight from perf_event_open(2), no LIKWID needed.
+//
+// Counters are opened with inherit set, so threads spawned after construction
+// (e.g. the global ThreadPool) are counted too; create the PerfCounters before
+// the first parallel kernel runs. Each counter is opened on its own: whatever
+// the kernel, PMU or perf_event_paranoid setting refuses is simply reported
+// as unavailable.
+class PerfCounters {
+public:
+    enum Event {
+        CYCLES,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        DTLB_MISSES,
+        // Intel FP_ARITH_INST_RETIRED, single precision, by vector width
+        FP_SCALAR_SINGLE,
+        FP_128_SINGLE,
+        FP_256_SINGLE,
+        FP_512_SINGLE,
+        NUM_EVENTS
+    };
+
+    struct Sample {
+        double value[NUM_EVENTS];
+        bool valid[NUM_EVENTS];
+
+        bool has(Event event) const {
+            return valid[event];
+        }
+
+        // Single precision flop counted by the FP_ARITH events, an FMA counts
+        // as two. Only meaningful when has_flops().
+        double flops() const {
+            return value[FP_SCALAR_SINGLE] + 4 * value[FP_128_SINGLE] +
+                   8 * value[FP_256_SINGLE] + 16 * value[FP_512_SINGLE];
+        }
+
+        bool has_flops() const {
+            return valid[FP_SCALAR_SINGLE] && valid[FP_128_SINGLE] && valid[FP_256_SINGLE];
+        }
+    };
+
+    PerfCounters() {
+        bool intel = cpuVendor() == "GenuineIntel";
+        for (int event = 0; event < NUM_EVENTS; event++) {
+            perf_event_attr attr = attrFor(Event(event), intel);
+            _fds[event] = attr.size == 0 ? -1 : open(attr);
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : _fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available(Event event) const {
+        return _fds[event] >= 0;
+    }
+
+    bool any_available() const {
+        for (int fd : _fds) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start() {
+        for (int fd : _fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // Stops counting and returns the counts since start(), scaled up when the
+    // kernel had to multiplex the PMU between counters
+    Sample stop() {
+        for (int fd : _fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+
+        Sample sample;
+        for (int event = 0; event < NUM_EVENTS; event++) {
+            sample.value[event] = 0;
+            sample.valid[event] = false;
+
+            uint64_t data[3];
+            if (_fds[event] < 0 || read(_fds[event], data, sizeof(data)) != sizeof(data)) {
+                continue;
+            }
+            uint64_t value = data[0], enabled = data[1], running = data[2];
+            if (running == 0) {
+                continue;
+            }
+            sample.value[event] = double(value) * enabled / running;
+            sample.valid[event] = true;
+        }
+        return sample;
+    }
+
+    // Derived metrics for a run of `flop` useful floating point operations:
+    // IPC, misses per flop and, where the FP events exist, the ratio of
+    // retired to useful flop. Unavailable counters are left out.
+    static std::vector<std::pair<std::string, double>> metrics(const Sample& sample,
+                                                               double flop) {
+        std::vector<std::pair<std::string, double>> result;
+        if (sample.has(CYCLES)) {
+            result.emplace_back("cycles", sample.value[CYCLES]);
+        }
+        if (sample.has(CYCLES) && sample.has(INSTRUCTIONS)) {
+            result.emplace_back("ipc", sample.value[INSTRUCTIONS] / sample.value[CYCLES]);
+        }
+        if (sample.has(L1D_MISSES)) {
+            result.emplace_back("l1d_miss_per_flop", sample.value[L1D_MISSES] / flop);
+        }
+        if (sample.has(LLC_MISSES)) {
+            result.emplace_back("llc_miss_per_flop", sample.value[LLC_MISSES] / flop);
+        }
+        if (sample.has(DTLB_MISSES)) {
+            result.emplace_back("dtlb_miss_per_flop", sample.value[DTLB_MISSES] / flop);
+        }
+        if (sample.has_flops()) {
+            result.emplace_back("retired_flop_ratio", sample.flops() / flop);
+        }
+        return result;
+    }
+
+private:
+    static std::string cpuVendor() {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 9, "vendor_id") == 0) {
+                size_t colon = line.find(':');
+                return colon == std::string::npos ? "" : line.substr(line.find_first_not_of(" \t", colon + 1));
+            }
+        }
+        return "";
+    }
+
+    static uint64_t cacheConfig(uint64_t cache, uint64_t op, uint64_t result) {
+        return cache | (op << 8) | (result << 16);
+    }
+
+    // attr.size is left 0 for events this CPU has no encoding for
+    static perf_event_attr attrFor(Event event, bool intel) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+
+        switch (event) {
+        case CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_MISS);
+            break;
+        case LLC_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheConfig(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                                      PERF_COUNT_HW_CACHE_RESULT_MISS);
+            break;
+        case FP_SCALAR_SINGLE:
+        case FP_128_SINGLE:
+        case FP_256_SINGLE:
+        case FP_512_SINGLE: {
+            if (!intel) {
+                return attr;
+            }
+            // FP_ARITH_INST_RETIRED is event 0xc7, the umask selects the width
+            static const uint64_t umask[] = {0x02, 0x08, 0x20, 0x80};
+            attr.type = PERF_TYPE_RAW;
+            attr.config = 0xc7 | (umask[event - FP_SCALAR_SINGLE] << 8);
+            break;
+        }
+        default:
+            return attr;
+        }
+
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return attr;
+    }
+
+    static int open(perf_event_attr& attr) {
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    int _fds[NUM_EVENTS];
+};
+
+} // namespace support
+
+#endif
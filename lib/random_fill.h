@@ -0,0 +1,209 @@
+#include "cpu_features.h"
+#include "matrix.h"
+#include "thread_pool.h"
+#include <stdint.h>
+#include <algorithm>
+#include <immintrin.h>
+
+#ifndef __RANDOM_FILL_H__
+#define __RANDOM_FILL_H__
+
+namespace support {
+
+// Philox4x32-10 (Salmon, Moraes, Dror and Shaw, "Parallel random numbers: as
+// easy as 1, 2, 3", SC 2011): ten rounds of 32x32 -> 64 bit multiplies and
+// xors that scramble a 128-bit counter under a 64-bit key. The output for a
+// counter does not depend on any other, so matrix elements can be generated
+// in any order, on any number of threads and at any SIMD width with the same
+// result.
+static const uint32_t PHILOX_M0 = 0xD2511F53, PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9, PHILOX_W1 = 0xBB67AE85;
+
+// Replaces ctr with its Philox4x32-10 output under key (k0, k1)
+inline void philox4x32(uint32_t ctr[4], uint32_t k0, uint32_t k1) {
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = uint64_t(PHILOX_M0) * ctr[0];
+        uint64_t p1 = uint64_t(PHILOX_M1) * ctr[2];
+        uint32_t c0 = uint32_t(p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = uint32_t(p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[1] = uint32_t(p1);
+        ctr[3] = uint32_t(p0);
+        ctr[0] = c0;
+        ctr[2] = c2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+namespace random_detail {
+
+// Row r of a filled matrix is cut into blocks of 64 columns. Lane l of block
+// b is the counter (16 b + l, r, 0, 0), and output word w of it is column
+// 64 b + 16 w + l. A 16-lane vector of counters thus yields four runs of 16
+// adjacent columns with no transpose, and the layout is the same at every
+// width.
+static const uint32_t BLOCK = 64;
+static const uint32_t LANES = 16;
+
+// Top 24 bits to [0, 1), then an affine map with a separate multiply and add
+// so that no variant contracts it into an FMA and rounds differently
+inline float to_float(uint32_t bits, float lo, float scale) {
+    float u = float(bits >> 8) * (1.0f / 16777216);
+    return lo + scale * u;
+}
+
+// Blocks [b0, b0 + count) of row r into out
+inline void blocksScalar(float* out, uint32_t r, uint32_t b0, uint32_t count, uint32_t k0,
+                         uint32_t k1, float lo, float scale) {
+    for (uint32_t b = 0; b < count; b++) {
+        for (uint32_t l = 0; l < LANES; l++) {
+            uint32_t ctr[4] = {(b0 + b) * LANES + l, r, 0, 0};
+            philox4x32(ctr, k0, k1);
+            for (uint32_t w = 0; w < 4; w++) {
+                out[b * BLOCK + w * LANES + l] = to_float(ctr[w], lo, scale);
+            }
+        }
+    }
+}
+
+// High and low halves of the 32x32 bit products of every lane with m
+TARGET_AVX2 inline void mulhilo256(__m256i a, __m256i m, __m256i& hi, __m256i& lo) {
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+    lo = _mm256_mullo_epi32(a, m);
+}
+
+TARGET_AVX2 inline void blocks256(float* out, uint32_t r, uint32_t b0, uint32_t count,
+                                  uint32_t k0, uint32_t k1, float lo, float scale) {
+    const __m256i m0 = _mm256_set1_epi32(PHILOX_M0), m1 = _mm256_set1_epi32(PHILOX_M1);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 vlo = _mm256_set1_ps(lo), vscale = _mm256_set1_ps(scale);
+    const __m256 unit = _mm256_set1_ps(1.0f / 16777216);
+    for (uint32_t b = 0; b < count; b++) {
+        for (uint32_t half = 0; half < 2; half++) {
+            __m256i c[4] = {
+                _mm256_add_epi32(_mm256_set1_epi32((b0 + b) * LANES + half * 8), lane),
+                _mm256_set1_epi32(r), _mm256_setzero_si256(), _mm256_setzero_si256()};
+            uint32_t key0 = k0, key1 = k1;
+            for (int round = 0; round < 10; round++) {
+                __m256i hi0, lo0, hi1, lo1;
+                mulhilo256(c[0], m0, hi0, lo0);
+                mulhilo256(c[2], m1, hi1, lo1);
+                c[0] = _mm256_xor_si256(_mm256_xor_si256(hi1, c[1]), _mm256_set1_epi32(key0));
+                c[2] = _mm256_xor_si256(_mm256_xor_si256(hi0, c[3]), _mm256_set1_epi32(key1));
+                c[1] = lo1;
+                c[3] = lo0;
+                key0 += PHILOX_W0;
+                key1 += PHILOX_W1;
+            }
+            for (uint32_t w = 0; w < 4; w++) {
+                __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(c[w], 8)), unit);
+                _mm256_storeu_ps(out + b * BLOCK + w * LANES + half * 8,
+                                 _mm256_add_ps(vlo, _mm256_mul_ps(vscale, u)));
+            }
+        }
+    }
+}
+
+TARGET_AVX512 inline void mulhilo512(__m512i a, __m512i m, __m512i& hi, __m512i& lo) {
+    __m512i even = _mm512_mul_epu32(a, m);
+    __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(a, 32), m);
+    hi = _mm512_mask_blend_epi32(0xaaaa, _mm512_srli_epi64(even, 32), odd);
+    lo = _mm512_mullo_epi32(a, m);
+}
+
+TARGET_AVX512 inline void blocks512(float* out, uint32_t r, uint32_t b0, uint32_t count,
+                                    uint32_t k0, uint32_t k1, float lo, float scale) {
+    const __m512i m0 = _mm512_set1_epi32(PHILOX_M0), m1 = _mm512_set1_epi32(PHILOX_M1);
+    const __m512i lane =
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512 vlo = _mm512_set1_ps(lo), vscale = _mm512_set1_ps(scale);
+    const __m512 unit = _mm512_set1_ps(1.0f / 16777216);
+    for (uint32_t b = 0; b < count; b++) {
+        __m512i c[4] = {_mm512_add_epi32(_mm512_set1_epi32((b0 + b) * LANES), lane),
+                        _mm512_set1_epi32(r), _mm512_setzero_si512(), _mm512_setzero_si512()};
+        uint32_t key0 = k0, key1 = k1;
+        for (int round = 0; round < 10; round++) {
+            __m512i hi0, lo0, hi1, lo1;
+            mulhilo512(c[0], m0, hi0, lo0);
+            mulhilo512(c[2], m1, hi1, lo1);
+            c[0] = _mm512_xor_si512(_mm512_xor_si512(hi1, c[1]), _mm512_set1_epi32(key0));
+            c[2] = _mm512_xor_si512(_mm512_xor_si512(hi0, c[3]), _mm512_set1_epi32(key1));
+            c[1] = lo1;
+            c[3] = lo0;
+            key0 += PHILOX_W0;
+            key1 += PHILOX_W1;
+        }
+        for (uint32_t w = 0; w < 4; w++) {
+            __m512 u = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(c[w], 8)), unit);
+            _mm512_storeu_ps(out + b * BLOCK + w * LANES,
+                             _mm512_add_ps(vlo, _mm512_mul_ps(vscale, u)));
+        }
+    }
+}
+
+inline void blocks(Isa isa, float* out, uint32_t r, uint32_t b0, uint32_t count, uint32_t k0,
+                   uint32_t k1, float lo, float scale) {
+    if (isa == Isa::AVX512) {
+        blocks512(out, r, b0, count, k0, k1, lo, scale);
+    } else if (isa == Isa::AVX2) {
+        blocks256(out, r, b0, count, k0, k1, lo, scale);
+    } else {
+        blocksScalar(out, r, b0, count, k0, k1, lo, scale);
+    }
+}
+
+} // namespace random_detail
+
+// Fills m with floats uniform in [lo, hi) drawn from Philox4x32-10 keyed by
+// seed. Element (r, c) of m depends only on seed, r and c, so the result is
+// the same for any thread count, kernel variant or row stride; use another
+// seed for each matrix that should differ. Rows are split across `threads`
+// workers of the global pool, 0 meaning all of them.
+inline void random_fill(MatrixView<float> m, uint64_t seed, float lo = 0, float hi = 1,
+                        uint32_t threads = 0) {
+    using namespace random_detail;
+    uint32_t width = m.get_width(), height = m.get_height();
+    uint32_t k0 = uint32_t(seed), k1 = uint32_t(seed >> 32);
+    float scale = hi - lo;
+    Isa isa = active_isa();
+    bool contiguous = m.get_col_stride() == 1;
+    uint32_t full = contiguous ? width / BLOCK : 0;
+
+    auto fillRows = [&](uint32_t r0, uint32_t r1) {
+        alignas(64) float tail[BLOCK];
+        for (uint32_t r = r0; r < r1; r++) {
+            if (full > 0) {
+                blocks(isa, &m.a(r, 0), r, 0, full, k0, k1, lo, scale);
+            }
+            // Partial last block, or every block of a strided view
+            for (uint32_t c0 = full * BLOCK; c0 < width; c0 += BLOCK) {
+                blocks(isa, tail, r, c0 / BLOCK, 1, k0, k1, lo, scale);
+                for (uint32_t c = c0; c < std::min(c0 + BLOCK, width); c++) {
+                    m.a(r, c) = tail[c - c0];
+                }
+            }
+        }
+    };
+
+    ThreadPool& pool = ThreadPool::global();
+    uint32_t workers = threads == 0 ? pool.size() : std::min(threads, pool.size());
+    // About 64K elements per task, a few tasks per worker
+    uint32_t tasks = uint32_t(std::min<uint64_t>(
+        {uint64_t(height), uint64_t(width) * height / 65536 + 1, uint64_t(workers) * 4}));
+    if (workers <= 1 || tasks <= 1) {
+        fillRows(0, height);
+        return;
+    }
+    pool.parallel_for(
+        tasks,
+        [&](uint32_t task, uint32_t) {
+            fillRows(uint64_t(height) * task / tasks, uint64_t(height) * (task + 1) / tasks);
+        },
+        workers);
+}
+
+} // namespace support
+
+#endif
@@ -0,0 +1,434 @@
+#include "cpu_features.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <immintrin.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef __ROOFLINE_H__
+#define __ROOFLINE_H__
+
+namespace support {
+
+// Measured limits of the machine, the ceilings of the roofline model
+struct MachinePeak {
+    std::string cpu;
+    // Kernel variant the FMA peak was measured with, see active_isa()
+    std::string isa;
+    uint32_t threads = 0;
+    // Single precision FMA throughput
+    double gflops_1core = 0, gflops_all = 0;
+    // Sustained read bandwidth out of each cache level, one core
+    double l1_gbs = 0, l2_gbs = 0, l3_gbs = 0;
+    // STREAM triad bandwidth from DRAM, all cores
+    double dram_gbs = 0;
+};
+
+namespace calibration {
+
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline std::string cpu_model() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            size_t colon = line.find(':');
+            return colon == std::string::npos ? "" : line.substr(line.find_first_not_of(" \t", colon + 1));
+        }
+    }
+    return "unknown";
+}
+
+// Size in bytes of the data/unified cache at level, 0 if sysfs does not say
+inline size_t cache_size(uint32_t level) {
+    for (uint32_t index = 0; index < 8; index++) {
+        std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        std::ifstream level_file(dir + "level"), type_file(dir + "type"), size_file(dir + "size");
+        uint32_t cache_level;
+        std::string type, size;
+        if (!(level_file >> cache_level) || !(type_file >> type) || !(size_file >> size)) {
+            continue;
+        }
+        if (cache_level != level || type == "Instruction") {
+            continue;
+        }
+        size_t value = std::stoul(size);
+        char unit = size.back();
+        return unit == 'K' ? value << 10 : unit == 'M' ? value << 20 : value;
+    }
+    return 0;
+}
+
+// Independent FMA chains of the peak loops, enough to cover latency on both
+// ports like peak_flops in old_archive/matvec.cc
+static const int FMA_CHAINS = 12;
+
+// Seconds for `iterations` steps of FMA_CHAINS chains, one variant per Isa.
+// SSE has no FMA and runs a multiply and an add per step.
+inline double fma_seconds_sse(uint64_t iterations) {
+    __m128 acc[FMA_CHAINS];
+    for (int r = 0; r < FMA_CHAINS; r++) {
+        acc[r] = _mm_set1_ps(r);
+    }
+    __m128 a = _mm_set1_ps(0.999f), b = _mm_set1_ps(0.001f);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int r = 0; r < FMA_CHAINS; r++) {
+            acc[r] = _mm_add_ps(_mm_mul_ps(acc[r], a), b);
+        }
+    }
+    double seconds = seconds_since(start);
+
+    // Keep the chains alive
+    __m128 sum = acc[0];
+    for (int r = 1; r < FMA_CHAINS; r++) {
+        sum = _mm_add_ps(sum, acc[r]);
+    }
+    volatile float sink = _mm_cvtss_f32(sum);
+    (void)sink;
+    return seconds;
+}
+
+TARGET_AVX2 inline double fma_seconds_avx2(uint64_t iterations) {
+    __m256 acc[FMA_CHAINS];
+    for (int r = 0; r < FMA_CHAINS; r++) {
+        acc[r] = _mm256_set1_ps(r);
+    }
+    __m256 a = _mm256_set1_ps(0.999f), b = _mm256_set1_ps(0.001f);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int r = 0; r < FMA_CHAINS; r++) {
+            acc[r] = _mm256_fmadd_ps(acc[r], a, b);
+        }
+    }
+    double seconds = seconds_since(start);
+
+    __m256 sum = acc[0];
+    for (int r = 1; r < FMA_CHAINS; r++) {
+        sum = _mm256_add_ps(sum, acc[r]);
+    }
+    volatile float sink = _mm256_cvtss_f32(sum);
+    (void)sink;
+    return seconds;
+}
+
+TARGET_AVX512 inline double fma_seconds_avx512(uint64_t iterations) {
+    __m512 acc[FMA_CHAINS];
+    for (int r = 0; r < FMA_CHAINS; r++) {
+        acc[r] = _mm512_set1_ps(r);
+    }
+    __m512 a = _mm512_set1_ps(0.999f), b = _mm512_set1_ps(0.001f);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int r = 0; r < FMA_CHAINS; r++) {
+            acc[r] = _mm512_fmadd_ps(acc[r], a, b);
+        }
+    }
+    double seconds = seconds_since(start);
+
+    __m512 sum = acc[0];
+    for (int r = 1; r < FMA_CHAINS; r++) {
+        sum = _mm512_add_ps(sum, acc[r]);
+    }
+    volatile float sink = _mm512_reduce_add_ps(sum);
+    (void)sink;
+    return seconds;
+}
+
+// Floating point operations in `iterations` steps of the active_isa() loop
+inline double fma_flop(uint64_t iterations) {
+    Isa isa = active_isa();
+    double lanes = isa == Isa::AVX512 ? 16 : isa == Isa::AVX2 ? 8 : 4;
+    return double(iterations) * FMA_CHAINS * 2 * lanes;
+}
+
+// Single core GFLOPS of the FMA chains at the vector width of active_isa(),
+// the width the GEMM kernels run at
+inline double fma_gflops(uint64_t iterations) {
+    double seconds;
+    switch (active_isa()) {
+    case Isa::AVX512:
+        seconds = fma_seconds_avx512(iterations);
+        break;
+    case Isa::AVX2:
+        seconds = fma_seconds_avx2(iterations);
+        break;
+    default:
+        seconds = fma_seconds_sse(iterations);
+        break;
+    }
+    return fma_flop(iterations) / seconds / 1e9;
+}
+
+// Seconds reading count floats (a multiple of 64) `passes` times with 8
+// independent loads, in 16 or 32 byte vectors
+inline double read_seconds_sse(const float* data, size_t count, uint32_t passes) {
+    __m128 acc[8];
+    for (int r = 0; r < 8; r++) {
+        acc[r] = _mm_setzero_ps();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < count; i += 32) {
+            for (int r = 0; r < 8; r++) {
+                acc[r] = _mm_add_ps(acc[r], _mm_load_ps(data + i + 4 * r));
+            }
+        }
+    }
+    double seconds = seconds_since(start);
+
+    __m128 sum = acc[0];
+    for (int r = 1; r < 8; r++) {
+        sum = _mm_add_ps(sum, acc[r]);
+    }
+    volatile float sink = _mm_cvtss_f32(sum);
+    (void)sink;
+    return seconds;
+}
+
+TARGET_AVX2 inline double read_seconds_avx2(const float* data, size_t count,
+                                            uint32_t passes) {
+    __m256 acc[8];
+    for (int r = 0; r < 8; r++) {
+        acc[r] = _mm256_setzero_ps();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < count; i += 64) {
+            for (int r = 0; r < 8; r++) {
+                acc[r] = _mm256_add_ps(acc[r], _mm256_load_ps(data + i + 8 * r));
+            }
+        }
+    }
+    double seconds = seconds_since(start);
+
+    __m256 sum = acc[0];
+    for (int r = 1; r < 8; r++) {
+        sum = _mm256_add_ps(sum, acc[r]);
+    }
+    volatile float sink = _mm256_cvtss_f32(sum);
+    (void)sink;
+    return seconds;
+}
+
+// GB/s reading `bytes` of data `passes` times
+inline double read_gbs(const float* data, size_t bytes, uint32_t passes) {
+    size_t count = bytes / sizeof(float) / 64 * 64;
+    double seconds = active_isa() >= Isa::AVX2 ? read_seconds_avx2(data, count, passes)
+                                               : read_seconds_sse(data, count, passes);
+    return double(count) * sizeof(float) * passes / seconds / 1e9;
+}
+
+// Best of `trials` STREAM triads a = b + s * c over n floats, split across the pool
+inline double triad_gbs(size_t n, uint32_t trials) {
+    Workspace workspace;
+    Workspace::Scope scope(workspace);
+    float* a = workspace.alloc<float>(n);
+    float* b = workspace.alloc<float>(n);
+    float* c = workspace.alloc<float>(n);
+
+    ThreadPool& pool = ThreadPool::global();
+    uint32_t chunks = pool.size() * 4;
+    auto for_chunks = [&](auto&& body) {
+        pool.parallel_for(chunks, [&](uint32_t chunk, uint32_t) {
+            body(n * chunk / chunks, n * (chunk + 1) / chunks);
+        });
+    };
+
+    // First touch from the workers that will stream the data
+    for_chunks([&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            a[i] = 0;
+            b[i] = 1;
+            c[i] = 2;
+        }
+    });
+
+    double best = 0;
+    for (uint32_t trial = 0; trial < trials; trial++) {
+        auto start = std::chrono::steady_clock::now();
+        for_chunks([&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                a[i] = b[i] + 3.0f * c[i];
+            }
+        });
+        best = std::max(best, 3.0 * n * sizeof(float) / seconds_since(start) / 1e9);
+    }
+    return best;
+}
+
+} // namespace calibration
+
+// Measures every MachinePeak ceiling. Takes about a second.
+inline MachinePeak calibrate_machine() {
+    using namespace calibration;
+    MachinePeak peak;
+    peak.cpu = cpu_model();
+    peak.isa = isa_name(active_isa());
+
+    ThreadPool& pool = ThreadPool::global();
+    peak.threads = pool.size();
+
+    const uint64_t FMA_ITERATIONS = 20000000;
+    for (int trial = 0; trial < 3; trial++) {
+        peak.gflops_1core = std::max(peak.gflops_1core, fma_gflops(FMA_ITERATIONS));
+    }
+
+    // Every worker runs the FMA loop at the same time
+    auto start = std::chrono::steady_clock::now();
+    pool.parallel_for(pool.size(), [&](uint32_t, uint32_t) { fma_gflops(FMA_ITERATIONS); });
+    double seconds = seconds_since(start);
+    peak.gflops_all =
+        std::max(pool.size() * fma_flop(FMA_ITERATIONS) / seconds / 1e9, peak.gflops_1core);
+
+    size_t l1 = cache_size(1), l2 = cache_size(2), l3 = cache_size(3);
+    l1 = l1 ? l1 : 32 << 10;
+    l2 = l2 ? l2 : 1 << 20;
+    l3 = l3 ? l3 : 16 << 20;
+
+    // Half of each level so the buffer stays resident, and L3 small enough
+    // that a single core's slice of a shared L3 can hold it
+    size_t l1_bytes = l1 / 2, l2_bytes = l2 / 2;
+    size_t l3_bytes = std::max(2 * l2, std::min<size_t>(l3 / 4, 32 << 20));
+    const size_t TOTAL_READ = size_t(1) << 30;
+
+    Workspace workspace;
+    {
+        Workspace::Scope scope(workspace);
+        float* buffer = workspace.alloc<float>(l3_bytes / sizeof(float));
+        std::fill(buffer, buffer + l3_bytes / sizeof(float), 1.0f);
+        peak.l1_gbs = read_gbs(buffer, l1_bytes, TOTAL_READ / l1_bytes);
+        peak.l2_gbs = read_gbs(buffer, l2_bytes, TOTAL_READ / l2_bytes);
+        peak.l3_gbs = read_gbs(buffer, l3_bytes, std::max<size_t>(TOTAL_READ / l3_bytes, 2));
+    }
+
+    // Arrays well past L3, but no more than 1/16 of RAM each
+    size_t ram = size_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    size_t triad_bytes = std::min(std::max<size_t>(2 * l3, 64 << 20), ram / 16);
+    peak.dram_gbs = triad_gbs(triad_bytes / sizeof(float), 5);
+
+    return peak;
+}
+
+inline void save_calibration(const std::string& path, const MachinePeak& peak) {
+    std::ofstream file(path);
+    file << "cpu=" << peak.cpu << "\n"
+         << "isa=" << peak.isa << "\n"
+         << "threads=" << peak.threads << "\n"
+         << "gflops_1core=" << peak.gflops_1core << "\n"
+         << "gflops_all=" << peak.gflops_all << "\n"
+         << "l1_gbs=" << peak.l1_gbs << "\n"
+         << "l2_gbs=" << peak.l2_gbs << "\n"
+         << "l3_gbs=" << peak.l3_gbs << "\n"
+         << "dram_gbs=" << peak.dram_gbs << "\n";
+}
+
+// Loads a calibration file, rejecting one made on another CPU model, with
+// another kernel variant or with another thread count
+inline bool load_calibration(const std::string& path, MachinePeak& peak) {
+    std::ifstream file(path);
+    std::string line;
+    MachinePeak loaded;
+    while (std::getline(file, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        if (key == "cpu") {
+            loaded.cpu = value;
+            continue;
+        }
+        if (key == "isa") {
+            loaded.isa = value;
+            continue;
+        }
+
+        double number = std::atof(value.c_str());
+        if (key == "threads") {
+            loaded.threads = number;
+        } else if (key == "gflops_1core") {
+            loaded.gflops_1core = number;
+        } else if (key == "gflops_all") {
+            loaded.gflops_all = number;
+        } else if (key == "l1_gbs") {
+            loaded.l1_gbs = number;
+        } else if (key == "l2_gbs") {
+            loaded.l2_gbs = number;
+        } else if (key == "l3_gbs") {
+            loaded.l3_gbs = number;
+        } else if (key == "dram_gbs") {
+            loaded.dram_gbs = number;
+        }
+    }
+
+    if (loaded.cpu != calibration::cpu_model() || loaded.isa != isa_name(active_isa()) ||
+        loaded.threads != ThreadPool::global().size() ||
+        loaded.gflops_1core <= 0 || loaded.dram_gbs <= 0) {
+        return false;
+    }
+    peak = loaded;
+    return true;
+}
+
+// Cached calibration at path if it matches this machine, otherwise measures
+// and rewrites the cache
+inline MachinePeak load_or_calibrate(const std::string& path, bool force = false) {
+    MachinePeak peak;
+    if (!force && load_calibration(path, peak)) {
+        return peak;
+    }
+    peak = calibrate_machine();
+    save_calibration(path, peak);
+    return peak;
+}
+
+// Roofline placement of an [M, K] @ [K, N] GEMM that ran at `gflops`.
+// Arithmetic intensity counts the compulsory DRAM traffic (read A and B, read
+// and write C); the attainable rate is min(peak, intensity * bandwidth).
+inline std::vector<std::pair<std::string, double>> roofline_metrics(
+    const MachinePeak& peak, uint32_t M, uint32_t N, uint32_t K, double gflops, bool parallel) {
+    double flop = 2.0 * M * N * K;
+    double bytes = 4.0 * (double(M) * K + double(K) * N + 2.0 * M * N);
+    double intensity = flop / bytes;
+    double peak_gflops = parallel ? peak.gflops_all : peak.gflops_1core;
+    double attainable = std::min(peak_gflops, intensity * peak.dram_gbs);
+
+    return {
+        {"pct_peak", 100.0 * gflops / peak_gflops},
+        {"intensity_flop_per_byte", intensity},
+        {"roofline_gflops", attainable},
+        {"pct_roofline", 100.0 * gflops / attainable},
+        {"memory_bound", intensity * peak.dram_gbs < peak_gflops ? 1.0 : 0.0},
+    };
+}
+
+inline std::ostream& operator<<(std::ostream& os, const MachinePeak& peak) {
+    os << peak.cpu << " (" << peak.isa << "), " << peak.threads << " threads: FMA peak " << peak.gflops_1core
+       << " GFLOPS/core, " << peak.gflops_all << " GFLOPS all cores; L1 " << peak.l1_gbs
+       << " GB/s, L2 " << peak.l2_gbs << " GB/s, L3 " << peak.l3_gbs << " GB/s, DRAM "
+       << peak.dram_gbs << " GB/s; ridge point " << peak.gflops_all / peak.dram_gbs
+       << " flop/byte";
+    return os;
+}
+
+} // namespace support
+
+#endif
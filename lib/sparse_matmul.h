@@ -0,0 +1,430 @@
+#include "cpu_features.h"
+#include "gemv.h"
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "sparse_matrix.h"
+#include "thread_pool.h"
+#include "workspace.h"
+#include <algorithm>
+#include <cstring>
+#include <immintrin.h>
+
+#ifndef __SPARSE_MATMUL_H__
+#define __SPARSE_MATMUL_H__
+
+using support::BsrMatrix;
+using support::CsrMatrix;
+using support::MatrixView;
+using support::ThreadPool;
+using support::Workspace;
+
+namespace algo {
+namespace sparse {
+
+// Sparse A times dense B. Each nonzero a[i, k] of a CSR row scales row k of B
+// into row i of C, so the SIMD lanes run along the rows of B and C, which are
+// contiguous, and a strip of C stays in registers while the whole sparse row
+// streams past it. Only the index loads are irregular. SpMV has no dense
+// dimension to vectorize along and gathers x instead.
+//
+// Work is split across the global pool by nonzeros rather than rows, so a few
+// dense rows do not leave one worker with most of the work.
+
+// Columns of C held in registers per pass over a sparse row
+constexpr uint32_t STRIP_AVX512 = 64;
+constexpr uint32_t STRIP_AVX2 = 32;
+
+// Splits rows [0, rows) into `tasks` runs of about equal nonzeros, given
+// row_ptr with rows + 1 entries. Runs are [bounds[t], bounds[t + 1]).
+inline void balanceRows(const uint64_t *row_ptr, uint32_t rows, uint32_t tasks,
+                        uint32_t *bounds) {
+  uint64_t nnz = row_ptr[rows];
+  bounds[0] = 0;
+  for (uint32_t t = 1; t < tasks; t++) {
+    uint64_t target = nnz * t / tasks;
+    uint32_t row =
+        std::lower_bound(row_ptr, row_ptr + rows + 1, target) - row_ptr;
+    bounds[t] = std::max(bounds[t - 1], std::min(row, rows));
+  }
+  bounds[tasks] = rows;
+}
+
+// Runs fn(r0, r1) over runs of rows balanced by row_ptr on `threads` workers
+// (0 means all), inline for a single worker
+template <typename F>
+void forRowRuns(const uint64_t *row_ptr, uint32_t rows, uint32_t threads,
+                Workspace &workspace, F &&fn) {
+  ThreadPool &pool = ThreadPool::global();
+  uint32_t workers =
+      threads == 0 ? pool.size() : std::min(threads, pool.size());
+  if (workers <= 1 || rows <= 1) {
+    fn(0u, rows);
+    return;
+  }
+
+  // A few runs per worker to even out the tail
+  uint32_t tasks = std::min(rows, workers * 4);
+  Workspace::Scope scope(workspace);
+  uint32_t *bounds = workspace.alloc<uint32_t>(tasks + 1);
+  balanceRows(row_ptr, rows, tasks, bounds);
+  pool.parallel_for(
+      tasks,
+      [&](uint32_t task, uint32_t) { fn(bounds[task], bounds[task + 1]); },
+      workers);
+}
+
+// C[i, :] = A[i, :] @ B for rows [r0, r1), 64 columns of C in 4 zmm per pass
+TARGET_AVX512 inline void csrRows512(const CsrMatrix<float> &A, const float *B,
+                                     int64_t ldb, float *C, int64_t ldc,
+                                     uint32_t M, uint32_t r0, uint32_t r1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  for (uint32_t j0 = 0; j0 < M; j0 += STRIP_AVX512) {
+    __mmask16 mask[4];
+    for (uint32_t q = 0; q < 4; q++) {
+      int64_t n = std::clamp<int64_t>(int64_t(M) - j0 - 16 * q, 0, 16);
+      mask[q] = n == 16 ? 0xffff : (1u << n) - 1;
+    }
+    for (uint32_t i = r0; i < r1; i++) {
+      __m512 acc[4];
+      for (uint32_t q = 0; q < 4; q++) {
+        acc[q] = _mm512_setzero_ps();
+      }
+      for (uint64_t p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+        __m512 a = _mm512_set1_ps(val[p]);
+        const float *b = B + col[p] * ldb + j0;
+        for (uint32_t q = 0; q < 4; q++) {
+          acc[q] = _mm512_fmadd_ps(
+              a, _mm512_maskz_loadu_ps(mask[q], b + 16 * q), acc[q]);
+        }
+      }
+      for (uint32_t q = 0; q < 4; q++) {
+        _mm512_mask_storeu_ps(C + i * ldc + j0 + 16 * q, mask[q], acc[q]);
+      }
+    }
+  }
+}
+
+// As csrRows512 with 32 columns of C in 4 ymm
+TARGET_AVX2 inline void csrRows256(const CsrMatrix<float> &A, const float *B,
+                                   int64_t ldb, float *C, int64_t ldc,
+                                   uint32_t M, uint32_t r0, uint32_t r1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  for (uint32_t j0 = 0; j0 < M; j0 += STRIP_AVX2) {
+    __m256i mask[4];
+    for (uint32_t q = 0; q < 4; q++) {
+      int64_t n = std::clamp<int64_t>(int64_t(M) - j0 - 8 * q, 0, 8);
+      mask[q] = packed::laneMask(n);
+    }
+    for (uint32_t i = r0; i < r1; i++) {
+      __m256 acc[4];
+      for (uint32_t q = 0; q < 4; q++) {
+        acc[q] = _mm256_setzero_ps();
+      }
+      for (uint64_t p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+        __m256 a = _mm256_set1_ps(val[p]);
+        const float *b = B + col[p] * ldb + j0;
+        for (uint32_t q = 0; q < 4; q++) {
+          acc[q] = _mm256_fmadd_ps(a, _mm256_maskload_ps(b + 8 * q, mask[q]),
+                                   acc[q]);
+        }
+      }
+      for (uint32_t q = 0; q < 4; q++) {
+        _mm256_maskstore_ps(C + i * ldc + j0 + 8 * q, mask[q], acc[q]);
+      }
+    }
+  }
+}
+
+// Any layout and any ISA, one row of C at a time
+inline void csrRowsScalar(const CsrMatrix<float> &A, MatrixView<const float> B,
+                          MatrixView<float> C, uint32_t r0, uint32_t r1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  uint32_t M = C.get_width();
+  for (uint32_t i = r0; i < r1; i++) {
+    for (uint32_t j = 0; j < M; j++) {
+      C.a(i, j) = 0;
+    }
+    for (uint64_t p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+      float a = val[p];
+      for (uint32_t j = 0; j < M; j++) {
+        C.a(i, j) += a * B.r(col[p], j);
+      }
+    }
+  }
+}
+
+// C = A @ B for CSR A [N, K] and dense B [K, M], on `threads` workers of the
+// global pool (0 means all). B and C need contiguous rows for the SIMD
+// kernels, other layouts take a scalar loop.
+inline void spmm(const CsrMatrix<float> &A, MatrixView<const float> B,
+                 MatrixView<float> C, uint32_t threads = 0,
+                 Workspace &workspace = Workspace::local()) {
+  uint32_t N = A.get_height(), M = C.get_width();
+  support::Isa isa = support::active_isa();
+  bool rows = B.get_col_stride() == 1 && C.get_col_stride() == 1;
+
+  forRowRuns(A.row_ptr(), N, threads, workspace,
+             [&](uint32_t r0, uint32_t r1) {
+               if (rows && isa == support::Isa::AVX512) {
+                 csrRows512(A, B.data(), B.get_row_stride(), C.data(),
+                            C.get_row_stride(), M, r0, r1);
+               } else if (rows && isa == support::Isa::AVX2) {
+                 csrRows256(A, B.data(), B.get_row_stride(), C.data(),
+                            C.get_row_stride(), M, r0, r1);
+               } else {
+                 csrRowsScalar(A, B, C, r0, r1);
+               }
+             });
+}
+
+// y[i] = A[i, :] . x for rows [r0, r1), gathering 16 elements of x at a time
+TARGET_AVX512 inline void csrDot512(const CsrMatrix<float> &A, const float *x,
+                                    float *y, uint32_t r0, uint32_t r1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  for (uint32_t i = r0; i < r1; i++) {
+    uint64_t p = row_ptr[i], end = row_ptr[i + 1];
+    __m512 acc = _mm512_setzero_ps();
+    for (; p + 16 <= end; p += 16) {
+      __m512i idx = _mm512_loadu_si512(col + p);
+      acc = _mm512_fmadd_ps(_mm512_loadu_ps(val + p),
+                            _mm512_i32gather_ps(idx, x, 4), acc);
+    }
+    if (p < end) {
+      __mmask16 mask = (1u << (end - p)) - 1;
+      __m512i idx = _mm512_maskz_loadu_epi32(mask, col + p);
+      acc = _mm512_fmadd_ps(
+          _mm512_maskz_loadu_ps(mask, val + p),
+          _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx, x, 4), acc);
+    }
+    y[i] = _mm512_reduce_add_ps(acc);
+  }
+}
+
+// As csrDot512, 8 elements at a time
+TARGET_AVX2 inline void csrDot256(const CsrMatrix<float> &A, const float *x,
+                                  float *y, uint32_t r0, uint32_t r1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  for (uint32_t i = r0; i < r1; i++) {
+    uint64_t p = row_ptr[i], end = row_ptr[i + 1];
+    __m256 acc = _mm256_setzero_ps();
+    for (; p + 8 <= end; p += 8) {
+      __m256i idx =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(col + p));
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(val + p),
+                            _mm256_i32gather_ps(x, idx, 4), acc);
+    }
+    float sum = gemv::hsum(acc);
+    for (; p < end; p++) {
+      sum += val[p] * x[col[p]];
+    }
+    y[i] = sum;
+  }
+}
+
+inline void csrDotScalar(const CsrMatrix<float> &A, const float *x, float *y,
+                         uint32_t r0, uint32_t r1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  for (uint32_t i = r0; i < r1; i++) {
+    float sum = 0;
+    for (uint64_t p = row_ptr[i]; p < row_ptr[i + 1]; p++) {
+      sum += val[p] * x[col[p]];
+    }
+    y[i] = sum;
+  }
+}
+
+// y = A @ x for CSR A [N, K], x a row or column vector of K elements and y
+// one of N elements. Strided x and y are staged through workspace.
+inline void spmv(const CsrMatrix<float> &A, MatrixView<const float> x,
+                 MatrixView<float> y, uint32_t threads = 0,
+                 Workspace &workspace = Workspace::local()) {
+  uint32_t N = A.get_height(), K = A.get_width();
+  int64_t strideX = gemv::vectorStride(x), strideY = gemv::vectorStride(y);
+
+  Workspace::Scope scope(workspace);
+  const float *xs = x.data();
+  if (strideX != 1 && K > 1) {
+    float *staged = workspace.alloc<float>(K);
+    for (uint32_t k = 0; k < K; k++) {
+      staged[k] = x.data()[k * strideX];
+    }
+    xs = staged;
+  }
+  float *ys = strideY == 1 || N <= 1 ? y.data() : workspace.alloc<float>(N);
+
+  support::Isa isa = support::active_isa();
+  forRowRuns(A.row_ptr(), N, threads, workspace,
+             [&](uint32_t r0, uint32_t r1) {
+               if (isa == support::Isa::AVX512) {
+                 csrDot512(A, xs, ys, r0, r1);
+               } else if (isa == support::Isa::AVX2) {
+                 csrDot256(A, xs, ys, r0, r1);
+               } else {
+                 csrDotScalar(A, xs, ys, r0, r1);
+               }
+             });
+
+  if (ys != y.data()) {
+    for (uint32_t i = 0; i < N; i++) {
+      y.data()[i * strideY] = ys[i];
+    }
+  }
+}
+
+// C[BR rows, :] = A[block row I, :] @ B for block rows [I0, I1), 32 columns of
+// C per pass, 2 zmm for each of the BR rows. Each row of B loaded is used for
+// all BR rows of the block.
+template <uint32_t BR, uint32_t BC>
+TARGET_AVX512 inline void
+bsrRows512(const BsrMatrix<float, BR, BC> &A, const float *B, int64_t ldb,
+           float *C, int64_t ldc, uint32_t M, uint32_t I0, uint32_t I1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  uint32_t N = A.get_height(), K = A.get_width();
+  for (uint32_t j0 = 0; j0 < M; j0 += 32) {
+    int64_t n = std::min<int64_t>(M - j0, 32);
+    __mmask16 mask0 = n >= 16 ? 0xffff : (1u << n) - 1;
+    __mmask16 mask1 = n >= 32 ? 0xffff : n > 16 ? (1u << (n - 16)) - 1 : 0;
+    for (uint32_t I = I0; I < I1; I++) {
+      __m512 acc[BR][2];
+      for (uint32_t r = 0; r < BR; r++) {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+      }
+      for (uint64_t p = row_ptr[I]; p < row_ptr[I + 1]; p++) {
+        uint32_t k0 = col[p] * BC;
+        uint32_t bc = std::min(BC, K - k0);
+        const float *block = val + p * BR * BC;
+        for (uint32_t c = 0; c < bc; c++) {
+          const float *b = B + (k0 + c) * ldb + j0;
+          __m512 b0 = _mm512_maskz_loadu_ps(mask0, b);
+          __m512 b1 = _mm512_maskz_loadu_ps(mask1, b + 16);
+          for (uint32_t r = 0; r < BR; r++) {
+            __m512 a = _mm512_set1_ps(block[r * BC + c]);
+            acc[r][0] = _mm512_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(a, b1, acc[r][1]);
+          }
+        }
+      }
+      for (uint32_t r = 0; r < BR && I * BR + r < N; r++) {
+        float *c = C + (I * BR + r) * ldc + j0;
+        _mm512_mask_storeu_ps(c, mask0, acc[r][0]);
+        _mm512_mask_storeu_ps(c + 16, mask1, acc[r][1]);
+      }
+    }
+  }
+}
+
+// As bsrRows512 with 16 columns of C per pass in 2 ymm per row
+template <uint32_t BR, uint32_t BC>
+TARGET_AVX2 inline void
+bsrRows256(const BsrMatrix<float, BR, BC> &A, const float *B, int64_t ldb,
+           float *C, int64_t ldc, uint32_t M, uint32_t I0, uint32_t I1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  uint32_t N = A.get_height(), K = A.get_width();
+  for (uint32_t j0 = 0; j0 < M; j0 += 16) {
+    uint32_t n = std::min(M - j0, 16u);
+    __m256i mask0 = packed::laneMask(std::min(n, 8u));
+    __m256i mask1 = packed::laneMask(n > 8 ? n - 8 : 0);
+    for (uint32_t I = I0; I < I1; I++) {
+      __m256 acc[BR][2];
+      for (uint32_t r = 0; r < BR; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+      }
+      for (uint64_t p = row_ptr[I]; p < row_ptr[I + 1]; p++) {
+        uint32_t k0 = col[p] * BC;
+        uint32_t bc = std::min(BC, K - k0);
+        const float *block = val + p * BR * BC;
+        for (uint32_t c = 0; c < bc; c++) {
+          const float *b = B + (k0 + c) * ldb + j0;
+          __m256 b0 = _mm256_maskload_ps(b, mask0);
+          __m256 b1 = _mm256_maskload_ps(b + 8, mask1);
+          for (uint32_t r = 0; r < BR; r++) {
+            __m256 a = _mm256_set1_ps(block[r * BC + c]);
+            acc[r][0] = _mm256_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a, b1, acc[r][1]);
+          }
+        }
+      }
+      for (uint32_t r = 0; r < BR && I * BR + r < N; r++) {
+        float *c = C + (I * BR + r) * ldc + j0;
+        _mm256_maskstore_ps(c, mask0, acc[r][0]);
+        _mm256_maskstore_ps(c + 8, mask1, acc[r][1]);
+      }
+    }
+  }
+}
+
+template <uint32_t BR, uint32_t BC>
+void bsrRowsScalar(const BsrMatrix<float, BR, BC> &A,
+                   MatrixView<const float> B, MatrixView<float> C, uint32_t I0,
+                   uint32_t I1) {
+  const uint64_t *row_ptr = A.row_ptr();
+  const uint32_t *col = A.col_idx();
+  const float *val = A.values();
+  uint32_t N = A.get_height(), K = A.get_width(), M = C.get_width();
+  for (uint32_t I = I0; I < I1; I++) {
+    uint32_t br = std::min(BR, N - I * BR);
+    for (uint32_t r = 0; r < br; r++) {
+      for (uint32_t j = 0; j < M; j++) {
+        C.a(I * BR + r, j) = 0;
+      }
+    }
+    for (uint64_t p = row_ptr[I]; p < row_ptr[I + 1]; p++) {
+      uint32_t k0 = col[p] * BC;
+      uint32_t bc = std::min(BC, K - k0);
+      const float *block = val + p * BR * BC;
+      for (uint32_t r = 0; r < br; r++) {
+        for (uint32_t c = 0; c < bc; c++) {
+          float a = block[r * BC + c];
+          for (uint32_t j = 0; j < M; j++) {
+            C.a(I * BR + r, j) += a * B.r(k0 + c, j);
+          }
+        }
+      }
+    }
+  }
+}
+
+// C = A @ B for BSR A [N, K] and dense B [K, M], as spmm for CSR
+template <uint32_t BR, uint32_t BC>
+void spmm(const BsrMatrix<float, BR, BC> &A, MatrixView<const float> B,
+          MatrixView<float> C, uint32_t threads = 0,
+          Workspace &workspace = Workspace::local()) {
+  uint32_t blockRows = (A.get_height() + BR - 1) / BR, M = C.get_width();
+  support::Isa isa = support::active_isa();
+  bool rows = B.get_col_stride() == 1 && C.get_col_stride() == 1;
+
+  forRowRuns(A.row_ptr(), blockRows, threads, workspace,
+             [&](uint32_t I0, uint32_t I1) {
+               if (rows && isa == support::Isa::AVX512) {
+                 bsrRows512(A, B.data(), B.get_row_stride(), C.data(),
+                            C.get_row_stride(), M, I0, I1);
+               } else if (rows && isa == support::Isa::AVX2) {
+                 bsrRows256(A, B.data(), B.get_row_stride(), C.data(),
+                            C.get_row_stride(), M, I0, I1);
+               } else {
+                 bsrRowsScalar(A, B, C, I0, I1);
+               }
+             });
+}
+
+} // namespace sparse
+} // namespace algo
+#endif
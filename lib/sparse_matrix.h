@@ -0,0 +1,209 @@
+#include "matrix.h"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef __SPARSE_MATRIX_H__
+#define __SPARSE_MATRIX_H__
+
+namespace support {
+
+// Compressed sparse row companion to Matrix for pruned weights. The nonzeros
+// of row i are values[row_ptr[i] .. row_ptr[i + 1]), at columns col_idx[...]
+// in increasing order. Built from a dense matrix, read-only afterwards.
+template <typename T>
+class CsrMatrix {
+public:
+    CsrMatrix() : _row_ptr(1, 0) {}
+
+    // Keeps the entries of dense that are not zero
+    static CsrMatrix from_dense(MatrixView<const T> dense) {
+        CsrMatrix csr;
+        csr._width = dense.get_width();
+        csr._height = dense.get_height();
+        csr._row_ptr.assign(1, 0);
+        csr._row_ptr.reserve(size_t(csr._height) + 1);
+        for (uint32_t i = 0; i < csr._height; i++) {
+            for (uint32_t j = 0; j < csr._width; j++) {
+                const T& value = dense.r(i, j);
+                if (value != T(0)) {
+                    csr._col_idx.push_back(j);
+                    csr._values.push_back(value);
+                }
+            }
+            csr._row_ptr.push_back(csr._values.size());
+        }
+        return csr;
+    }
+
+    // Writes the matrix out densely, zeros included
+    void to_dense(MatrixView<T> dense) const {
+        for (uint32_t i = 0; i < _height; i++) {
+            for (uint32_t j = 0; j < _width; j++) {
+                dense.a(i, j) = T(0);
+            }
+            for (uint64_t p = _row_ptr[i]; p < _row_ptr[i + 1]; p++) {
+                dense.a(i, _col_idx[p]) = _values[p];
+            }
+        }
+    }
+
+    uint32_t get_width() const {
+        return _width;
+    }
+
+    uint32_t get_height() const {
+        return _height;
+    }
+
+    size_t nnz() const {
+        return _values.size();
+    }
+
+    // Fraction of the entries that are stored
+    double density() const {
+        return _width == 0 || _height == 0 ? 0 : double(nnz()) / _width / _height;
+    }
+
+    // Bytes of values and indices, to compare with the dense footprint
+    size_t bytes() const {
+        return _values.size() * (sizeof(T) + sizeof(uint32_t)) +
+               _row_ptr.size() * sizeof(uint64_t);
+    }
+
+    const uint64_t* row_ptr() const {
+        return _row_ptr.data();
+    }
+
+    const uint32_t* col_idx() const {
+        return _col_idx.data();
+    }
+
+    const T* values() const {
+        return _values.data();
+    }
+
+private:
+    uint32_t _width = 0, _height = 0;
+    std::vector<uint64_t> _row_ptr;
+    std::vector<uint32_t> _col_idx;
+    std::vector<T> _values;
+};
+
+// Block compressed sparse row: CSR over dense [BR, BC] blocks. A block is
+// stored when any of its entries is nonzero, row-major, with the zeros inside
+// it kept. Each value loaded from B is then reused for BR rows of C, and there
+// is one index per block rather than per value; the price is the explicit
+// zeros, see fill(). Blocks on the bottom and right edges are zero padded.
+template <typename T, uint32_t BR, uint32_t BC>
+class BsrMatrix {
+public:
+    static constexpr uint32_t BLOCK_ROWS = BR;
+    static constexpr uint32_t BLOCK_COLS = BC;
+
+    BsrMatrix() : _row_ptr(1, 0) {}
+
+    static BsrMatrix from_dense(MatrixView<const T> dense) {
+        BsrMatrix bsr;
+        bsr._width = dense.get_width();
+        bsr._height = dense.get_height();
+        uint32_t blockRows = (bsr._height + BR - 1) / BR;
+        uint32_t blockCols = (bsr._width + BC - 1) / BC;
+        bsr._row_ptr.assign(1, 0);
+        bsr._row_ptr.reserve(size_t(blockRows) + 1);
+
+        T block[BR * BC];
+        for (uint32_t I = 0; I < blockRows; I++) {
+            for (uint32_t J = 0; J < blockCols; J++) {
+                bool any = false;
+                for (uint32_t r = 0; r < BR; r++) {
+                    for (uint32_t c = 0; c < BC; c++) {
+                        uint32_t i = I * BR + r, j = J * BC + c;
+                        block[r * BC + c] =
+                            i < bsr._height && j < bsr._width ? dense.r(i, j) : T(0);
+                        any |= block[r * BC + c] != T(0);
+                    }
+                }
+                if (any) {
+                    bsr._col_idx.push_back(J);
+                    bsr._values.insert(bsr._values.end(), block, block + BR * BC);
+                }
+            }
+            bsr._row_ptr.push_back(bsr._col_idx.size());
+        }
+        return bsr;
+    }
+
+    void to_dense(MatrixView<T> dense) const {
+        for (uint32_t i = 0; i < _height; i++) {
+            for (uint32_t j = 0; j < _width; j++) {
+                dense.a(i, j) = T(0);
+            }
+        }
+        for (uint32_t I = 0; I + 1 < _row_ptr.size(); I++) {
+            for (uint64_t p = _row_ptr[I]; p < _row_ptr[I + 1]; p++) {
+                uint32_t i0 = I * BR, j0 = _col_idx[p] * BC;
+                const T* block = &_values[p * BR * BC];
+                for (uint32_t r = 0; r < BR && i0 + r < _height; r++) {
+                    for (uint32_t c = 0; c < BC && j0 + c < _width; c++) {
+                        dense.a(i0 + r, j0 + c) = block[r * BC + c];
+                    }
+                }
+            }
+        }
+    }
+
+    uint32_t get_width() const {
+        return _width;
+    }
+
+    uint32_t get_height() const {
+        return _height;
+    }
+
+    size_t blocks() const {
+        return _col_idx.size();
+    }
+
+    // Nonzeros among the stored values, 1 when every block is full
+    double fill() const {
+        if (_values.empty()) {
+            return 1;
+        }
+        size_t nonzero = 0;
+        for (const T& value : _values) {
+            nonzero += value != T(0);
+        }
+        return double(nonzero) / _values.size();
+    }
+
+    size_t bytes() const {
+        return _values.size() * sizeof(T) + _col_idx.size() * sizeof(uint32_t) +
+               _row_ptr.size() * sizeof(uint64_t);
+    }
+
+    // Block offsets of each block row, one past the end for the last
+    const uint64_t* row_ptr() const {
+        return _row_ptr.data();
+    }
+
+    // Block column of each block
+    const uint32_t* col_idx() const {
+        return _col_idx.data();
+    }
+
+    // BR * BC values per block
+    const T* values() const {
+        return _values.data();
+    }
+
+private:
+    uint32_t _width = 0, _height = 0;
+    std::vector<uint64_t> _row_ptr;
+    std::vector<uint32_t> _col_idx;
+    std::vector<T> _values;
+};
+
+} // namespace support
+
+#endif
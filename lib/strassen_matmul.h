@@ -0,0 +1,142 @@
+#include "matrix.h"
+#include "packed_matmul.h"
+#include "workspace.h"
+#include <algorithm>
+
+#ifndef __STRASSEN_MATMUL_H__
+#define __STRASSEN_MATMUL_H__
+
+using support::MatrixView;
+using support::Workspace;
+
+namespace algo {
+namespace strassen {
+
+// Strassen-Winograd: 7 half-size products and 15 additions per level instead
+// of 8 products, O(n^2.81) overall. Each level splits M, N and K in half and
+// recurses until the smallest of them is at most `cutoff`, where the packed
+// GEMM takes over. Below roughly that size the extra passes over memory for
+// the additions cost more than the product they save.
+//
+// The rounding error grows by a constant factor per level rather than with K,
+// so results are within the usual tolerance of the classical product for the
+// few levels large matrices need, but are not bit identical.
+
+// out = X + sign * Y elementwise. out may alias X or Y.
+inline void combine(MatrixView<const float> X, MatrixView<const float> Y,
+                    float sign, MatrixView<float> out) {
+  uint32_t rows = out.get_height(), cols = out.get_width();
+  if (X.get_col_stride() == 1 && Y.get_col_stride() == 1 &&
+      out.get_col_stride() == 1) {
+    for (uint32_t i = 0; i < rows; i++) {
+      const float *x = &X.r(i, 0), *y = &Y.r(i, 0);
+      float *o = &out.a(i, 0);
+      for (uint32_t j = 0; j < cols; j++) {
+        o[j] = x[j] + sign * y[j];
+      }
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < rows; i++) {
+    for (uint32_t j = 0; j < cols; j++) {
+      out.a(i, j) = X.r(i, j) + sign * Y.r(i, j);
+    }
+  }
+}
+
+// Dense [height, width] view onto scratch memory
+inline MatrixView<float> scratch(float *data, uint32_t height,
+                                 uint32_t width) {
+  return MatrixView<float>(data, width, height, width);
+}
+
+template <size_t cutoff>
+void strassenGemm(MatrixView<const float> A, MatrixView<const float> B,
+                  MatrixView<float> C, Workspace &workspace) {
+  uint32_t M = C.get_height(), N = C.get_width(), K = A.get_width();
+  if (std::min({M, N, K}) <= std::max<size_t>(cutoff, 1)) {
+    packed::packed_matmul_ws(A, B, C, workspace);
+    return;
+  }
+
+  // Odd dimensions are peeled: the even core recurses and the last row,
+  // column and rank-1 term of K are fixed up afterwards
+  uint32_t m = M / 2, n = N / 2, k = K / 2;
+
+  auto A11 = A.block(0, 0, m, k), A12 = A.block(0, k, m, k);
+  auto A21 = A.block(m, 0, m, k), A22 = A.block(m, k, m, k);
+  auto B11 = B.block(0, 0, k, n), B12 = B.block(0, n, k, n);
+  auto B21 = B.block(k, 0, k, n), B22 = B.block(k, n, k, n);
+  auto C11 = C.block(0, 0, m, n), C12 = C.block(0, n, m, n);
+  auto C21 = C.block(m, 0, m, n), C22 = C.block(m, n, m, n);
+
+  {
+    Workspace::Scope scope(workspace);
+    // Two temporaries, with the quadrants of C holding the other partial
+    // products (Boyer, Dumas, Pernet and Zhou's schedule for C = A @ B)
+    float *x = workspace.alloc<float>(size_t(m) * std::max(k, n));
+    auto S = scratch(x, m, k), P1 = scratch(x, m, n);
+    auto T = scratch(workspace.alloc<float>(size_t(k) * n), k, n);
+
+    combine(A11, A21, -1, S);                       // S3 = A11 - A21
+    combine(B22, B12, -1, T);                       // T3 = B22 - B12
+    strassenGemm<cutoff>(S, T, C21, workspace);     // P7 = S3 T3
+    combine(A21, A22, 1, S);                        // S1 = A21 + A22
+    combine(B12, B11, -1, T);                       // T1 = B12 - B11
+    strassenGemm<cutoff>(S, T, C22, workspace);     // P5 = S1 T1
+    combine(S, A11, -1, S);                         // S2 = S1 - A11
+    combine(B22, T, -1, T);                         // T2 = B22 - T1
+    strassenGemm<cutoff>(S, T, C12, workspace);     // P6 = S2 T2
+    combine(A12, S, -1, S);                         // S4 = A12 - S2
+    strassenGemm<cutoff>(S, B22, C11, workspace);   // P3 = S4 B22
+    strassenGemm<cutoff>(A11, B11, P1, workspace);  // P1 = A11 B11
+    combine(P1, C12, 1, C12);                       // U2 = P1 + P6
+    combine(C12, C21, 1, C21);                      // U3 = U2 + P7
+    combine(C12, C22, 1, C12);                      // U4 = U2 + P5
+    combine(C21, C22, 1, C22);                      // U7 = U3 + P5
+    combine(C12, C11, 1, C12);                      // U5 = U4 + P3
+    combine(T, B21, -1, T);                         // T4 = T2 - B21
+    strassenGemm<cutoff>(A22, T, C11, workspace);   // P4 = A22 T4
+    combine(C21, C11, -1, C21);                     // U6 = U3 - P4
+    strassenGemm<cutoff>(A12, B21, C11, workspace); // P2 = A12 B21
+    combine(P1, C11, 1, C11);                       // U1 = P1 + P2
+  }
+
+  if (K > 2 * k) {
+    // C[:2m, :2n] += A[:2m, K-1] B[K-1, :2n]
+    for (uint32_t i = 0; i < 2 * m; i++) {
+      float a = A.r(i, K - 1);
+      for (uint32_t j = 0; j < 2 * n; j++) {
+        C.a(i, j) += a * B.r(K - 1, j);
+      }
+    }
+  }
+  if (N > 2 * n) {
+    packed::packed_matmul_ws(A, B.block(0, N - 1, K, 1),
+                             C.block(0, N - 1, M, 1), workspace);
+  }
+  if (M > 2 * m) {
+    packed::packed_matmul_ws(A.block(M - 1, 0, 1, K), B.block(0, 0, K, 2 * n),
+                             C.block(M - 1, 0, 1, 2 * n), workspace);
+  }
+}
+
+// C = A @ B with Strassen-Winograd down to `cutoff`, temporaries carved out of
+// workspace. Any shape works, but it only pays off for large, roughly square
+// products; see --strassen in main.cpp for the crossover.
+template <size_t cutoff = 512>
+void strassen_matmul_ws(MatrixView<const float> A, MatrixView<const float> B,
+                        MatrixView<float> C, Workspace &workspace) {
+  strassenGemm<cutoff>(A, B, C, workspace);
+}
+
+// As strassen_matmul_ws, on the calling thread's workspace
+template <size_t cutoff = 512>
+void strassen_matmul(MatrixView<const float> A, MatrixView<const float> B,
+                     MatrixView<float> C) {
+  strassen_matmul_ws<cutoff>(A, B, C, Workspace::local());
+}
+
+} // namespace strassen
+} // namespace algo
+#endif
@@ -0,0 +1,100 @@
+#include "epilogue.h"
+#include "matrix.h"
+#include "matrix_file.h"
+#include "parallel_matmul.h"
+#include "workspace.h"
+#include <stdint.h>
+#include <algorithm>
+
+#ifndef __STREAMING_MATMUL_H__
+#define __STREAMING_MATMUL_H__
+
+using algo::epilogue::Epilogue;
+using support::Matrix;
+using support::MatrixView;
+using support::Workspace;
+
+namespace algo {
+namespace streaming {
+
+// Out-of-core GEMM for a B too large to keep in memory, typically weights
+// mapped from a matrix file. B is walked in K panels, consecutive row ranges
+// of about panelBytes that are contiguous in the file: while the packed GEMM
+// multiplies one panel, the kernel reads the next one ahead (MADV_WILLNEED),
+// and once a panel is done its pages are dropped (MADV_DONTNEED), so only
+// about two panels of B are ever resident. A and C stay in memory.
+//
+// Each panel adds A[:, k0:k1] @ B[k0:k1, :] to C, so K is the only dimension
+// split and the result matches the in-memory GEMM up to the summation order
+// across panels.
+
+// Rows of B per panel: about panelBytes, a multiple of the packed GEMM's K
+// block when there is room for one, so no panel ends in a ragged block
+inline uint32_t panelRows(const Matrix<float> &B, size_t panelBytes,
+                          uint32_t blockK = 256) {
+  size_t rowBytes = std::max<size_t>(size_t(B.get_stride()) * sizeof(float), 1);
+  size_t rows = std::max<size_t>(panelBytes / rowBytes, 1);
+  if (rows >= blockK) {
+    rows = rows / blockK * blockK;
+  }
+  return uint32_t(std::min<size_t>(rows, std::max(B.get_height(), 1u)));
+}
+
+// C = epilogue(A @ B), streaming B by K panels of about panelBytes on
+// `threads` workers of the global pool, 0 meaning all of them. Pages are only
+// dropped when B is a file mapping; an in-memory B is just multiplied panel
+// by panel.
+inline void streamed_matmul_fused(MatrixView<const float> A,
+                                  const Matrix<float> &B, MatrixView<float> C,
+                                  const Epilogue &epilogue,
+                                  size_t panelBytes = size_t(64) << 20,
+                                  uint32_t threads = 0,
+                                  Workspace &workspace = Workspace::local()) {
+  uint32_t K = B.get_height(), M = B.get_width();
+  size_t rowBytes = size_t(B.get_stride()) * sizeof(float);
+  uint32_t rows = panelRows(B, panelBytes);
+  auto panelData = [&](uint32_t k0) {
+    return reinterpret_cast<const char *>(B.data()) + k0 * rowBytes;
+  };
+  auto panelSize = [&](uint32_t k0) {
+    return std::min(rows, K - k0) * rowBytes;
+  };
+
+  if (K == 0) {
+    parallel::packed_matmul_fused_threads(A, B, C, epilogue, threads,
+                                          workspace);
+    return;
+  }
+
+  if (B.is_mapped()) {
+    support::will_need(panelData(0), panelSize(0));
+  }
+  for (uint32_t k0 = 0; k0 < K; k0 += rows) {
+    uint32_t kp = std::min(rows, K - k0);
+    if (B.is_mapped() && k0 + kp < K) {
+      support::will_need(panelData(k0 + kp), panelSize(k0 + kp));
+    }
+
+    // The first panel applies alpha and beta, later ones accumulate, and the
+    // last applies bias and activation
+    parallel::packed_matmul_fused_threads(
+        A.block(0, k0, A.get_height(), kp), B.view().block(k0, 0, kp, M), C,
+        epilogue.block(0, 0, k0 == 0, k0 + kp == K), threads, workspace);
+
+    if (B.is_mapped()) {
+      support::dont_need(panelData(k0), panelSize(k0));
+    }
+  }
+}
+
+// C = A @ B, streaming B by K panels of about panelBytes
+inline void streamed_matmul(MatrixView<const float> A, const Matrix<float> &B,
+                            MatrixView<float> C,
+                            size_t panelBytes = size_t(64) << 20,
+                            uint32_t threads = 0) {
+  streamed_matmul_fused(A, B, C, Epilogue(), panelBytes, threads);
+}
+
+} // namespace streaming
+} // namespace algo
+#endif
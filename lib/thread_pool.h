@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+namespace support {
+
+// Persistent pool of worker threads. Threads are created once and parked on a
+// condition variable between jobs, so a parallel_for costs a wake-up rather
+// than a thread start.
+//
+// Each worker owns a deque of task indices. A job is split into contiguous
+// ranges, one per deque; owners pop from the front of their own deque and,
+// once it is empty, steal from the back of the others. Slow tasks (edge tiles,
+// a core shared with another process) are picked up by whoever is idle.
+// Since every deque starts as a range, it is stored as [begin, end) and a job
+// never allocates. Workers can be put in groups (NUMA nodes, see numa.h), and
+// thieves then search their own group first, so tasks mostly stay on the node
+// whose worker owns them.
+class ThreadPool {
+public:
+
+    // The calling thread acts as worker 0, so threads - 1 are spawned
+    explicit ThreadPool(uint32_t threads)
+        : _size(std::max<uint32_t>(threads, 1)),
+          _queues(new WorkQueue[_size]), _groups(_size, 0) {
+        for (uint32_t w = 1; w < _size; w++) {
+            _threads.emplace_back(&ThreadPool::workerLoop, this, w);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (std::thread& thread : _threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Process wide pool with one worker per hardware thread
+    static ThreadPool& global() {
+        static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1u));
+        return pool;
+    }
+
+    uint32_t size() const {
+        return _size;
+    }
+
+    // Index of the pool worker running the calling thread, or -1 outside a job
+    static int32_t current_worker() {
+        return _current_worker;
+    }
+
+    // Runs fn(task, worker) for every task in [0, num_tasks) on at most
+    // `threads` workers (0 means all) and blocks until all tasks are done.
+    // worker is in [0, threads) and can be used to index per-thread scratch.
+    // Calls made from inside a task run serially on the calling thread, which
+    // then passes worker 0: its pool index may be past the scratch sized for
+    // `threads`.
+    template <typename F>
+    void parallel_for(uint32_t num_tasks, F&& fn, uint32_t threads = 0) {
+        run(num_tasks, fn, threads, true);
+    }
+
+    // Runs fn(worker) exactly once on each of `threads` workers (0 means
+    // all), with no stealing, for per-thread setup that has to happen on the
+    // thread itself: pinning, or first touch of the memory a worker will own.
+    // From inside a task, fn runs once on the calling worker.
+    template <typename F>
+    void for_each_worker(F&& fn, uint32_t threads = 0) {
+        uint32_t active = threads == 0 ? _size : std::min(threads, _size);
+        if (_current_worker >= 0) {
+            fn(uint32_t(_current_worker));
+            return;
+        }
+        run(active, [&](uint32_t, uint32_t worker) { fn(worker); }, active, false);
+    }
+
+    // Group of each worker, by default all 0. Only call between jobs.
+    void set_groups(const std::vector<uint32_t>& groups) {
+        for (uint32_t w = 0; w < _size; w++) {
+            _groups[w] = w < groups.size() ? groups[w] : 0;
+        }
+    }
+
+    uint32_t group(uint32_t worker) const {
+        return _groups[worker];
+    }
+
+private:
+    template <typename F>
+    void run(uint32_t num_tasks, F&& fn, uint32_t threads, bool steal) {
+        if (num_tasks == 0) {
+            return;
+        }
+
+        uint32_t active = threads == 0 ? _size : std::min(threads, _size);
+        active = std::min(active, num_tasks);
+        if (active == 1 || _current_worker >= 0) {
+            for (uint32_t task = 0; task < num_tasks; task++) {
+                fn(task, 0);
+            }
+            return;
+        }
+
+        // One job at a time, concurrent callers queue up here
+        std::lock_guard<std::mutex> submit(_submit);
+
+        {
+            // Wait out workers that woke late for the previous job before
+            // handing out tasks, so every task runs on a worker < active
+            std::unique_lock<std::mutex> lock(_lock);
+            _done.wait(lock, [&] { return _busy == 0; });
+
+            _fn = TaskRef(fn);
+            _remaining.store(num_tasks);
+            for (uint32_t w = 0; w < active; w++) {
+                std::lock_guard<std::mutex> queue_lock(_queues[w].lock);
+                _queues[w].begin = uint64_t(num_tasks) * w / active;
+                _queues[w].end = uint64_t(num_tasks) * (w + 1) / active;
+            }
+            _active = active;
+            _steal = steal;
+            _generation++;
+        }
+        _wake.notify_all();
+
+        _current_worker = 0;
+        runTasks(0, active);
+        _current_worker = -1;
+
+        std::unique_lock<std::mutex> lock(_lock);
+        _done.wait(lock, [&] { return _remaining.load() == 0 && _busy == 0; });
+        _fn = TaskRef();
+    }
+
+    // Non-owning reference to the job's callable, so submitting a lambda
+    // never allocates the way std::function can
+    struct TaskRef {
+        const void* fn = nullptr;
+        void (*call)(const void*, uint32_t, uint32_t) = nullptr;
+
+        TaskRef() = default;
+
+        template <typename F>
+        explicit TaskRef(const F& f) : fn(&f) {
+            call = [](const void* fn, uint32_t task, uint32_t worker) {
+                (*static_cast<const F*>(fn))(task, worker);
+            };
+        }
+
+        void operator()(uint32_t task, uint32_t worker) const {
+            call(fn, task, worker);
+        }
+    };
+
+    struct WorkQueue {
+        std::mutex lock;
+        uint32_t begin = 0, end = 0;
+    };
+
+    bool pop(uint32_t worker, uint32_t& task) {
+        WorkQueue& queue = _queues[worker];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.begin == queue.end) {
+            return false;
+        }
+        task = queue.begin++;
+        return true;
+    }
+
+    // Takes the last task of another worker, trying the thief's own group
+    // before the rest
+    bool steal(uint32_t thief, uint32_t active, uint32_t& task) {
+        for (int pass = 0; pass < 2; pass++) {
+            for (uint32_t offset = 1; offset < active; offset++) {
+                uint32_t victim = (thief + offset) % active;
+                if ((_groups[victim] == _groups[thief]) != (pass == 0)) {
+                    continue;
+                }
+                WorkQueue& queue = _queues[victim];
+                std::lock_guard<std::mutex> lock(queue.lock);
+                if (queue.begin != queue.end) {
+                    task = --queue.end;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void runTasks(uint32_t worker, uint32_t active) {
+        uint32_t task;
+        while (pop(worker, task) || (_steal && steal(worker, active, task))) {
+            _fn(task, worker);
+            if (_remaining.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(_lock);
+                _done.notify_all();
+            }
+        }
+    }
+
+    void workerLoop(uint32_t worker) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(_lock);
+        while (true) {
+            _wake.wait(lock, [&] { return _stop || _generation != seen; });
+            if (_stop) {
+                return;
+            }
+            seen = _generation;
+            uint32_t active = _active;
+            if (worker >= active) {
+                continue;
+            }
+
+            _busy++;
+            lock.unlock();
+            _current_worker = worker;
+            runTasks(worker, active);
+            _current_worker = -1;
+            lock.lock();
+            if (--_busy == 0) {
+                _done.notify_all();
+            }
+        }
+    }
+
+    uint32_t _size;
+    std::unique_ptr<WorkQueue[]> _queues;
+    std::vector<uint32_t> _groups;
+    std::vector<std::thread> _threads;
+
+    std::mutex _submit;
+    std::mutex _lock;
+    std::condition_variable _wake, _done;
+    bool _stop = false;
+    uint64_t _generation = 0;
+    uint32_t _active = 0;
+    uint32_t _busy = 0;
+    bool _steal = true;
+
+    TaskRef _fn;
+    std::atomic<uint32_t> _remaining{0};
+
+    static inline thread_local int32_t _current_worker = -1;
+};
+
+} // namespace support
+
+#endif
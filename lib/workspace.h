@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+
+#ifndef __WORKSPACE_H__
+#define __WORKSPACE_H__
+
+namespace support {
+
+// Bump-pointer arena for kernel scratch such as packed panels and per-thread
+// accumulators. A kernel opens a Workspace::Scope, carves buffers out with
+// alloc() and everything is handed back when the scope closes.
+//
+// Requests that do not fit spill into temporary heap blocks, chained through
+// a header at the start of each block so that spilling makes that one
+// allocation and nothing else. When the outermost scope closes the arena is
+// regrown once to the high water mark, so after the first call at the largest
+// shape seen, repeated calls never touch the heap.
+class Workspace {
+public:
+    static const size_t ALIGNMENT = 64;
+
+    Workspace() = default;
+
+    explicit Workspace(size_t bytes) {
+        reserve(bytes);
+    }
+
+    ~Workspace() {
+        releaseSpills();
+        std::free(_block);
+    }
+
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+
+    // Workspace of the calling thread, the default for every kernel
+    static Workspace& local() {
+        static thread_local Workspace workspace;
+        return workspace;
+    }
+
+    // Everything allocated while a Scope is alive is released when it dies.
+    // Scopes nest, so a kernel can call other kernels on the same workspace.
+    class Scope {
+    public:
+        explicit Scope(Workspace& workspace) : _workspace(workspace), _mark(workspace._used) {
+            _workspace._depth++;
+        }
+
+        ~Scope() {
+            _workspace.rewind(_mark);
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Workspace& _workspace;
+        size_t _mark;
+    };
+
+    // Uninitialized storage for count elements, aligned to alignment bytes.
+    // Only valid until the enclosing Scope closes.
+    template <typename T>
+    T* alloc(size_t count, size_t alignment = ALIGNMENT) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "workspace memory is released without running destructors");
+        alignment = std::max(alignment, alignof(T));
+        size_t bytes = count * sizeof(T);
+
+        size_t start = (_used + alignment - 1) / alignment * alignment;
+        if (start + bytes <= _capacity) {
+            _used = start + bytes;
+            _high_water = std::max(_high_water, _used + _spilled);
+            return reinterpret_cast<T*>(_block + start);
+        }
+
+        // Does not fit, serve it from the heap until the outermost scope
+        // closes. The first alignment bytes hold the link to the previous
+        // spill.
+        alignment = std::max(alignment, alignof(Spill));
+        size_t spill_bytes = std::max<size_t>((bytes + alignment - 1) / alignment * alignment, alignment);
+        char* memory = static_cast<char*>(std::aligned_alloc(alignment, alignment + spill_bytes));
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+        _spills = new (memory) Spill{_spills};
+        _heap_allocations++;
+        _spilled += spill_bytes + alignment;
+        _high_water = std::max(_high_water, _used + _spilled);
+        return reinterpret_cast<T*>(memory + alignment);
+    }
+
+    // Grows the arena to at least bytes. Only call with no scope open.
+    void reserve(size_t bytes) {
+        if (bytes <= _capacity) {
+            return;
+        }
+        bytes = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        void* memory = std::aligned_alloc(ALIGNMENT, bytes);
+        if (memory == nullptr) {
+            throw std::bad_alloc();
+        }
+        std::free(_block);
+        _block = static_cast<char*>(memory);
+        _capacity = bytes;
+        _heap_allocations++;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    size_t used() const {
+        return _used;
+    }
+
+    // Largest amount of scratch requested at once so far
+    size_t high_water() const {
+        return _high_water;
+    }
+
+    // Heap allocations made by this workspace, flat after warm-up
+    uint64_t heap_allocations() const {
+        return _heap_allocations;
+    }
+
+private:
+    void rewind(size_t mark) {
+        _used = mark;
+        if (--_depth != 0) {
+            return;
+        }
+
+        releaseSpills();
+        reserve(_high_water);
+    }
+
+    void releaseSpills() {
+        while (_spills != nullptr) {
+            Spill* next = _spills->next;
+            std::free(_spills);
+            _spills = next;
+        }
+        _spilled = 0;
+    }
+
+    char* _block = nullptr;
+    size_t _capacity = 0;
+    size_t _used = 0;
+    size_t _high_water = 0;
+    uint32_t _depth = 0;
+
+    // Header of a spilled block, newest first
+    struct Spill {
+        Spill* next;
+    };
+
+    Spill* _spills = nullptr;
+    size_t _spilled = 0;
+    uint64_t _heap_allocations = 0;
+};
+
+} // namespace support
+
+#endif
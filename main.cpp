@@ -1,93 +1,1357 @@
+#include "async_matmul.h"
+#include "autotune.h"
+#include "batched_matmul.h"
+#include "benchmark.h"
+#include "conv2d.h"
+#include "epilogue.h"
+#include "expression.h"
+#include "fixed_matmul.h"
+#include "half.h"
+#include "half_matmul.h"
+#include "int8_matmul.h"
 #include "matrix.h"
+#include "matrix_file.h"
 #include "naive_matmul.h"
+#include "numa.h"
+#include "packed_matmul.h"
+#include "parallel_matmul.h"
+#include "perf_counters.h"
+#include "random_fill.h"
+#include "roofline.h"
+#include "sparse_matmul.h"
+#include "strassen_matmul.h"
+#include "streaming_matmul.h"
+#include "thread_pool.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <chrono>
-#include <functional>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <random>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
+using support::BenchmarkResult;
+using support::KernelEntry;
+using support::KernelRegistry;
 using support::Matrix;
+using support::MatrixView;
+using support::PerfCounters;
+using support::ReportFormat;
 
-using f_matmul_float =
-    std::function<void(Matrix<float> &, Matrix<float> &, Matrix<float> &)>;
+// Seeds of support::random_fill for the operands, so A, B and C differ but
+// are the same on every run
+constexpr uint64_t SEED_A = 1, SEED_B = 2, SEED_C = 3;
 
-void randomInitFloatMatrix(Matrix<float> &mat) {
-  std::default_random_engine generator(0);
-  std::uniform_real_distribution<float> distribution(0.0, 1.0);
+// width x height input mapped from name.mat in dir, created and filled from
+// seed when missing or of another shape (dir too), so later runs skip
+// generating it. With no dir, a random matrix on the heap.
+Matrix<float> inputMatrix(const std::string &dir, const std::string &name,
+                          uint32_t width, uint32_t height, uint64_t seed) {
+  if (dir.empty()) {
+    Matrix<float> mat(width, height);
+    support::random_fill(mat, seed);
+    return mat;
+  }
+
+  mkdir(dir.c_str(), 0755);
+  std::string path = dir + "/" + name + ".mat";
+  try {
+    support::MatrixFileHeader header = support::read_matrix_header(path);
+    if (header.dtype == support::MatrixDType::F32 && header.width == width &&
+        header.height == height) {
+      return support::map_matrix_file<float>(path);
+    }
+  } catch (const std::runtime_error &) {
+    // Missing or unreadable, written again below
+  }
+  Matrix<float> mat = support::create_matrix_file<float>(path, width, height);
+  support::random_fill(mat, seed);
+  return mat;
+}
+
+void registerKernels(KernelRegistry &registry) {
+  REGISTER_MATMUL(registry, algo::naive::naive_matmul_ijk<float>);
+  REGISTER_MATMUL(registry, algo::naive::naive_matmul_kij<float>);
+  REGISTER_MATMUL(registry, algo::naive::tiled_ijk_matmul_ijk<float, 8, 8, 8>);
+  REGISTER_MATMUL(registry,
+                  algo::naive::tiled_ijk_matmul_ijk<float, 16, 16, 16>);
+  REGISTER_MATMUL(registry,
+                  algo::naive::tiled_ijk_matmul_ijk<float, 32, 32, 32>);
+  REGISTER_MATMUL(registry, algo::naive::tiled_ijk_matmul_kij<float, 8, 8, 8>);
+  REGISTER_MATMUL(registry,
+                  algo::naive::tiled_ijk_matmul_kij<float, 16, 16, 16>);
+  REGISTER_MATMUL(registry,
+                  algo::naive::tiled_ijk_matmul_kij<float, 32, 32, 32>);
+  REGISTER_MATMUL(registry, algo::packed::packed_matmul<72, 256, 4080>);
+  REGISTER_PARALLEL_MATMUL(registry,
+                           algo::parallel::packed_matmul<72, 256, 4080, 128>);
+  REGISTER_MATMUL(registry, algo::autotune::tuned_matmul);
+  REGISTER_MATMUL(registry, algo::strassen::strassen_matmul<512>);
+}
+
+struct Shape {
+  uint32_t M, N, K;
+};
+
+struct Options {
+  std::vector<Shape> shapes;
+  std::vector<std::string> kernels;
+  uint32_t warmups = 1;
+  uint32_t repeats = 10;
+  ReportFormat format = ReportFormat::TEXT;
+  std::string output;
+  bool list = false;
+  bool example = false;
+  bool scaling = false;
+  bool counters = false;
+  bool roofline = false;
+  bool recalibrate = false;
+  std::string calibration;
+  bool tune = false;
+  std::string tuning_db;
+  uint32_t batched = 0;
+  uint32_t async = 0;
+  uint32_t conv = 0;
+  bool fixed = false;
+  bool half = false;
+  bool strassen = false;
+  bool epilogue = false;
+  bool expression = false;
+  bool sparse = false;
+  bool stream = false;
+  bool pin = false;
+  bool numa = false;
+  std::string data;
+  // Where files are written when no --data directory is given
+  std::string binary_dir;
+  bool int8 = false;
+};
+
+void usage(const char *argv0) {
+  std::cerr
+      << "usage: " << argv0 << " [options]\n"
+      << "  --shapes S[,S...]   MxNxK, or a single number for a cube "
+         "(default 256,512,1024,255x257x263)\n"
+      << "  --kernels F[,F...]  only kernels whose name contains one of F\n"
+      << "  --warmups N         untimed runs per kernel (default 1)\n"
+      << "  --repeats N         timed runs per kernel (default 10)\n"
+      << "  --format F          text, csv or json (default text)\n"
+      << "  --output FILE       write the report to FILE instead of stdout\n"
+      << "  --list              list registered kernels and exit\n"
+      << "  --example           print small worked examples first\n"
+      << "  --scaling           thread scaling of the parallel GEMM per shape, and\n"
+      << "                      a check of GEMMs nested in pool tasks\n"
+      << "  --batched N         batches of N small GEMMs (64 to 128 cubes)\n"
+      << "  --async N           N client threads, one issuing shape GEMMs and "
+         "the rest 64^3 ones, sync against the async queue\n"
+      << "  --conv N            ResNet-50 convolutions on batches of N images, "
+         "NCHW and NHWC, im2col against implicit GEMM\n"
+      << "  --fixed             compile time shaped 4x4 to 32x32 kernels\n"
+      << "  --half              bf16/fp16 storage GEMMs per shape, with their "
+         "error against fp32\n"
+      << "  --int8              quantized int8 GEMMs per shape against the "
+         "fp32 path\n"
+      << "  --epilogue          alpha/beta, bias and ReLU/GELU fused into the "
+         "GEMM against separate passes\n"
+      << "  --expr              D = A * B + C and A * B * x as fused expressions "
+         "against temporaries by hand\n"
+      << "  --sparse            CSR/BSR SpMM and SpMV per shape over a density "
+         "sweep against the dense kernels\n"
+      << "  --stream            stream a file-mapped B through the GEMM by K "
+         "panels, cold and warm, per shape\n"
+      << "  --strassen          Strassen-Winograd cutoffs per shape against "
+         "the classical kernels\n"
+      << "  --data DIR          keep A and B as matrix files in DIR and map "
+         "them instead of generating them each run\n"
+      << "  --pin               pin pool workers to CPUs node by node, "
+         "stealing within a node first\n"
+      << "  --numa              per-node scaling of the parallel GEMM under "
+         "each page placement (implies --pin)\n"
+      << "  --counters          report perf_event hardware counters per kernel\n"
+      << "  --roofline          report % of peak and roofline position, "
+         "calibrating the machine on first use\n"
+      << "  --calibration FILE  calibration cache (default: calibration.txt "
+         "next to the binary)\n"
+      << "  --recalibrate       measure the machine again even if cached\n"
+      << "  --tune              autotune every shape first and save the "
+         "results\n"
+      << "  --tuning-db FILE    tuning database (default: tuning.db next to "
+         "the binary)\n"
+      << "environment:\n"
+      << "  MATMUL_ISA=sse|avx2|avx512  kernel variant (default: the widest "
+         "this CPU runs)\n";
+}
+
+std::vector<std::string> splitList(const std::string &list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+bool parseShape(const std::string &text, Shape &shape) {
+  unsigned M, N, K;
+  char x1, x2;
+  std::stringstream stream(text);
+  if (stream >> M >> x1 >> N >> x2 >> K && x1 == 'x' && x2 == 'x' &&
+      stream.eof()) {
+    shape = {M, N, K};
+    return true;
+  }
+
+  std::stringstream cube(text);
+  if (cube >> M && cube.eof()) {
+    shape = {M, M, M};
+    return true;
+  }
+  return false;
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
 
-  for (int r = 0; r < mat.get_height(); r++) {
-    for (int c = 0; c < mat.get_width(); c++) {
-      mat.a(r, c) = distribution(generator);
+    if (arg == "--list") {
+      options.list = true;
+    } else if (arg == "--example") {
+      options.example = true;
+    } else if (arg == "--scaling") {
+      options.scaling = true;
+    } else if (arg == "--half") {
+      options.half = true;
+    } else if (arg == "--int8") {
+      options.int8 = true;
+    } else if (arg == "--epilogue") {
+      options.epilogue = true;
+    } else if (arg == "--expr") {
+      options.expression = true;
+    } else if (arg == "--sparse") {
+      options.sparse = true;
+    } else if (arg == "--pin") {
+      options.pin = true;
+    } else if (arg == "--numa") {
+      options.numa = true;
+    } else if (arg == "--stream") {
+      options.stream = true;
+    } else if (arg == "--data" && has_value) {
+      options.data = argv[++i];
+    } else if (arg == "--strassen") {
+      options.strassen = true;
+    } else if (arg == "--fixed") {
+      options.fixed = true;
+    } else if (arg == "--batched" && has_value) {
+      options.batched = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--async" && has_value) {
+      options.async = std::max(std::atoi(argv[++i]), 2);
+    } else if (arg == "--conv" && has_value) {
+      options.conv = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--counters") {
+      options.counters = true;
+    } else if (arg == "--roofline") {
+      options.roofline = true;
+    } else if (arg == "--recalibrate") {
+      options.roofline = true;
+      options.recalibrate = true;
+    } else if (arg == "--calibration" && has_value) {
+      options.calibration = argv[++i];
+    } else if (arg == "--tune") {
+      options.tune = true;
+    } else if (arg == "--tuning-db" && has_value) {
+      options.tuning_db = argv[++i];
+    } else if (arg == "--shapes" && has_value) {
+      for (const std::string &item : splitList(argv[++i])) {
+        Shape shape;
+        if (!parseShape(item, shape)) {
+          std::cerr << "bad shape '" << item << "'" << std::endl;
+          return false;
+        }
+        options.shapes.push_back(shape);
+      }
+    } else if (arg == "--kernels" && has_value) {
+      options.kernels = splitList(argv[++i]);
+    } else if (arg == "--warmups" && has_value) {
+      options.warmups = std::atoi(argv[++i]);
+    } else if (arg == "--repeats" && has_value) {
+      options.repeats = std::max(std::atoi(argv[++i]), 1);
+    } else if (arg == "--format" && has_value) {
+      std::string format = argv[++i];
+      if (format == "text") {
+        options.format = ReportFormat::TEXT;
+      } else if (format == "csv") {
+        options.format = ReportFormat::CSV;
+      } else if (format == "json") {
+        options.format = ReportFormat::JSON;
+      } else {
+        std::cerr << "bad format '" << format << "'" << std::endl;
+        return false;
+      }
+    } else if (arg == "--output" && has_value) {
+      options.output = argv[++i];
+    } else {
+      return false;
     }
   }
+
+  // Caches live next to the binary unless told otherwise
+  std::string binary = argv[0];
+  size_t slash = binary.rfind('/');
+  std::string binary_dir =
+      slash == std::string::npos ? "" : binary.substr(0, slash + 1);
+  options.binary_dir = slash == std::string::npos ? "." : binary.substr(0, slash);
+  if (options.calibration.empty()) {
+    options.calibration = binary_dir + "calibration.txt";
+  }
+  if (options.tuning_db.empty()) {
+    options.tuning_db = binary_dir + "tuning.db";
+  }
+
+  if (options.shapes.empty()) {
+    options.shapes = {{256, 256, 256},
+                      {512, 512, 512},
+                      {1024, 1024, 1024},
+                      {255, 257, 263}};
+  }
+  return true;
+}
+
+// Random A [M, K] and B [K, N] with golden = A @ B, which most modes start
+// from, and C for their results
+struct Operands {
+  Matrix<float> A, B, C, golden;
+
+  explicit Operands(const Shape &shape)
+      : A(shape.K, shape.M), B(shape.N, shape.K), C(shape.N, shape.M),
+        golden(shape.N, shape.M) {
+    support::random_fill(A, SEED_A);
+    support::random_fill(B, SEED_B);
+    support::reference_matmul(A, B, golden);
+  }
+};
+
+// One row of a mode's report, GFLOPS counting `flop` operations per run (2 *
+// M * N * K if 0). The caller sets the error through check() and adds any
+// metrics of its own to extra.
+BenchmarkResult makeResult(const std::string &name, const Shape &shape,
+                           uint32_t warmups, uint32_t repeats,
+                           const support::TimingStats &stats, double flop = 0) {
+  BenchmarkResult result;
+  result.kernel = name;
+  result.M = shape.M;
+  result.N = shape.N;
+  result.K = shape.K;
+  result.warmups = warmups;
+  result.repeats = repeats;
+  result.stats = stats;
+  flop = flop > 0 ? flop : 2.0 * shape.M * shape.N * shape.K;
+  result.gflops = stats.median_us > 0 ? flop / stats.median_us / 1e3 : 0;
+  return result;
+}
+
+// makeResult() for `repeats` timed runs of fn
+template <typename F>
+BenchmarkResult timeVariant(const std::string &name, const Shape &shape,
+                            uint32_t warmups, uint32_t repeats, F &&fn,
+                            double flop = 0) {
+  return makeResult(name, shape, warmups, repeats,
+                    support::summarize(support::time_runs(fn, warmups, repeats)),
+                    flop);
 }
 
-template <int warmups, int repeats>
-int64_t benchmark_get_us(Matrix<float> &matA, Matrix<float> &matB,
-                         Matrix<float> &matC, f_matmul_float func) {
-  for (int i = 0; i < warmups; i++) {
-    func(matA, matB, matC);
+void check(BenchmarkResult &result, double error, double tolerance = 1e-4) {
+  result.error = error;
+  result.correct = error <= tolerance;
+}
+
+// Runs the parallel packed GEMM on 1..N workers of the global pool and reports
+// speedup and parallel efficiency (speedup / threads) against one thread.
+void test_scaling(const Shape &shape, uint32_t warmups, uint32_t repeats,
+                  std::vector<BenchmarkResult> &results) {
+  Operands ops(shape);
+
+  uint32_t max_threads = support::ThreadPool::global().size();
+  double us_one_thread = 0;
+  for (uint32_t threads = 1; threads <= max_threads; threads++) {
+    BenchmarkResult result = timeVariant(
+        "scaling: packed_matmul_threads " + std::to_string(threads), shape,
+        warmups, repeats, [&] {
+          algo::parallel::packed_matmul_threads<>(ops.A, ops.B, ops.C,
+                                                  threads);
+        });
+    check(result, support::max_error(ops.C, ops.golden));
+    double us = result.stats.median_us;
+    if (threads == 1) {
+      us_one_thread = us;
+    }
+
+    double speedup = us_one_thread / std::max(us, 1e-3);
+    result.extra = {{"threads", threads},
+                    {"speedup", speedup},
+                    {"efficiency_pct", 100.0 * speedup / threads}};
+    results.push_back(result);
   }
 
-  auto t1 = std::chrono::high_resolution_clock::now();
-  for (int i = 0; i < repeats; i++) {
-    func(matA, matB, matC);
+  // GEMMs started from inside pool tasks run inline, each on a band of rows,
+  // with scratch sized for fewer workers than the pool has
+  std::fill(ops.C.data(),
+            ops.C.data() + size_t(ops.C.get_stride()) * ops.C.get_height(),
+            0.0f);
+  uint32_t bands = std::min(2 * max_threads, shape.M);
+  BenchmarkResult result = timeVariant(
+      "scaling: nested in " + std::to_string(bands) + " tasks on 2 threads",
+      shape, warmups, repeats, [&] {
+        support::ThreadPool::global().parallel_for(
+            bands, [&](uint32_t band, uint32_t) {
+              uint32_t r0 = uint64_t(shape.M) * band / bands;
+              uint32_t r1 = uint64_t(shape.M) * (band + 1) / bands;
+              algo::parallel::packed_matmul_threads<>(
+                  ops.A.block(r0, 0, r1 - r0, shape.K), ops.B,
+                  ops.C.block(r0, 0, r1 - r0, shape.N), 2);
+            });
+      });
+  check(result, support::max_error(ops.C, ops.golden));
+  results.push_back(result);
+}
+
+// Multiplies `batch` independent [M, K] @ [K, N] problems, the way per-head
+// attention does, one at a time with the naive and packed kernels and then
+// through the batched API with separate matrices and one strided buffer.
+void test_batched(const Shape &shape, uint32_t batch, uint32_t warmups,
+                  uint32_t repeats, std::vector<BenchmarkResult> &results) {
+  using algo::batched::StridedBatch;
+
+  // One [batch * M, K] buffer holds every A, and likewise for B and C
+  Matrix<float> bufA(shape.K, shape.M * batch);
+  Matrix<float> bufB(shape.N, shape.K * batch);
+  Matrix<float> bufC(shape.N, shape.M * batch);
+  Matrix<float> golden(shape.N, shape.M * batch);
+  support::random_fill(bufA, SEED_A);
+  support::random_fill(bufB, SEED_B);
+
+  StridedBatch<float> A(bufA.data(), shape.K, shape.M, bufA.get_stride(),
+                        int64_t(shape.M) * bufA.get_stride(), batch);
+  StridedBatch<float> B(bufB.data(), shape.N, shape.K, bufB.get_stride(),
+                        int64_t(shape.K) * bufB.get_stride(), batch);
+  StridedBatch<float> C(bufC.data(), shape.N, shape.M, bufC.get_stride(),
+                        int64_t(shape.M) * bufC.get_stride(), batch);
+  StridedBatch<float> G(golden.data(), shape.N, shape.M, golden.get_stride(),
+                        int64_t(shape.M) * golden.get_stride(), batch);
+
+  std::vector<MatrixView<const float>> viewsA, viewsB;
+  std::vector<MatrixView<float>> viewsC;
+  for (uint32_t i = 0; i < batch; i++) {
+    viewsA.push_back(A[i]);
+    viewsB.push_back(B[i]);
+    viewsC.push_back(C[i]);
+    support::reference_matmul(A[i], B[i], G[i]);
   }
-  auto t2 = std::chrono::high_resolution_clock::now();
-  auto us = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
-  return us.count() / repeats;
+
+  auto report = [&](const std::string &name, auto &&fn) {
+    std::fill(bufC.data(),
+              bufC.data() + size_t(bufC.get_stride()) * bufC.get_height(),
+              0.0f);
+    BenchmarkResult result =
+        timeVariant("batched: " + name, shape, warmups, repeats, fn,
+                    2.0 * shape.M * shape.N * shape.K * batch);
+    check(result, support::max_error(bufC, golden));
+    result.extra = {{"batch", batch}};
+    results.push_back(result);
+  };
+
+  report("loop naive_matmul_kij", [&] {
+    for (uint32_t i = 0; i < batch; i++) {
+      algo::naive::naive_matmul_kij<float>(A[i], B[i], C[i]);
+    }
+  });
+  report("loop packed_matmul", [&] {
+    for (uint32_t i = 0; i < batch; i++) {
+      algo::packed::packed_matmul(A[i], B[i], C[i]);
+    }
+  });
+  report("batched_matmul", [&] {
+    algo::batched::batched_matmul(viewsA, viewsB, viewsC);
+  });
+  report("batched_matmul_strided",
+         [&] { algo::batched::batched_matmul_strided(A, B, C); });
 }
 
-template <int M, int N, int K, int warmups, int repeats>
-void test_conditions() {
-  Matrix<float> matA(M, K);
-  Matrix<float> matB(K, N);
-  Matrix<float> matC(M, N);
+// Multiplies COUNT pairs of SIZE x SIZE matrices with the fixed size kernel
+// and with the runtime kernels on the same data, reporting products per
+// second.
+template <uint32_t SIZE>
+void test_fixed(uint32_t warmups, uint32_t repeats,
+                std::vector<BenchmarkResult> &results) {
+  using Fixed = Matrix<float, SIZE, SIZE>;
+  const uint32_t COUNT = 4096;
 
-  randomInitFloatMatrix(matA);
-  randomInitFloatMatrix(matB);
-  randomInitFloatMatrix(matC);
+  // Product n keys its operands by n in the seed's upper half
+  std::vector<Fixed> A(COUNT), B(COUNT), C(COUNT), golden(COUNT);
+  for (uint32_t n = 0; n < COUNT; n++) {
+    support::random_fill(A[n], SEED_A | uint64_t(n) << 32);
+    support::random_fill(B[n], SEED_B | uint64_t(n) << 32);
+    support::reference_matmul(A[n], B[n], golden[n]);
+  }
 
-  std::cout << "M = " << M << ", N = " << N << ", K = " << K
-            << ", warmups = " << warmups << ", repeats " << repeats
+  auto report = [&](const std::string &name, auto &&fn) {
+    BenchmarkResult result = timeVariant(
+        "fixed: " + name, {SIZE, SIZE, SIZE}, warmups, repeats,
+        [&] {
+          for (uint32_t n = 0; n < COUNT; n++) {
+            fn(n);
+          }
+        },
+        2.0 * SIZE * SIZE * SIZE * COUNT);
+    double error = 0;
+    for (uint32_t n = 0; n < COUNT; n++) {
+      error = std::max(error, support::max_error(C[n], golden[n]));
+    }
+    check(result, error);
+    result.extra = {{"products", COUNT},
+                    {"m_products_per_s", COUNT / result.stats.median_us}};
+    results.push_back(result);
+  };
+
+  report("algo::fixed::matmul",
+         [&](uint32_t n) { algo::fixed::matmul(A[n], B[n], C[n]); });
+  report("naive_matmul_kij", [&](uint32_t n) {
+    algo::naive::naive_matmul_kij<float>(A[n], B[n], C[n]);
+  });
+  report("packed_matmul",
+         [&](uint32_t n) { algo::packed::packed_matmul(A[n], B[n], C[n]); });
+}
+
+// Runs each shape with A and B stored as bf16 and as fp16, both operands
+// 16-bit and with float A against 16-bit B. The kernel error is measured
+// against a float product of the rounded inputs, the storage error against
+// the fp32 product of the original inputs. Shapes with N = 1 take the GEMV
+// path.
+void test_half(const Shape &shape, uint32_t warmups, uint32_t repeats,
+               std::vector<BenchmarkResult> &results) {
+  using support::HalfFormat;
+
+  Operands ops(shape);
+
+  auto report = [&](const std::string &name, MatrixView<const float> rounded,
+                    auto &&fn) {
+    BenchmarkResult result =
+        timeVariant("half: " + name, shape, warmups, repeats, fn);
+    check(result, support::max_error(ops.C, rounded));
+    result.extra = {{"error_vs_fp32", support::max_error(ops.C, ops.golden)}};
+    results.push_back(result);
+  };
+
+  report("fp32 packed_matmul", ops.golden,
+         [&] { algo::packed::packed_matmul(ops.A, ops.B, ops.C); });
+
+  for (HalfFormat format : {HalfFormat::BF16, HalfFormat::FP16}) {
+    std::string name = support::half_format_name(format);
+    Matrix<uint16_t> halfA(shape.K, shape.M);
+    Matrix<uint16_t> halfB(shape.N, shape.K);
+    Matrix<float> roundedA(shape.K, shape.M);
+    Matrix<float> roundedB(shape.N, shape.K);
+    support::to_half(ops.A, halfA, format);
+    support::to_half(ops.B, halfB, format);
+    support::from_half(halfA, roundedA, format);
+    support::from_half(halfB, roundedB, format);
+
+    Matrix<float> both(shape.N, shape.M);
+    Matrix<float> weights(shape.N, shape.M);
+    support::reference_matmul(roundedA, roundedB, both);
+    support::reference_matmul(ops.A, roundedB, weights);
+
+    report(name + " x " + name, both, [&] {
+      algo::half::half_matmul(halfA, halfB, ops.C, format);
+    });
+    report("fp32 x " + name, weights, [&] {
+      algo::half::half_matmul(ops.A, halfB, ops.C, format);
+    });
+  }
+}
+
+// Quantizes A per row and B per column to int8 and runs the int8 GEMM with
+// int32, dequantized float and requantized int8 output next to the fp32
+// packed kernel; GFLOPS are int8 operations here. The int32 result must match
+// the reference exactly, the float one its dequantization, and the int8 one
+// the fp32 product quantized the same way (off by one is rounding). The
+// float outputs also report their error against the fp32 product.
+void test_int8(const Shape &shape, uint32_t warmups, uint32_t repeats,
+               std::vector<BenchmarkResult> &results) {
+  using algo::quant::QuantAxis;
+  using algo::quant::QuantParams;
+
+  Operands ops(shape);
+  Matrix<int8_t> quantA(shape.K, shape.M);
+  Matrix<int8_t> quantB(shape.N, shape.K);
+  Matrix<int8_t> quantC(shape.N, shape.M);
+  Matrix<int8_t> quantGolden(shape.N, shape.M);
+  Matrix<int32_t> accC(shape.N, shape.M);
+  Matrix<int32_t> accGolden(shape.N, shape.M);
+  Matrix<float> dequantGolden(shape.N, shape.M);
+  QuantParams paramsA = algo::quant::quantize(ops.A, quantA, QuantAxis::ROWS);
+  QuantParams paramsB =
+      algo::quant::quantize(ops.B, quantB, QuantAxis::COLUMNS);
+  QuantParams paramsC =
+      algo::quant::quantize(ops.golden, quantGolden, QuantAxis::TENSOR);
+  algo::quant::reference_int8_matmul(quantA, quantB, accGolden, paramsA,
+                                     paramsB);
+  for (uint32_t i = 0; i < shape.M; i++) {
+    for (uint32_t j = 0; j < shape.N; j++) {
+      dequantGolden.a(i, j) =
+          float(accGolden.r(i, j)) * (paramsA.scale_at(i) * paramsB.scale_at(j));
+    }
+  }
+  std::cerr << "Int8 kernels: "
+            << algo::quant::int8_isa_name(algo::quant::int8_isa())
             << std::endl;
 
-  uint64_t us_ijk = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::naive_matmul_ijk<float>);
-  std::cout << "\tnaive_matmul_ijk (us): " << us_ijk << std::endl;
+  auto report = [&](const std::string &name, auto &&fn, auto &&verify) {
+    BenchmarkResult result =
+        timeVariant("int8: " + name, shape, warmups, repeats, fn);
+    verify(result);
+    results.push_back(result);
+  };
+  auto floatError = [&](MatrixView<const float> expected) {
+    return [&, expected](BenchmarkResult &result) {
+      check(result, support::max_error(ops.C, expected));
+      result.extra = {
+          {"error_vs_fp32", support::max_error(ops.C, ops.golden)}};
+    };
+  };
+
+  report(
+      "fp32 packed_matmul",
+      [&] { algo::packed::packed_matmul(ops.A, ops.B, ops.C); },
+      floatError(ops.golden));
+  report(
+      "int8 -> int32",
+      [&] { algo::quant::int8_matmul(quantA, quantB, accC, paramsA, paramsB); },
+      [&](BenchmarkResult &result) {
+        uint64_t wrong = 0;
+        for (uint32_t i = 0; i < shape.M; i++) {
+          for (uint32_t j = 0; j < shape.N; j++) {
+            wrong += accC.r(i, j) != accGolden.r(i, j);
+          }
+        }
+        check(result, wrong, 0);
+        result.extra = {{"wrong", wrong}};
+      });
+  report(
+      "int8 -> fp32",
+      [&] {
+        algo::quant::int8_matmul(quantA, quantB, ops.C, paramsA, paramsB);
+      },
+      floatError(dequantGolden));
+  report(
+      "int8 -> int8",
+      [&] {
+        algo::quant::int8_matmul(quantA, quantB, quantC, paramsA, paramsB,
+                                 paramsC);
+      },
+      [&](BenchmarkResult &result) {
+        int worst = 0;
+        for (uint32_t i = 0; i < shape.M; i++) {
+          for (uint32_t j = 0; j < shape.N; j++) {
+            worst = std::max(worst, std::abs(quantC.r(i, j) -
+                                             quantGolden.r(i, j)));
+          }
+        }
+        check(result, worst, 1);
+        result.extra = {{"max_steps", worst}};
+      });
+}
+
+// C = act(alpha * A @ B + beta * C + row_bias + col_bias) with the ops fused
+// into the packed kernels' write-back, against the packed GEMM followed by a
+// separate pass over C for each op. Timed runs keep feeding C back in; the
+// check restores C and runs once, against the reference product with an
+// exact GELU.
+void test_epilogue(const Shape &shape, uint32_t warmups, uint32_t repeats,
+                   std::vector<BenchmarkResult> &results) {
+  using algo::epilogue::Activation;
+  using algo::epilogue::Epilogue;
+
+  Operands ops(shape);
+  Matrix<float> initC(shape.N, shape.M);
+  Matrix<float> product(shape.N, shape.M);
+  Matrix<float> expected(shape.N, shape.M);
+  support::random_fill(initC, SEED_C);
+
+  std::vector<float> rowBias(shape.M), colBias(shape.N);
+  support::random_fill(MatrixView<float>(rowBias.data(), shape.M, 1, shape.M),
+                       SEED_C + 1, -1, 1);
+  support::random_fill(MatrixView<float>(colBias.data(), shape.N, 1, shape.N),
+                       SEED_C + 2, -1, 1);
+
+  auto restore = [&] {
+    for (uint32_t i = 0; i < shape.M; i++) {
+      for (uint32_t j = 0; j < shape.N; j++) {
+        ops.C.a(i, j) = initC.r(i, j);
+      }
+    }
+  };
+  auto report = [&](const std::string &name, auto &&fn) {
+    BenchmarkResult result =
+        timeVariant("epilogue: " + name, shape, warmups, repeats, fn);
+    restore();
+    fn();
+    check(result, support::max_error(ops.C, expected));
+    results.push_back(result);
+  };
+
+  for (Activation activation : {Activation::RELU, Activation::GELU}) {
+    Epilogue epilogue;
+    epilogue.alpha = 0.5f;
+    epilogue.beta = 0.25f;
+    epilogue.row_bias = rowBias.data();
+    epilogue.col_bias = colBias.data();
+    epilogue.activation = activation;
+    bool relu = activation == Activation::RELU;
+
+    for (uint32_t i = 0; i < shape.M; i++) {
+      for (uint32_t j = 0; j < shape.N; j++) {
+        double x = 0.5 * ops.golden.r(i, j) + 0.25 * initC.r(i, j) +
+                   rowBias[i] + colBias[j];
+        expected.a(i, j) =
+            relu ? std::max(x, 0.0)
+                 : 0.5 * x *
+                       (1 + std::tanh(0.7978845608 * (x + 0.044715 * x * x * x)));
+      }
+    }
+
+    std::string suffix = relu ? " + relu" : " + gelu";
+    report("packed_matmul, separate passes" + suffix, [&] {
+      algo::packed::packed_matmul(ops.A, ops.B, product);
+      for (uint32_t i = 0; i < shape.M; i++) {
+        for (uint32_t j = 0; j < shape.N; j++) {
+          ops.C.a(i, j) = 0.5f * product.r(i, j) + 0.25f * ops.C.r(i, j);
+        }
+      }
+      for (uint32_t i = 0; i < shape.M; i++) {
+        for (uint32_t j = 0; j < shape.N; j++) {
+          ops.C.a(i, j) += rowBias[i] + colBias[j];
+        }
+      }
+      for (uint32_t i = 0; i < shape.M; i++) {
+        for (uint32_t j = 0; j < shape.N; j++) {
+          ops.C.a(i, j) = relu ? std::max(ops.C.r(i, j), 0.0f)
+                               : algo::epilogue::gelu(ops.C.r(i, j));
+        }
+      }
+    });
+    report("packed_matmul_fused" + suffix, [&] {
+      algo::packed::packed_matmul_fused(ops.A, ops.B, ops.C, epilogue);
+    });
+    report("parallel packed_matmul_fused" + suffix, [&] {
+      algo::parallel::packed_matmul_fused(ops.A, ops.B, ops.C, epilogue);
+    });
+  }
+}
+
+// Prunes A to a range of densities (unstructured, each entry kept with that
+// probability) and runs it as CSR and as 4x4 BSR against the dense tiled and
+// packed kernels, which cost the same at any density, and SpMV against GEMV
+// on the first column of B. BSR is also run on A pruned in whole 4x4 blocks,
+// the structure it is meant for. GFLOPS count the dense operations, so they
+// show the effective speedup; speedups are against the parallel packed GEMM
+// / GEMV, and footprints against dense A.
+void test_sparse(const Shape &shape, uint32_t warmups, uint32_t repeats,
+                 std::vector<BenchmarkResult> &results) {
+  using support::BsrMatrix;
+  using support::CsrMatrix;
+
+  Operands ops(shape);
+  Shape gemvShape = {shape.M, 1, shape.K};
+  Matrix<float> y(1, shape.M);
+  Matrix<float> goldenY(1, shape.M);
+  MatrixView<const float> x = ops.B.block(0, 0, shape.K, 1);
+  support::reference_matmul(ops.A, x, goldenY);
+
+  auto dense = [&](const std::string &name, const Shape &variant,
+                   MatrixView<const float> result,
+                   MatrixView<const float> expected, auto &&fn) {
+    BenchmarkResult bench =
+        timeVariant("sparse: dense " + name, variant, warmups, repeats, fn);
+    check(bench, support::max_error(result, expected));
+    results.push_back(bench);
+    return bench.stats.median_us;
+  };
+  dense("tiled_ijk_matmul_kij<32>", shape, ops.C, ops.golden, [&] {
+    algo::naive::tiled_ijk_matmul_kij<float, 32, 32, 32>(ops.A, ops.B, ops.C);
+  });
+  double packedUs =
+      dense("parallel packed_matmul", shape, ops.C, ops.golden,
+            [&] { algo::parallel::packed_matmul(ops.A, ops.B, ops.C); });
+  double gemvUs = dense("gemv", gemvShape, y, goldenY,
+                        [&] { algo::gemv::gemv(ops.A, x, y); });
+
+  // An entry (or 4x4 block) is kept while its draw is below the density, so
+  // each density keeps a superset of the sparser ones
+  Matrix<float> draws(shape.K, shape.M);
+  Matrix<float> blockDraws((shape.K + 3) / 4, (shape.M + 3) / 4);
+  support::random_fill(draws, SEED_C + 1);
+  support::random_fill(blockDraws, SEED_C + 2);
+  Matrix<float> pruned(shape.K, shape.M);
+  Matrix<float> blockPruned(shape.K, shape.M);
+  Matrix<float> golden(shape.N, shape.M);
+  Matrix<float> blockGolden(shape.N, shape.M);
+  for (double density : {0.01, 0.05, 0.1, 0.2, 0.5}) {
+    for (uint32_t i = 0; i < shape.M; i++) {
+      for (uint32_t k = 0; k < shape.K; k++) {
+        pruned.a(i, k) = draws.r(i, k) < density ? ops.A.r(i, k) : 0.0f;
+      }
+    }
+    for (uint32_t i0 = 0; i0 < shape.M; i0 += 4) {
+      for (uint32_t k0 = 0; k0 < shape.K; k0 += 4) {
+        bool keep = blockDraws.r(i0 / 4, k0 / 4) < density;
+        for (uint32_t i = i0; i < std::min(i0 + 4, shape.M); i++) {
+          for (uint32_t k = k0; k < std::min(k0 + 4, shape.K); k++) {
+            blockPruned.a(i, k) = keep ? ops.A.r(i, k) : 0.0f;
+          }
+        }
+      }
+    }
+    support::reference_matmul(pruned, ops.B, golden);
+    support::reference_matmul(blockPruned, ops.B, blockGolden);
+    support::reference_matmul(pruned, x, goldenY);
+    CsrMatrix<float> csr = CsrMatrix<float>::from_dense(pruned);
+    BsrMatrix<float, 4, 4> bsr = BsrMatrix<float, 4, 4>::from_dense(pruned);
+    BsrMatrix<float, 4, 4> blockBsr =
+        BsrMatrix<float, 4, 4>::from_dense(blockPruned);
+    double denseBytes = double(shape.M) * shape.K * sizeof(float);
+
+    auto report = [&](const std::string &name, const Shape &variant,
+                      double dense_us, double bytes, double stored_nonzero,
+                      MatrixView<const float> result,
+                      MatrixView<const float> expected, auto &&fn) {
+      BenchmarkResult bench = timeVariant(
+          "sparse " + std::to_string(int(100 * density)) + "%: " + name,
+          variant, warmups, repeats, fn);
+      check(bench, support::max_error(result, expected));
+      bench.extra = {{"density", csr.density()},
+                     {"speedup_vs_dense", dense_us / bench.stats.median_us},
+                     {"bytes_pct_of_dense", 100 * bytes / denseBytes},
+                     {"stored_nonzero_pct", 100 * stored_nonzero}};
+      results.push_back(bench);
+    };
+
+    report("csr spmm", shape, packedUs, csr.bytes(), 1, ops.C, golden,
+           [&] { algo::sparse::spmm(csr, ops.B, ops.C); });
+    report("bsr 4x4 spmm", shape, packedUs, bsr.bytes(), bsr.fill(), ops.C,
+           golden, [&] { algo::sparse::spmm(bsr, ops.B, ops.C); });
+    report("csr spmv", gemvShape, gemvUs, csr.bytes(), 1, y, goldenY,
+           [&] { algo::sparse::spmv(csr, x, y); });
+    report("bsr 4x4 spmm, 4x4 block pruned", shape, packedUs,
+           blockBsr.bytes(), blockBsr.fill(), ops.C, blockGolden,
+           [&] { algo::sparse::spmm(blockBsr, ops.B, ops.C); });
+  }
+}
+
+// Times the parallel packed GEMM on the CPUs of the first 1, 2, ... NUMA
+// nodes (workers are pinned node by node) for each page placement of the
+// operands. "default" fills them from the calling thread, so all their pages
+// sit on its node; "first-touch" puts each worker's band of A and C rows on
+// its node and interleaves B, which every worker reads; "interleave" spreads
+// all three. Speedups are against the first node alone.
+void test_numa(const Shape &shape, uint32_t warmups, uint32_t repeats,
+               std::vector<BenchmarkResult> &results) {
+  using support::Placement;
+  const std::vector<support::NumaNode> &nodes = support::numa_nodes();
+  uint32_t poolSize = support::ThreadPool::global().size();
+
+  for (const support::NumaNode &node : nodes) {
+    std::cerr << "NUMA node " << node.id << ": " << node.cpus.size()
+              << " cpus" << (node.has_memory ? "" : ", no memory")
+              << std::endl;
+  }
+
+  Matrix<float> golden = Operands(shape).golden.copy();
+
+  for (Placement placement : {Placement::DEFAULT, Placement::FIRST_TOUCH,
+                              Placement::INTERLEAVE}) {
+    support::AllocPolicy policy, policyB;
+    policy.placement = placement;
+    policyB.placement = placement == Placement::FIRST_TOUCH
+                            ? Placement::INTERLEAVE
+                            : placement;
+    Matrix<float> matA(shape.K, shape.M, policy);
+    Matrix<float> matB(shape.N, shape.K, policyB);
+    Matrix<float> matC(shape.N, shape.M, policy);
+    uint32_t fillThreads = placement == Placement::DEFAULT ? 1 : 0;
+    support::random_fill(matA, SEED_A, 0, 1, fillThreads);
+    support::random_fill(matB, SEED_B, 0, 1, fillThreads);
+    support::random_fill(matC, SEED_C, 0, 1, fillThreads);
+
+    uint32_t threads = 0;
+    double firstNodeUs = 0;
+    for (uint32_t n = 0; n < nodes.size() && threads < poolSize; n++) {
+      if (nodes[n].cpus.empty()) {
+        continue;
+      }
+      threads = std::min<uint32_t>(threads + nodes[n].cpus.size(), poolSize);
+      BenchmarkResult result = timeVariant(
+          std::string("numa ") + support::placement_name(placement) + ": " +
+              std::to_string(n + 1) + " node(s)",
+          shape, warmups, repeats, [&] {
+            algo::parallel::packed_matmul_threads(matA, matB, matC, threads);
+          });
+      check(result, support::max_error(matC, golden));
+      firstNodeUs = firstNodeUs == 0 ? result.stats.median_us : firstNodeUs;
+      result.extra = {{"threads", threads},
+                      {"speedup_vs_1_node",
+                       firstNodeUs / result.stats.median_us}};
+      results.push_back(result);
+    }
+  }
+}
+
+// Resident set size in bytes, from /proc/self/statm
+size_t residentBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+// Writes B to a matrix file in dir, maps it and multiplies it by K panels
+// with algo::streaming against the packed GEMM on B in memory, which is
+// skipped when B would take more than half of RAM. Cold runs first drop the
+// file from the page cache, so B comes from disk. GB/s is B read per second,
+// and the resident growth shows how much of B stays mapped after a run. The
+// golden C sums the reference over the same K panels, so B is read once. The
+// file is removed afterwards unless `keep` is set.
+void test_streaming(const Shape &shape, const std::string &dir, bool keep,
+                    uint32_t warmups, uint32_t repeats,
+                    std::vector<BenchmarkResult> &results) {
+  std::string path = dir + "/stream_B_" + std::to_string(shape.N) + "x" +
+                     std::to_string(shape.K) + ".mat";
+  Matrix<float> matA(shape.K, shape.M);
+  Matrix<float> matC(shape.N, shape.M);
+  Matrix<float> golden(shape.N, shape.M);
+  Matrix<float> partial(shape.N, shape.M);
+  support::random_fill(matA, SEED_A);
+  {
+    Matrix<float> written =
+        support::create_matrix_file<float>(path, shape.N, shape.K);
+    support::random_fill(written, SEED_B);
+  }
+  const Matrix<float> matB = support::map_matrix_file<float>(path);
+  uint32_t panelRows = uint32_t(std::max<size_t>(
+      (size_t(64) << 20) / (size_t(matB.get_stride()) * sizeof(float)), 1));
+  for (uint32_t k0 = 0; k0 < shape.K; k0 += panelRows) {
+    uint32_t rows = std::min(panelRows, shape.K - k0);
+    support::reference_matmul(matA.block(0, k0, shape.M, rows),
+                              matB.view().block(k0, 0, rows, shape.N),
+                              k0 == 0 ? golden.view() : partial.view());
+    for (uint32_t i = 0; k0 > 0 && i < shape.M; i++) {
+      for (uint32_t j = 0; j < shape.N; j++) {
+        golden.a(i, j) += partial.r(i, j);
+      }
+    }
+  }
+
+  double bBytes = double(matB.get_stride()) * shape.K * sizeof(float);
+  std::cerr << "Streaming B " << bBytes / (1 << 20) << " MB mapped from "
+            << path << std::endl;
+
+  auto evict = [&] {
+    // Written back first, the page cache only drops clean pages
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  };
+
+  auto report = [&](const std::string &name, auto &&fn) {
+    BenchmarkResult result =
+        timeVariant("streaming: " + name, shape, warmups, repeats, fn);
+    size_t before = residentBytes();
+    fn();
+    size_t after = residentBytes();
+    check(result, support::max_error(matC, golden));
+    result.extra = {
+        {"b_gbs", bBytes / result.stats.median_us / 1e3},
+        {"resident_mb",
+         double(after > before ? after - before : 0) / (1 << 20)}};
+    results.push_back(result);
+  };
+
+  size_t ram = size_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+  if (bBytes < ram / 2) {
+    Matrix<float> heapB = matB.copy();
+    report("packed_matmul, B in memory",
+           [&] { algo::parallel::packed_matmul(matA, heapB, matC); });
+  }
+  for (size_t panel : {size_t(16) << 20, size_t(64) << 20}) {
+    std::string size = std::to_string(panel >> 20) + " MB panels";
+    report("streamed, " + size + ", cached", [&] {
+      algo::streaming::streamed_matmul(matA, matB, matC, panel);
+    });
+    report("streamed, " + size + ", cold", [&] {
+      evict();
+      algo::streaming::streamed_matmul(matA, matB, matC, panel);
+    });
+  }
+  if (!keep) {
+    unlink(path.c_str());
+  }
+}
+
+// Runs Strassen-Winograd with a range of cutoffs next to the classical tiled
+// and packed kernels. GFLOPS count the classical 2 * M * N * K operations, so
+// they show the effective speedup, and errors are against the reference.
+// The fastest row per shape gives the crossover on this machine.
+void test_strassen(const Shape &shape, uint32_t warmups, uint32_t repeats,
+                   std::vector<BenchmarkResult> &results) {
+  Operands ops(shape);
+
+  auto report = [&](const std::string &name, auto &&fn) {
+    BenchmarkResult result =
+        timeVariant("strassen: " + name, shape, warmups, repeats, fn);
+    check(result, support::max_error(ops.C, ops.golden));
+    results.push_back(result);
+  };
+
+  report("tiled_ijk_matmul_kij<32>", [&] {
+    algo::naive::tiled_ijk_matmul_kij<float, 32, 32, 32>(ops.A, ops.B, ops.C);
+  });
+  report("packed_matmul",
+         [&] { algo::packed::packed_matmul(ops.A, ops.B, ops.C); });
+  report("strassen cutoff 128", [&] {
+    algo::strassen::strassen_matmul<128>(ops.A, ops.B, ops.C);
+  });
+  report("strassen cutoff 256", [&] {
+    algo::strassen::strassen_matmul<256>(ops.A, ops.B, ops.C);
+  });
+  report("strassen cutoff 512", [&] {
+    algo::strassen::strassen_matmul<512>(ops.A, ops.B, ops.C);
+  });
+  report("strassen cutoff 1024", [&] {
+    algo::strassen::strassen_matmul<1024>(ops.A, ops.B, ops.C);
+  });
+}
+
+// Serving load: one client thread keeps issuing `shape` GEMMs while `clients`
+// - 1 others issue 64^3 ones, each waiting for its result before the next.
+// "sync" calls the parallel GEMM directly, so every call queues for the pool
+// in arrival order; "queued" submits to an algo::async::GemmQueue, which
+// batches the small jobs and lets them pass the large ones. Timings are the
+// large calls' latencies, with the small ones' in extra, GFLOPS are over the
+// whole run, and the last result of every client is checked. With a one
+// worker pool the sync calls run on their own threads and the OS interleaves
+// them, so the comparison only says something with several workers. Then a
+// chain of three layers X1 = A @ W1, X2 = X1 @ W2, X3 = X2 @ W3 goes through
+// the queue next to independent jobs, each layer released by its input's
+// token.
+void test_async(const Shape &shape, uint32_t clients, uint32_t repeats,
+                std::vector<BenchmarkResult> &results) {
+  using Clock = std::chrono::steady_clock;
+  const uint32_t small = 64, smallPerLarge = 16;
+
+  Operands large(shape), smallOps({small, small, small});
+
+  // matmul(A, B, C) runs one GEMM and returns once C is written
+  auto report = [&](const std::string &name, auto &&matmul) {
+    std::vector<Matrix<float>> outputs;
+    outputs.emplace_back(shape.N, shape.M);
+    for (uint32_t c = 1; c < clients; c++) {
+      outputs.emplace_back(small, small);
+    }
+    std::vector<std::vector<double>> latencies(clients);
+
+    auto client = [&](uint32_t c) {
+      bool isLarge = c == 0;
+      uint32_t calls = isLarge ? repeats : repeats * smallPerLarge;
+      for (uint32_t i = 0; i < calls; i++) {
+        auto start = Clock::now();
+        if (isLarge) {
+          matmul(large.A, large.B, outputs[c]);
+        } else {
+          matmul(smallOps.A, smallOps.B, outputs[c]);
+        }
+        latencies[c].push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - start)
+                .count());
+      }
+    };
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t c = 0; c < clients; c++) {
+      threads.emplace_back(client, c);
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    double wallUs =
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count();
+
+    std::vector<double> smallUs;
+    double error = support::max_error(outputs[0], large.golden);
+    for (uint32_t c = 1; c < clients; c++) {
+      smallUs.insert(smallUs.end(), latencies[c].begin(), latencies[c].end());
+      error = std::max(error, support::max_error(outputs[c], smallOps.golden));
+    }
+    support::TimingStats smallStats = support::summarize(smallUs);
+    double flop = 2.0 * shape.M * shape.N * shape.K * repeats +
+                  2.0 * small * small * small * smallUs.size();
+    BenchmarkResult result =
+        makeResult("async: " + name, shape, 0, repeats,
+                   support::summarize(latencies[0]), 0);
+    result.gflops = flop / wallUs / 1e3;
+    check(result, error);
+    result.extra = {{"clients", clients},
+                    {"small_p50_us", smallStats.median_us},
+                    {"small_p99_us", smallStats.p99_us}};
+    results.push_back(result);
+  };
+
+  report("sync", [](MatrixView<const float> A, MatrixView<const float> B,
+                    MatrixView<float> C) {
+    algo::parallel::packed_matmul(A, B, C);
+  });
+  {
+    algo::async::GemmQueue queue;
+    report("queued", [&](MatrixView<const float> A, MatrixView<const float> B,
+                         MatrixView<float> C) { queue.submit(A, B, C).wait(); });
+  }
 
-  uint64_t us_kij = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::naive_matmul_kij<float>);
-  std::cout << "\tnaive_matmul_kij (us): " << us_kij << std::endl;
+  // Square layers keep every X the shape of A
+  Matrix<float> W1(shape.K, shape.K), W2(shape.K, shape.K);
+  Matrix<float> W3(shape.K, shape.K);
+  Matrix<float> X1(shape.K, shape.M), X2(shape.K, shape.M);
+  Matrix<float> X3(shape.K, shape.M);
+  Matrix<float> G1(shape.K, shape.M), G2(shape.K, shape.M);
+  Matrix<float> G3(shape.K, shape.M);
+  // Scaled by 1 / K so the activations stay near 1 through the chain
+  float scale = 2.0f / std::max(shape.K, 1u);
+  support::random_fill(W1, SEED_B, 0, scale);
+  support::random_fill(W2, SEED_B + 1, 0, scale);
+  support::random_fill(W3, SEED_B + 2, 0, scale);
+  support::reference_matmul(large.A, W1, G1);
+  support::reference_matmul(G1, W2, G2);
+  support::reference_matmul(G2, W3, G3);
 
-  uint64_t us_tiled8ijk_inner_ijk = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::tiled_ijk_matmul_ijk<float, 8, 8, 8>);
-  std::cout << "\tiled_ijk_matmul_ijk<float, 8, 8, 8> (us): "
-            << us_tiled8ijk_inner_ijk << std::endl;
+  std::vector<Matrix<float>> sides;
+  for (uint32_t i = 0; i < 2 * smallPerLarge; i++) {
+    sides.emplace_back(small, small);
+  }
+  auto start = Clock::now();
+  {
+    algo::async::GemmQueue queue;
+    algo::async::Token t1 = queue.submit(large.A, W1, X1);
+    algo::async::Token t2 = queue.submit(X1, W2, X2, {t1});
+    for (Matrix<float> &side : sides) {
+      queue.submit(smallOps.A, smallOps.B, side);
+    }
+    queue.submit(X2, W3, X3, {t2}).wait();
+    queue.wait_all();
+  }
+  double chainUs =
+      std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+  double error = support::max_error(X3, G3);
+  for (const Matrix<float> &side : sides) {
+    error = std::max(error, support::max_error(side, smallOps.golden));
+  }
+  Shape layer = {shape.M, shape.K, shape.K};
+  BenchmarkResult result = makeResult(
+      "async: chain of 3 with " + std::to_string(sides.size()) +
+          " small jobs alongside",
+      layer, 0, 1, support::summarize({chainUs}),
+      3 * 2.0 * shape.M * shape.K * shape.K +
+          sides.size() * 2.0 * small * small * small);
+  check(result, error);
+  results.push_back(result);
+}
 
-  uint64_t us_tiled16_ijk_inner_ijk = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::tiled_ijk_matmul_ijk<float, 16, 16, 16>);
-  std::cout << "\tiled_ijk_matmul_ijk<float, 16, 16, 16> (us): "
-            << us_tiled16_ijk_inner_ijk << std::endl;
+// D = A @ B + C and y = A @ B @ x written by hand, with a temporary Matrix
+// for the product and a separate pass for the sum, against the same
+// expressions through algo::expr, which folds C into the GEMM's beta and
+// multiplies the chain as A @ (B @ x). GFLOPS of the chain count the left to
+// right flops, so they show the effective speedup of the reordering.
+void test_expression(const Shape &shape, uint32_t warmups, uint32_t repeats,
+                     std::vector<BenchmarkResult> &results) {
+  using namespace algo::expr;
 
-  uint64_t us_tiled32_ijk_inner_ijk = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::tiled_ijk_matmul_ijk<float, 32, 32, 32>);
-  std::cout << "\tiled_ijk_matmul_ijk<float, 32, 32, 32> (us): "
-            << us_tiled32_ijk_inner_ijk << std::endl;
+  Operands ops(shape);
+  Matrix<float> matD(shape.N, shape.M);
+  Matrix<float> golden(shape.N, shape.M);
+  Matrix<float> x(1, shape.N), y(1, shape.M), goldenY(1, shape.M);
+  support::random_fill(ops.C, SEED_C);
+  support::random_fill(x, SEED_C + 1);
+  support::reference_matmul(ops.golden, x, goldenY);
+  for (uint32_t i = 0; i < shape.M; i++) {
+    for (uint32_t j = 0; j < shape.N; j++) {
+      golden.a(i, j) = ops.golden.r(i, j) + ops.C.r(i, j);
+    }
+  }
 
-  uint64_t us_tiled8_ijk_inner_kij = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::tiled_ijk_matmul_kij<float, 8, 8, 8>);
-  std::cout << "\tiled_ijk_matmul_kij<float, 8, 8, 8> (us): "
-            << us_tiled8_ijk_inner_kij << std::endl;
+  auto report = [&](const std::string &name, double flop,
+                    const Matrix<float> &result, const Matrix<float> &expected,
+                    auto &&fn) {
+    BenchmarkResult bench = timeVariant("expression: " + name, shape, warmups,
+                                        repeats, fn, flop);
+    check(bench, support::max_error(result, expected));
+    results.push_back(bench);
+    return &results.back();
+  };
 
-  uint64_t us_tiled16_ijk_inner_kij = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::tiled_ijk_matmul_kij<float, 16, 16, 16>);
-  std::cout << "\tiled_ijk_matmul_kij<float, 16, 16, 16> (us): "
-            << us_tiled16_ijk_inner_kij << std::endl;
+  double flop = 2.0 * shape.M * shape.N * shape.K;
+  report("D = A @ B + C by hand", flop, matD, golden, [&] {
+    Matrix<float> product(shape.N, shape.M);
+    algo::parallel::packed_matmul(ops.A, ops.B, product);
+    for (uint32_t i = 0; i < shape.M; i++) {
+      for (uint32_t j = 0; j < shape.N; j++) {
+        matD.a(i, j) = product.r(i, j) + ops.C.r(i, j);
+      }
+    }
+  });
+  report("into(D) = A * B + C", flop, matD, golden,
+         [&] { into(matD) = ops.A * ops.B + ops.C; });
 
-  uint64_t us_tiled32_ijk_inner_kij = benchmark_get_us<warmups, repeats>(
-      matA, matB, matC, algo::naive::tiled_ijk_matmul_kij<float, 32, 32, 32>);
-  std::cout << "\tiled_ijk_matmul_kij<float, 32, 32, 32> (us): "
-            << us_tiled32_ijk_inner_kij << std::endl;
+  ChainPlan plan = plan_chain({shape.M, shape.K, shape.N, 1});
+  double leftToRight = flop + 2.0 * shape.M * shape.N;
+  report("y = (A @ B) @ x by hand", leftToRight, y, goldenY, [&] {
+    Matrix<float> product(shape.N, shape.M);
+    algo::parallel::packed_matmul(ops.A, ops.B, product);
+    algo::parallel::packed_matmul(product, x, y);
+  });
+  BenchmarkResult *planned =
+      report("into(y) = A * B * x as " + plan.describe({"A", "B", "x"}),
+             leftToRight, y, goldenY, [&] { into(y) = ops.A * ops.B * x; });
+  planned->extra = {{"planned_flops", double(plan.flops)},
+                    {"left_to_right_flops", leftToRight}};
+}
+
+// ResNet-50 convolutions in both layouts: the whole im2col matrix in a Matrix
+// followed by tiled_ijk_matmul_kij or the packed GEMM, as callers had to do
+// it, against algo::conv::conv2d unfolding tiles into workspace and gathering
+// patches straight into the packed panels. M, N and K are those of the GEMM
+// over the whole batch. Scratch is the unfolded data held at once; errors are
+// against the direct convolution.
+void test_conv(uint32_t batch, uint32_t warmups, uint32_t repeats,
+               std::vector<BenchmarkResult> &results) {
+  using algo::conv::Conv2dShape;
+  using algo::conv::ConvMode;
+  using algo::conv::Layout;
+
+  struct Layer {
+    const char *name;
+    uint32_t channels, size, filters, kernel, stride, pad;
+  };
+  const Layer layers[] = {
+      {"conv1 7x7/2", 3, 224, 64, 7, 2, 3},
+      {"res2 1x1", 256, 56, 64, 1, 1, 0},
+      {"res2 3x3", 64, 56, 64, 3, 1, 1},
+      {"res3 3x3/2", 128, 56, 128, 3, 2, 1},
+      {"res3 3x3", 128, 28, 128, 3, 1, 1},
+      {"res4 3x3", 256, 14, 256, 3, 1, 1},
+      {"res5 3x3", 512, 7, 512, 3, 1, 1},
+  };
+
+  for (const Layer &layer : layers) {
+    for (Layout layout : {Layout::NCHW, Layout::NHWC}) {
+      Conv2dShape shape;
+      shape.batch = batch;
+      shape.channels = layer.channels;
+      shape.height = shape.width = layer.size;
+      shape.filters = layer.filters;
+      shape.kernel_h = shape.kernel_w = layer.kernel;
+      shape.stride_h = shape.stride_w = layer.stride;
+      shape.pad_h = shape.pad_w = layer.pad;
+      shape.layout = layout;
+      uint32_t K = shape.patch(), P = shape.pixels();
+      bool nchw = layout == Layout::NCHW;
+      Shape gemm = {layer.filters, P * batch, K};
+
+      Matrix<float> input(shape.input_size(), 1);
+      Matrix<float> weights(K, shape.filters);
+      Matrix<float> output(shape.output_size(), 1);
+      Matrix<float> golden(shape.output_size(), 1);
+      support::random_fill(input, SEED_A);
+      support::random_fill(weights, SEED_B);
+      algo::conv::conv2d_reference(shape, input.data(), weights, golden.data());
+
+      auto report = [&](const std::string &name, double scratchBytes,
+                        auto &&fn) {
+        std::fill(output.data(), output.data() + output.get_stride(), 0.0f);
+        BenchmarkResult result = timeVariant(
+            std::string("conv ") + layer.name + (nchw ? " NCHW: " : " NHWC: ") +
+                name,
+            gemm, warmups, repeats, fn, shape.flops());
+        check(result, support::max_error(output, golden));
+        result.extra = {{"batch", batch},
+                        {"scratch_mb", scratchBytes / (1 << 20)}};
+        results.push_back(result);
+      };
+
+      // Image n's [filters, P] (NCHW) or [P, filters] (NHWC) block of output
+      auto outputOf = [&](uint32_t n) {
+        return nchw ? MatrixView<float>(output.data() + size_t(n) * P *
+                                                            shape.filters,
+                                        P, shape.filters, P)
+                    : MatrixView<float>(output.data() + size_t(n) * P *
+                                                            shape.filters,
+                                        shape.filters, P, shape.filters);
+      };
+      auto unfolded = [&](auto &&matmul) {
+        Matrix<float> cols = nchw ? Matrix<float>(P, K) : Matrix<float>(K, P);
+        for (uint32_t n = 0; n < batch; n++) {
+          algo::conv::im2col(shape, input.data(), n, cols);
+          if (nchw) {
+            matmul(weights.view(), cols.view(), outputOf(n));
+          } else {
+            matmul(cols.view(), weights.view().t(), outputOf(n));
+          }
+        }
+      };
+      double colsBytes = double(K) * P * sizeof(float);
+
+      if (shape.flops() < 1e9) {
+        report("im2col Matrix + tiled_ijk_matmul_kij<32>", colsBytes, [&] {
+          unfolded([](MatrixView<const float> A, MatrixView<const float> B,
+                      MatrixView<float> C) {
+            algo::naive::tiled_ijk_matmul_kij<float, 32, 32, 32>(A, B, C);
+          });
+        });
+      }
+      report("im2col Matrix + packed_matmul", colsBytes, [&] {
+        unfolded([](MatrixView<const float> A, MatrixView<const float> B,
+                    MatrixView<float> C) {
+          algo::parallel::packed_matmul(A, B, C);
+        });
+      });
+      double tileBytes = shape.is_pointwise()
+                             ? 0
+                             : std::min<double>(
+                                   colsBytes * (nchw ? 1 : batch),
+                                   std::max<double>(
+                                       algo::conv::IM2COL_TILE_BYTES,
+                                       16.0 * K * sizeof(float)));
+      report("conv2d im2col tiles", tileBytes, [&] {
+        algo::conv::conv2d(shape, input.data(), weights, output.data(),
+                           nullptr, algo::epilogue::Activation::NONE,
+                           ConvMode::IM2COL);
+      });
+      report("conv2d implicit GEMM", 0, [&] {
+        algo::conv::conv2d(shape, input.data(), weights, output.data(),
+                           nullptr, algo::epilogue::Activation::NONE,
+                           ConvMode::IMPLICIT);
+      });
+    }
+  }
 }
 
 void example_simple() {
@@ -96,19 +1360,19 @@ void example_simple() {
   Matrix<float> matB(32, 32);
   Matrix<float> matC(32, 32);
 
-  randomInitFloatMatrix(matA);
-  randomInitFloatMatrix(matB);
-  randomInitFloatMatrix(matC);
+  support::random_fill(matA, SEED_A);
+  support::random_fill(matB, SEED_B);
+  support::random_fill(matC, SEED_C);
   std::cout << "Matrix A: " << std::endl;
   std::cout << matA << std::endl;
   std::cout << "Matrix B: " << std::endl;
   std::cout << matB << std::endl;
 
-  algo::naive::naive_matmul_ijk(matA, matB, matC);
+  algo::naive::naive_matmul_ijk<float>(matA, matB, matC);
   std::cout << "Matrix C naive inner product: " << std::endl;
   std::cout << matC << std::endl;
 
-  algo::naive::naive_matmul_kij(matA, matB, matC);
+  algo::naive::naive_matmul_kij<float>(matA, matB, matC);
   std::cout << "Matrix C naive outer product: " << std::endl;
   std::cout << matC << std::endl;
 
@@ -119,14 +1383,208 @@ void example_simple() {
   algo::naive::tiled_ijk_matmul_kij<float, 16, 16, 16>(matA, matB, matC);
   std::cout << "Matrix C tiled ijk inner kij product: " << std::endl;
   std::cout << matC << std::endl;
+
+  algo::packed::packed_matmul(matA, matB, matC);
+  std::cout << "Matrix C packed 6x16 micro-kernel product: " << std::endl;
+  std::cout << matC << std::endl;
+
+  // Views multiply sub-blocks and transposes in place, without copies
+  Matrix<float> matD(16, 16);
+  algo::packed::packed_matmul(matA.t().block(0, 0, 16, 16),
+                              matB.block(8, 8, 16, 16), matD);
+  std::cout << "Matrix D = A^T[0:16, 0:16] @ B[8:24, 8:24] through views: "
+            << std::endl;
+  std::cout << matD << std::endl;
 }
 
-int main() {
-  example_simple();
+int main(int argc, char **argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  KernelRegistry &registry = KernelRegistry::global();
+  registerKernels(registry);
+
+  if (options.list) {
+    for (const KernelEntry &kernel : registry.kernels()) {
+      std::cout << kernel.name << std::endl;
+    }
+    return 0;
+  }
+
+  std::cerr << "Kernels: " << support::isa_name(support::active_isa())
+            << std::endl;
+
+  // Opened before the thread pool spawns its workers so they are counted too
+  std::unique_ptr<PerfCounters> counters;
+  if (options.counters) {
+    counters.reset(new PerfCounters());
+    if (!counters->any_available()) {
+      std::cerr << "perf_event_open counters unavailable (check "
+                   "/proc/sys/kernel/perf_event_paranoid), timing only"
+                << std::endl;
+      counters.reset();
+    }
+  }
+
+  if (options.pin || options.numa) {
+    support::ThreadPool &pool = support::ThreadPool::global();
+    bool pinned = support::pin_workers(pool);
+    std::cerr << (pinned ? "Pinned " : "Could not pin ") << pool.size()
+              << " workers over " << support::numa_nodes().size()
+              << " NUMA node(s)" << std::endl;
+  }
+
+  support::MachinePeak peak;
+  if (options.roofline) {
+    peak = support::load_or_calibrate(options.calibration, options.recalibrate);
+    std::cerr << "Machine: " << peak << std::endl;
+  }
+
+  algo::autotune::Dispatcher &tuner = algo::autotune::Dispatcher::global();
+  tuner.load(options.tuning_db);
+  if (options.tune) {
+    for (const Shape &shape : options.shapes) {
+      std::cerr << "Tuning " << shape.M << "x" << shape.N << "x" << shape.K
+                << std::endl;
+      auto best = tuner.tune(shape.M, shape.N, shape.K, options.repeats, true);
+      std::cerr << "\tbest: " << best.kernel << " (" << best.median_us
+                << " us)" << std::endl;
+    }
+    if (!tuner.save(options.tuning_db)) {
+      std::cerr << "could not write " << options.tuning_db << std::endl;
+    }
+  }
 
-  test_conditions<256, 256, 256, 1, 10>();
-  test_conditions<512, 512, 512, 1, 10>();
-  test_conditions<1024, 1024, 1024, 1, 10>();
+  if (options.example) {
+    example_simple();
+  }
 
-  return 0;
-}
\ No newline at end of file
+  std::vector<const KernelEntry *> kernels = registry.match(options.kernels);
+  // Text goes out as each kernel or mode finishes, csv/json once everything
+  // has run
+  bool stream_text =
+      options.format == ReportFormat::TEXT && options.output.empty();
+
+  std::vector<BenchmarkResult> results;
+  bool all_correct = true;
+  size_t reported = 0;
+  auto report = [&] {
+    for (; reported < results.size(); reported++) {
+      all_correct &= results[reported].correct;
+      if (stream_text) {
+        support::write_report(std::cout, {results[reported]}, options.format);
+      }
+    }
+  };
+
+  for (const Shape &shape : options.shapes) {
+    // Matrix takes (width, height): A is [M, K], B is [K, N], C is [M, N]
+    std::string suffix = std::to_string(shape.M) + "x" +
+                         std::to_string(shape.N) + "x" +
+                         std::to_string(shape.K);
+    Matrix<float> matA =
+        inputMatrix(options.data, "A_" + suffix, shape.K, shape.M, SEED_A);
+    Matrix<float> matB =
+        inputMatrix(options.data, "B_" + suffix, shape.N, shape.K, SEED_B);
+    Matrix<float> matC(shape.N, shape.M);
+    Matrix<float> golden(shape.N, shape.M);
+
+    support::reference_matmul(matA, matB, golden);
+
+    for (const KernelEntry *kernel : kernels) {
+      support::random_fill(matC, SEED_C);
+      results.push_back(support::run_benchmark(*kernel, matA, matB, matC,
+                                               golden, options.warmups,
+                                               options.repeats,
+                                               counters.get()));
+      if (options.roofline) {
+        BenchmarkResult &result = results.back();
+        for (const auto &metric :
+             support::roofline_metrics(peak, shape.M, shape.N, shape.K,
+                                       result.gflops, kernel->parallel)) {
+          result.extra.push_back(metric);
+        }
+      }
+      report();
+    }
+  }
+
+  // Each mode runs over every shape
+  auto forShapes = [&](bool enabled, auto &&test) {
+    if (!enabled) {
+      return;
+    }
+    for (const Shape &shape : options.shapes) {
+      test(shape);
+      report();
+    }
+  };
+  uint32_t warmups = options.warmups, repeats = options.repeats;
+
+  forShapes(options.scaling, [&](const Shape &shape) {
+    test_scaling(shape, warmups, repeats, results);
+  });
+
+  if (options.fixed) {
+    test_fixed<4>(warmups, repeats, results);
+    test_fixed<8>(warmups, repeats, results);
+    test_fixed<16>(warmups, repeats, results);
+    test_fixed<32>(warmups, repeats, results);
+    report();
+  }
+
+  forShapes(options.half, [&](const Shape &shape) {
+    test_half(shape, warmups, repeats, results);
+  });
+  forShapes(options.int8, [&](const Shape &shape) {
+    test_int8(shape, warmups, repeats, results);
+  });
+  forShapes(options.epilogue, [&](const Shape &shape) {
+    test_epilogue(shape, warmups, repeats, results);
+  });
+  forShapes(options.expression, [&](const Shape &shape) {
+    test_expression(shape, warmups, repeats, results);
+  });
+  forShapes(options.sparse, [&](const Shape &shape) {
+    test_sparse(shape, warmups, repeats, results);
+  });
+  forShapes(options.numa, [&](const Shape &shape) {
+    test_numa(shape, warmups, repeats, results);
+  });
+  forShapes(options.stream, [&](const Shape &shape) {
+    test_streaming(shape,
+                   options.data.empty() ? options.binary_dir : options.data,
+                   !options.data.empty(), warmups, repeats, results);
+  });
+  forShapes(options.strassen, [&](const Shape &shape) {
+    test_strassen(shape, warmups, repeats, results);
+  });
+  forShapes(options.async > 0, [&](const Shape &shape) {
+    test_async(shape, options.async, repeats, results);
+  });
+
+  if (options.conv > 0) {
+    test_conv(options.conv, warmups, repeats, results);
+    report();
+  }
+
+  if (options.batched > 0) {
+    for (uint32_t size : {64, 96, 128}) {
+      test_batched({size, size, size}, options.batched, warmups, repeats,
+                   results);
+    }
+    report();
+  }
+
+  if (!options.output.empty()) {
+    std::ofstream file(options.output);
+    support::write_report(file, results, options.format);
+  } else if (!stream_text) {
+    support::write_report(std::cout, results, options.format);
+  }
+
+  return all_correct ? 0 : 2;
+}